@@ -0,0 +1,98 @@
+#ifndef PROPLINK_BRIDGE_H_
+#define PROPLINK_BRIDGE_H_
+
+#include <string>
+#include <unordered_map>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include "client.h"
+
+namespace proplink {
+
+// Direction of a mapping of Bridge.
+enum class BridgeDirection {
+  AToB = 0,
+  BToA = 1
+};
+
+// Copies variables between two Servers A and B, driven by the subscription stream of the source side.
+// Updates are sent to the destination with write combining, so that a burst of changes costs one BATCH.
+// A value the bridge wrote to a server is not copied back when that server publishes it shortly after, so that
+// mappings in both directions don't loop.
+// e.g. Bridge bridge(...); bridge.MapPrefix("plc/", "hmi/plc/").MapVariable("hmi/setpoint", "setpoint", BridgeDirection::BToA);
+class Bridge {
+public:
+  // @brief Constructs a bridge with the endpoints of both servers.
+  // @param a_dealer_endpoint The router endpoint of server A.
+  // @param a_sub_endpoint The publisher endpoint of server A.
+  // @param b_dealer_endpoint The router endpoint of server B.
+  // @param b_sub_endpoint The publisher endpoint of server B.
+  Bridge(const std::string& a_dealer_endpoint, const std::string& a_sub_endpoint,
+         const std::string& b_dealer_endpoint, const std::string& b_sub_endpoint);
+
+  ~Bridge();
+
+  // @brief Maps a variable of one server to a variable of the other. A source variable has at most one mapping.
+  // @param from The name of the variable on the source server.
+  // @param to The name of the variable on the destination server.
+  // @param direction Which server is the source.
+  Bridge& MapVariable(const std::string& from, const std::string& to,
+                      const BridgeDirection direction = BridgeDirection::AToB);
+
+  // @brief Maps all variables whose names start with a prefix, replacing the prefix.
+  // e.g. MapPrefix("plc/", "hmi/plc/") copies "plc/speed" to "hmi/plc/speed".
+  // @param from_prefix The prefix of the variables on the source server.
+  // @param to_prefix The prefix replacing 'from_prefix' on the destination server.
+  // @param direction Which server is the source.
+  Bridge& MapPrefix(const std::string& from_prefix, const std::string& to_prefix,
+                    const BridgeDirection direction = BridgeDirection::AToB);
+
+  // @brief Connects to both servers and starts copying. The current values are copied first.
+  // @param max_delay_ms The maximum time in milliseconds an update waits to be batched with others.
+  // @param max_batch_size The number of queued updates which sends the batch immediately.
+  // @return Whether both servers are connected.
+  bool Start(const int max_delay_ms = 10, const size_t max_batch_size = 64);
+
+  // @brief Stops copying and disconnects from both servers. Queued updates are sent first.
+  void Stop();
+
+  // @brief Gets the number of updates sent to the destinations.
+  uint64_t GetForwardedCount() const { return forwarded_; }
+
+  // @brief Gets the number of updates dropped because the bridge just wrote the value itself, or it is unchanged.
+  uint64_t GetSuppressedCount() const { return suppressed_; }
+
+private:
+  // @brief Copies a value published by the source server to the destination server, unless it is an echo.
+  // @param from_side The index of the source server, 0 for A and 1 for B.
+  // @param from_name The name of the variable on the source server.
+  // @param to_name The name of the variable on the destination server.
+  // @param value The published value.
+  void __Forward(const int from_side, const std::string& from_name, const std::string& to_name, const Value& value);
+
+  // @brief Gets the client of a server.
+  // @param side The index of the server, 0 for A and 1 for B.
+  Client& __GetClient(const int side) { return side == 0 ? a_ : b_; }
+
+  ClientRuntime runtime_; // Callbacks of both clients are called from its worker thread.
+  Client a_;
+  Client b_;
+
+  // Writes of the client are not published, so an echo comes only from a callback of the server setting the
+  // value again, right after the write. A written value is forgotten after this time from the response of
+  // its SET, so that a later genuine change to the same value is copied.
+  static constexpr int kEchoWindowMs = 1000;
+  struct WrittenValue {
+    Value value;
+    std::chrono::steady_clock::time_point expiry;
+  };
+  std::mutex written_mutex_;
+  std::unordered_map<std::string, WrittenValue> written_[2]; // Values the bridge recently wrote to A and B, by name.
+  std::atomic<uint64_t> forwarded_;
+  std::atomic<uint64_t> suppressed_;
+};
+
+}  // namespace proplink
+
+#endif  // PROPLINK_BRIDGE_H_
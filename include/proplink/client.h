@@ -7,11 +7,122 @@
 #include <mutex>
 #include <functional>
 #include <queue>
+#include <deque>
 #include <future>
+#include <vector>
+#include <map>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <condition_variable>
 #include "core.h"
+#include "reflection.h"
 
 namespace proplink {
 
+class Client;
+
+// Ordered list of operations to be applied all-or-nothing by Client::ExecuteTransaction().
+// e.g. Transaction().SetVariable("exposure", 10.0).SetVariable("gain", 2.0).ExecuteTrigger("start")
+class Transaction {
+public:
+  // @brief Adds an operation setting the value of a variable.
+  Transaction& SetVariable(const std::string& name, const Value& value);
+
+  // @brief Adds an operation setting the value of a variable only if its current value equals 'expected'.
+  Transaction& CompareAndSetVariable(const std::string& name, const Value& expected, const Value& desired);
+
+  // @brief Adds an operation setting the value of a variable only if its version equals 'expected_version'.
+  Transaction& CompareAndSetVariableVersion(const std::string& name, const uint64_t expected_version, 
+                                            const Value& desired);
+
+  // @brief Adds an operation adding a delta to an int or double variable.
+  Transaction& AddToVariable(const std::string& name, const Value& delta);
+
+  // @brief Adds an operation inverting a boolean variable.
+  Transaction& ToggleVariable(const std::string& name);
+
+  // @brief Adds an operation executing a trigger. It is executed after all variables are committed.
+  Transaction& ExecuteTrigger(const std::string& trigger_name, const std::vector<Value>& arguments = {});
+
+  // @brief Gets the number of operations.
+  size_t size() const;
+
+private:
+  friend class Client;
+  struct Operation {
+    CommandMessage::CommandType command_type;
+    AtomicOperationMessage::OperationType operation_type;
+    std::string name;
+    Value value;
+    Value expected;
+    uint64_t expected_version = 0;
+    std::vector<Value> arguments; // For EXECUTE_TRIGGER.
+  };
+  std::vector<Operation> operations_;
+};
+
+// Endpoints of one server, for a Client connected to several servers.
+struct ServerEndpoint {
+  std::string dealer_endpoint;
+  std::string sub_endpoint;
+  bool replica = false; // Serves only reads. The subscription and all other commands use a primary.
+};
+
+// Shared runtime of many Clients, e.g. one per device server. It owns one ZeroMQ context and one worker thread
+// which polls the sockets of all attached Clients, so that all their callbacks are dispatched from that thread.
+// It must outlive the Clients constructed with it.
+class ClientRuntime {
+public:
+  ClientRuntime();
+  ~ClientRuntime();
+
+  // @brief Starts the worker thread. Called by the first Client::Open(), so calling it is optional.
+  // @return Whether the worker thread is running.
+  bool Start();
+
+  // @brief Stops the worker thread. The Clients should be closed before.
+  void Stop();
+
+private:
+  friend class Client;
+
+  // @brief Adds an opened Client to be serviced by the worker thread. Starts the worker thread if not running.
+  // @param client The Client whose sockets are opened.
+  // @return Whether the Client is attached.
+  bool __Attach(Client* client);
+
+  // @brief Removes a Client. When it returns, the worker thread no longer touches the Client,
+  // unless called from a callback on the worker thread, which checks the membership instead.
+  // @param client The Client to remove.
+  void __Detach(Client* client);
+
+  // @brief Checks whether a Client is still attached.
+  // @param client The Client to check.
+  bool __IsAttached(const Client* client);
+
+  // @brief Wakes the worker thread up to rebuild its poll items and recompute its timeout.
+  void __Wake();
+
+  // @brief Main worker loop that polls the sockets of all attached Clients.
+  void __WorkerLoop();
+
+  zmq::context_t context_;
+  std::string control_endpoint_;
+  std::unique_ptr<zmq::socket_t> inproc_socket_;
+  std::unique_ptr<zmq::socket_t> control_socket_; // Peer of inproc_socket_, used by the other threads.
+  std::mutex control_mutex_;
+
+  std::mutex start_mutex_;
+  std::thread worker_thread_;
+  std::atomic<bool> running_;
+
+  std::mutex clients_mutex_;
+  std::condition_variable iteration_cv_;
+  std::vector<Client*> clients_;
+  uint64_t iteration_; // Incremented whenever the worker loop takes a snapshot of clients_.
+};
+
 class Client {
 public:
   // @brief Constructs a client with dealer and subscriber endpoints.
@@ -19,16 +130,83 @@ public:
   // @param sub_endpoint The endpoint of subscribe socket of publish/subscribe pattern of ZeroMQ.
   Client(const std::string& dealer_endpoint, const std::string& sub_endpoint);
 
+  // @brief Constructs a client serviced by a shared runtime instead of its own context and worker thread.
+  // Callbacks of all Clients of the runtime are called from the runtime's worker thread.
+  // @param dealer_endpoint The endpoint of dealer socket of dealer/router pattern of ZeroMQ.
+  // @param sub_endpoint The endpoint of subscribe socket of publish/subscribe pattern of ZeroMQ.
+  // @param runtime The runtime, which must outlive the client.
+  Client(const std::string& dealer_endpoint, const std::string& sub_endpoint, ClientRuntime& runtime);
+
+  // @brief Constructs a client with several servers. Commands and the subscription use one primary at a time,
+  // failing over to the next healthy primary whenever reconnection is needed, e.g. on heartbeat timeout.
+  // GET commands are spread across the healthy replicas by their observed latency.
+  // @param endpoints The endpoints of the servers, in the order of preference of the primaries.
+  explicit Client(const std::vector<ServerEndpoint>& endpoints);
+
+  // @brief Constructs a client with several servers, serviced by a shared runtime.
+  // @param endpoints The endpoints of the servers, in the order of preference of the primaries.
+  // @param runtime The runtime, which must outlive the client.
+  Client(const std::vector<ServerEndpoint>& endpoints, ClientRuntime& runtime);
+
   ~Client();
 
-  // @brief Opens sockets and sets timeout. It does not check whether communication with the actual server was successful.
+  // @brief Opens sockets and sets timeout, and sends HELLO to the server.
   // @param socket_timeout_ms The time in milliseconds to wait for a response from the dealer socket. This value is valid until the socket is closed.
-  // @return Whether sockets are open for dealer_endpoint and sub_endpoint.
-  bool Open(const int socket_timeout_ms = 1000);
+  // @param wait_for_server_ms The time in milliseconds to wait for the response of HELLO. If the server doesn't respond
+  // within it, the sockets are closed and false is returned. 0 returns without waiting (default), and GetServerInfo()
+  // is filled when the response arrives.
+  // @return Whether sockets are open for dealer_endpoint and sub_endpoint, and the server responded if waited for.
+  bool Open(const int socket_timeout_ms = 1000, const int wait_for_server_ms = 0);
 
   // @brief Closes all sockets and terminates worker thread.
   void Close();
 
+  // @brief Enables heartbeats. HELLO is sent whenever nothing was received from the server for 'interval_ms',
+  // and if nothing is received for 'timeout_ms', the outstanding requests fail with CONNECTION_LOST and
+  // the client reconnects right away. After reconnection, or when the server restarted, the callbacks
+  // registered by RegisterCallback() are called with the values changed in the meantime.
+  // Must be called before Open().
+  // @param interval_ms The interval of heartbeats in milliseconds. 0 disables heartbeats (default).
+  // @param timeout_ms The time in milliseconds without response after which the server is considered dead.
+  // 0 uses three intervals.
+  void SetHeartbeat(const int interval_ms, const int timeout_ms = 0);
+
+  // @brief Sets the number of dealer connections to the server. Synchronous calls from many threads are sent on
+  // whichever connection is idle, instead of queueing for one socket. Asynchronous commands always use the first
+  // connection, so that they reach the server in order. Defaults to PROPLINK_SOCK_POOL_SIZE.
+  // Must be called before the first Open().
+  // @param pool_size The number of dealer connections.
+  void SetDealerPoolSize(const size_t pool_size);
+
+  // @brief Sets the endpoint of the bulk channel of the server, see Server::EnableBulkChannel().
+  // Values which the server sends by reference are read from it in chunks on a separate connection,
+  // by the thread extracting the value, so that other responses and publications are not held up.
+  // Callbacks of published large values run on a bulk thread started on the first one, or in ProcessEvents()
+  // in threadless mode. A value that can't be read, e.g. without this endpoint, is logged, left out of the
+  // results, and its change is not notified.
+  // @param bulk_endpoint The endpoint of the router socket of the bulk channel.
+  void SetBulkEndpoint(const std::string& bulk_endpoint);
+
+  // @brief Selects threadless mode, in which no worker thread is spawned and the application's event loop
+  // drives I/O through GetFileDescriptors() and ProcessEvents(). Callbacks are called from the thread calling
+  // ProcessEvents() or a synchronous method. Must be called before Open().
+  // Ignored for a client of ClientRuntime.
+  // @param threadless Whether to run without worker thread.
+  void SetThreadless(const bool threadless);
+
+  // @brief Gets the ZMQ_FD of the dealer sockets and the subscriber socket for the application's poller (e.g. epoll) in threadless mode.
+  // The descriptors are edge-triggered: when any becomes readable, call ProcessEvents(), which drains all messages.
+  // ProcessEvents() should also be called after sending commands. The descriptors change on reconnection.
+  // @return The file descriptors of the dealer sockets and the subscriber socket, or empty vector if not opened.
+  std::vector<zmq::fd_t> GetFileDescriptors();
+
+  // @brief Receives all pending responses and published variables, and calls their callbacks, in threadless mode.
+  // Also sends the writes due for write combining, and reconnects if the connection was lost.
+  // Must be called from one thread at a time.
+  // @return The time in milliseconds until ProcessEvents() must be called again even without socket events,
+  // or -1 if it only needs to be called on socket events.
+  long ProcessEvents();
+
   // @brief Queries the value of a variable from the server using synchronous connection.
   // @param name The name of variable to retrieve.
   // @return The value of the variable 'name', or empty Value() if 'name' does not exist or communication failed.
@@ -52,6 +230,24 @@ public:
   // (e.g. true is returned even when querying a variable that does not exist.)
   bool GetAllVariables(std::function<void(const ResponseMessage&)> callback);
 
+  // @brief Queries the values of several variables using synchronous connection. Unlike successive calls of
+  // GetVariable(), all values are read at one version of the store, so no write is seen half-applied,
+  // e.g. for x, y and z of one axis. Writers on the server are held only while the values are copied.
+  // @param names The names of the variables.
+  // @param version [out] The version of the store the values were read at, e.g. to be passed to WatchVariables()
+  // so that the following changes are received.
+  // @return Map containing name-value pairs of the variables, or empty map if any variable does not exist
+  // or communication failed.
+  std::unordered_map<std::string, Value> GetVariables(const std::vector<std::string>& names, uint64_t& version);
+
+  // @brief Queries the values of several variables at one version of the store using asynchronous connection.
+  // @param names The names of the variables.
+  // @param callback Callback to be called after the server responds. The response contains the variables
+  // in the order of 'names' and the version of the store.
+  // @return Whether the command was successfully sent.
+  bool GetVariables(const std::vector<std::string>& names,
+                    std::function<void(const ResponseMessage&)> callback);
+
   // @brief Queries the names of all triggers that exist from the server using synchronous connection.
   // @return Vector containing names of all triggers registered in the server, or empty vector if communication failed.
   std::vector<std::string> GetAllTriggers();
@@ -68,12 +264,82 @@ public:
   // @param connection_option Whether to wait for the server's response (SyncConnection or AsyncConnection).
   // @param callback Optional callback to be called after the server responds (only for async connections).
   // @return Whether the command was successfully sent. It does not guarantee that the actual value change was successful.
-  // (e.g. changing the value of read only property returns true because the "send" of the command was successful, even if the value did not change).
-  // The response can be handled in the callback. It won't check if the variable is read_only or not.
+  // With a cached schema, see Describe(), a write to a read_only variable or of another type is rejected without
+  // sending it: it returns false and the callback is called with READ_ONLY or TYPE_MISMATCH. Otherwise the server
+  // checks it, and the result is found in the response, which can be handled in the callback.
   bool SetVariable(const std::string& name, const Value& value,
                    const ConnectionOptions connection_option = AsyncConnection, 
                    std::function<void(const ResponseMessage&)> callback = nullptr);
 
+  // @brief Sets the value of a variable on the server only if its current value equals 'expected'.
+  // The comparison and the assignment are done atomically inside the server.
+  // @param name The name of the variable to set.
+  // @param expected The value the variable is expected to have. It must have the same type as the variable.
+  // @param desired The new value for the variable.
+  // @param connection_option Whether to wait for the server's response (SyncConnection or AsyncConnection).
+  // @param callback Optional callback to be called after the server responds. The response contains 
+  // the resulting value of the variable, or its current value if the comparison failed.
+  // @return Whether the command was successfully sent.
+  bool CompareAndSetVariable(const std::string& name, const Value& expected, const Value& desired,
+                             const ConnectionOptions connection_option = AsyncConnection, 
+                             std::function<void(const ResponseMessage&)> callback = nullptr);
+
+  // @brief Sets the value of a variable on the server only if its version equals 'expected_version'.
+  // The version of a variable is found in VariableMessage of responses and published messages.
+  // @param name The name of the variable to set.
+  // @param expected_version The version the variable is expected to have.
+  // @param desired The new value for the variable.
+  // @param connection_option Whether to wait for the server's response (SyncConnection or AsyncConnection).
+  // @param callback Optional callback to be called after the server responds. The response contains 
+  // the resulting value of the variable, or its current value if the comparison failed.
+  // @return Whether the command was successfully sent.
+  bool CompareAndSetVariableVersion(const std::string& name, const uint64_t expected_version, const Value& desired,
+                                    const ConnectionOptions connection_option = AsyncConnection, 
+                                    std::function<void(const ResponseMessage&)> callback = nullptr);
+
+  // @brief Adds a delta to an int or double variable atomically on the server.
+  // @param name The name of the variable to add to.
+  // @param delta The value to add. It must be int for int variable, and double or int for double variable.
+  // @param connection_option Whether to wait for the server's response (SyncConnection or AsyncConnection).
+  // @param callback Optional callback to be called after the server responds. The response contains the resulting value.
+  // @return Whether the command was successfully sent.
+  bool AddToVariable(const std::string& name, const Value& delta,
+                     const ConnectionOptions connection_option = AsyncConnection, 
+                     std::function<void(const ResponseMessage&)> callback = nullptr);
+
+  // @brief Inverts a boolean variable atomically on the server.
+  // @param name The name of the variable to toggle.
+  // @param connection_option Whether to wait for the server's response (SyncConnection or AsyncConnection).
+  // @param callback Optional callback to be called after the server responds. The response contains the resulting value.
+  // @return Whether the command was successfully sent.
+  bool ToggleVariable(const std::string& name,
+                      const ConnectionOptions connection_option = AsyncConnection, 
+                      std::function<void(const ResponseMessage&)> callback = nullptr);
+
+  // @brief Appends a suffix to a string variable atomically on the server.
+  // @param name The name of the variable to append to.
+  // @param suffix The string to append.
+  // @param connection_option Whether to wait for the server's response (SyncConnection or AsyncConnection).
+  // @param callback Optional callback to be called after the server responds. The response contains the resulting value.
+  // @return Whether the command was successfully sent.
+  bool AppendToVariable(const std::string& name, const std::string& suffix,
+                        const ConnectionOptions connection_option = AsyncConnection, 
+                        std::function<void(const ResponseMessage&)> callback = nullptr);
+
+  // @brief Applies the operations of a transaction on the server. All operations are validated (existence, 
+  // read_only, type and comparison) against one state of the variables and committed inside one critical
+  // section, or none of them is applied.
+  // Callbacks of the variables and triggers run on the server after the commit, in the order of operations.
+  // @param transaction The operations to apply.
+  // @param connection_option Whether to wait for the server's response (SyncConnection or AsyncConnection).
+  // @param callback Optional callback to be called after the server responds. 
+  // ResponseMessage::results() contains the result of each operation in order. A large value is a reference
+  // to the value of the variable after the transaction.
+  // @return Whether the command was successfully sent.
+  bool ExecuteTransaction(const Transaction& transaction,
+                          const ConnectionOptions connection_option = AsyncConnection, 
+                          std::function<void(const ResponseMessage&)> callback = nullptr);
+
   // @brief Executes a trigger on the server.
   // @param trigger_name The name of the trigger to execute.
   // @param connection_option Whether to wait for the server's response (SyncConnection or AsyncConnection).
@@ -83,54 +349,500 @@ public:
                       const ConnectionOptions connection_option = AsyncConnection, 
                       std::function<void(const ResponseMessage&)> callback = nullptr);
 
+  // @brief Waits until any of the variables changes after the given version using synchronous connection.
+  // The server parks the request instead of polling, so this replaces polling loops of GetVariable().
+  // @param names The names of variables to watch.
+  // @param version [in/out] The version of the store the caller has seen. Pass 0 to get the current values immediately.
+  // Updated to the version of the store at the response, which is to be passed to the next call.
+  // @param timeout_ms The time in milliseconds for the server to wait for a change. 0 waits for the request timeout,
+  // see Open(), since the caller is blocked meanwhile.
+  // @return Map containing name-value pairs of the changed variables, or empty map if timed out or communication failed.
+  // The server answers NOT_ALLOWED beyond 64 parked watches of one client.
+  std::unordered_map<std::string, Value> WatchVariables(const std::vector<std::string>& names, 
+                                                        uint64_t& version, 
+                                                        const int timeout_ms);
+
+  // @brief Waits until any of the variables changes after the given version using asynchronous connection.
+  // @param names The names of variables to watch.
+  // @param since_version The version of the store the caller has seen. Pass 0 to get the current values immediately.
+  // @param timeout_ms The time in milliseconds for the server to wait for a change. 0 waits without timeout.
+  // The server answers NOT_ALLOWED beyond 64 parked watches of one client.
+  // @param callback Callback to be called when the server responds. The response contains the changed variables 
+  // and the version of the store to be passed to the next call.
+  // @return Whether the command was successfully sent.
+  bool WatchVariables(const std::vector<std::string>& names, 
+                      const uint64_t since_version, 
+                      const int timeout_ms, 
+                      std::function<void(const ResponseMessage&)> callback);
+
+  // @brief Executes a trigger with arguments on the server.
+  // @param trigger_name The name of the trigger to execute.
+  // @param arguments The arguments passed to the callback of the trigger.
+  // @param connection_option Whether to wait for the server's response (SyncConnection or AsyncConnection).
+  // @param callback Optional callback to be called after the server responds. 
+  // ResponseMessage::trigger_results() contains the values returned by the trigger.
+  // @return Whether the command was successfully sent.
+  bool ExecuteTrigger(const std::string& trigger_name,
+                      const std::vector<Value>& arguments,
+                      const ConnectionOptions connection_option = AsyncConnection, 
+                      std::function<void(const ResponseMessage&)> callback = nullptr);
+
+  // @brief Executes a trigger with arguments on the server using synchronous connection, and gets its results.
+  // @param trigger_name The name of the trigger to execute.
+  // @param arguments The arguments passed to the callback of the trigger.
+  // @return The values returned by the trigger, or empty vector if the execution or communication failed.
+  std::vector<Value> CallTrigger(const std::string& trigger_name, 
+                                 const std::vector<Value>& arguments = {});
+
   // @brief Checks whether sockets have been opened. It does not check whether communication with the actual server was successful.
   // @return Whether sockets are open for dealer_endpoint and sub_endpoint.
   bool IsOpened() const;
 
+  // @brief Sends HELLO to the server using synchronous connection, and updates the server info.
+  // @param timeout_ms The time in milliseconds to wait for the response. Negative value uses the socket timeout given to Open().
+  // @return Whether the server responded.
+  bool Ping(const int timeout_ms = -1);
+
+  // @brief Gets the identity, epoch and capabilities of the server from the last response of HELLO.
+  // The epoch changes when the server restarts.
+  // @return The server info, or empty message if the server has not responded yet.
+  ServerInfoMessage GetServerInfo();
+
+  // @brief Fetches the schema of the server using synchronous connection, unless the cached one is current.
+  // The schema is also fetched asynchronously whenever HELLO reports a hash differing from the cached one,
+  // so calling it is optional. The cached schema is kept across reconnections.
+  // With a current schema, SetVariable() addresses variables by ID and checks the type and read_only flag of
+  // the value before sending, and GetAllVariables() receives only IDs and values.
+  // @return Whether the server responded.
+  bool Describe();
+
+  // @brief Gets the cached schema of the server.
+  // @return The descriptions of all variables, or empty vector if the schema has not been fetched.
+  std::vector<VariableSchema> GetSchema();
+
+  // @brief Enables micro-batching of asynchronous writes. SetVariable() and ExecuteTrigger() with AsyncConnection 
+  // from all threads are queued for up to 'max_delay_ms' and sent together as one BATCH message.
+  // A later set of the same variable within the window replaces the earlier one, whose callback is called
+  // with status SUPERSEDED, and takes its place at the end of the queue. Any other command sends the queue first,
+  // so that it doesn't overtake the queued writes. Each operation is still applied independently by the server.
+  // @param max_delay_ms The maximum time in milliseconds a write waits in the queue. 0 disables write combining (default).
+  // @param max_batch_size The number of queued writes which sends the batch immediately.
+  void SetWriteCombining(const int max_delay_ms, const size_t max_batch_size = 64);
+
   // @brief Registers a callback to be called when the value of a variable is changed by the server.
+  // Only the variables having a callback are subscribed, so the server does not publish the others to this client.
   // @param name The name of the variable to monitor for changes.
   // @param callback The callback function to be invoked when the variable value changes.
   void RegisterCallback(const std::string& name, 
                         VariableChangedCallback callback);
 
+  // @brief Reads all variables asynchronously and calls the registered callbacks of the values which differ
+  // from the last ones notified, e.g. to deliver the current values after Open().
+  void Resync() { __Resync(); }
+
+  // @brief Registers a callback to be called when any variable whose name starts with 'prefix' is changed
+  // by the server, including variables registered on the server later.
+  // @param prefix The prefix of the names of the variables to monitor. Empty monitors all variables.
+  // @param callback The callback function to be invoked with the name and value of the changed variable.
+  void RegisterPrefixCallback(const std::string& prefix, 
+                              NamedVariableChangedCallback callback);
+
+  // @brief Queries the value of a field of a struct declared by PROPLINK_STRUCT using synchronous connection.
+  // The name of the variable is a compile-time constant, and the value is returned with the type of the field.
+  // With a cached schema, see Describe(), the field is addressed by its ID, looked up once per schema and then
+  // indexed by the field without lock.
+  // e.g. double gain = client.Get<&Config::gain>();
+  // @return The value of the field, or a value-initialized one if communication failed or the type differs.
+  template <auto Member>
+  MemberType<Member> Get() {
+    const std::shared_ptr<const StructIds> ids = __GetStructIds<MemberClass<Member>>();
+    const Value value = __GetVariable(FieldName<Member>(), ids ? ids->ids[FieldIndex<Member>()] : 0);
+    const auto* typed = std::get_if<MemberType<Member>>(&value);
+    return typed ? *typed : MemberType<Member>{};
+  }
+
+  // @brief Sets the value of a field of a struct declared by PROPLINK_STRUCT. See SetVariable().
+  // The value has the type of the field, so a mismatch with the server's variable is a compile error.
+  // @param value The new value of the field.
+  // @param connection_option Whether to wait for the server's response (SyncConnection or AsyncConnection).
+  // @param callback Optional callback to be called after the server responds.
+  // @return Whether the command was successfully sent.
+  template <auto Member>
+  bool Set(const MemberType<Member>& value,
+           const ConnectionOptions connection_option = AsyncConnection,
+           std::function<void(const ResponseMessage&)> callback = nullptr) {
+    return SetVariable(FieldName<Member>(), FieldValue<Member>(value), connection_option, std::move(callback));
+  }
+
+  // @brief Queries the values of all fields of a struct declared by PROPLINK_STRUCT using synchronous connection.
+  // Only the fields are read, at one version of the store like GetVariables(). With a cached schema,
+  // see Describe(), they are addressed by their IDs, looked up once per schema.
+  // @return The struct, which is value-initialized if a field doesn't exist on the server or communication failed.
+  template <typename T>
+  T GetStruct() {
+    const std::shared_ptr<const StructIds> ids = __GetStructIds<T>();
+    std::vector<std::string> names;
+    std::vector<uint32_t> field_ids;
+    size_t index = 0;
+    ForEachField<T>([&ids, &names, &field_ids, &index](auto field) {
+      const uint32_t id = ids ? ids->ids[index] : 0;
+      if (id != 0) {
+        field_ids.push_back(id);
+      } else {
+        names.push_back(field.name);
+      }
+      index++;
+    });
+    uint64_t version = 0;
+    const std::unordered_map<std::string, Value> values = __GetVariables(names, field_ids, version);
+    T result{};
+    ForEachField<T>([&result, &values](auto field) {
+      constexpr auto member = decltype(field)::member;
+      auto it = values.find(field.name);
+      if (it == values.end()) return;
+      if (const auto* typed = std::get_if<MemberType<member>>(&it->second)) result.*member = *typed;
+    });
+    return result;
+  }
+
+  // @brief Sets all fields of a struct declared by PROPLINK_STRUCT in one transaction, so that they are
+  // applied all-or-nothing.
+  // @param value The new values of the fields.
+  // @param connection_option Whether to wait for the server's response (SyncConnection or AsyncConnection).
+  // @param callback Optional callback to be called after the server responds.
+  // @return Whether the command was successfully sent.
+  template <typename T>
+  bool SetStruct(const T& value,
+                 const ConnectionOptions connection_option = AsyncConnection,
+                 std::function<void(const ResponseMessage&)> callback = nullptr) {
+    Transaction transaction;
+    ForEachField<T>([&transaction, &value](auto field) {
+      constexpr auto member = decltype(field)::member;
+      transaction.SetVariable(field.name, FieldValue<member>(value.*member));
+    });
+    return ExecuteTransaction(transaction, connection_option, std::move(callback));
+  }
+
+  // @brief Registers a callback to be called with the typed value when a field of a struct declared by
+  // PROPLINK_STRUCT is changed by the server. Values of another type are ignored. See RegisterCallback().
+  // @param callback The callback function to be invoked with the new value of the field.
+  template <auto Member>
+  void OnChange(std::function<void(const MemberType<Member>&)> callback) {
+    RegisterCallback(FieldName<Member>(), [callback = std::move(callback)](const Value& value) {
+      if (const auto* typed = std::get_if<MemberType<Member>>(&value)) callback(*typed);
+    });
+  }
+
 private:
+  friend class ClientRuntime;
+
+  // @brief Queries the value of a variable using synchronous connection, see GetVariable().
+  // @param name The name of the variable.
+  // @param id The ID of the variable in the cached schema, which addresses it instead of the name, or 0.
+  // @return The value of the variable, or empty Value() if it does not exist or communication failed.
+  Value __GetVariable(const std::string& name, const uint32_t id);
+
+  // @brief Queries the values of several variables using synchronous connection, see GetVariables().
+  // @param names The names of the variables.
+  // @param ids The IDs of more variables in the cached schema.
+  // @param version [out] The version of the store the values were read at.
+  // @return Map of the values by name, or empty map if any variable does not exist or communication failed.
+  std::unordered_map<std::string, Value> __GetVariables(const std::vector<std::string>& names, 
+                                                        const std::vector<uint32_t>& ids, uint64_t& version);
+
+  // IDs of the fields of a struct declared by PROPLINK_STRUCT, see __GetStructIds().
+  struct StructIds {
+    uint64_t schema_hash = 0; // The schema the IDs were looked up in.
+    std::vector<uint32_t> ids; // By field index, 0 for fields not in the schema.
+  };
+
+  // @brief Gets the IDs of the fields of a struct declared by PROPLINK_STRUCT in the cached schema. They are
+  // looked up under schema_mutex_ when the schema changes, and otherwise read without lock nor lookup.
+  // @return The IDs, or nullptr if the schema has not been fetched.
+  template <typename T>
+  std::shared_ptr<const StructIds> __GetStructIds() {
+    // Shared by the clients, since the IDs are determined by the schema.
+    static std::shared_ptr<const StructIds> cache;
+    const uint64_t schema_hash = schema_hash_;
+    if (schema_hash == 0) return nullptr;
+    std::shared_ptr<const StructIds> ids = std::atomic_load(&cache);
+    if (ids && ids->schema_hash == schema_hash) return ids;
+    {
+      std::lock_guard<std::mutex> lock(schema_mutex_);
+      if (schema_hash_ == 0) return nullptr;
+      auto looked_up = std::make_shared<StructIds>();
+      looked_up->schema_hash = schema_hash_;
+      ForEachField<T>([this, &looked_up](auto field) {
+        auto it = schema_.find(field.name);
+        looked_up->ids.push_back(it != schema_.end() ? it->second.id : 0);
+      });
+      ids = std::move(looked_up);
+    }
+    std::atomic_store(&cache, ids);
+    return ids;
+  }
+
+  Client(const std::vector<ServerEndpoint>& endpoints, ClientRuntime* runtime);
+
+  // One connection of the dealer pool. Commands are sent on any of them, and responses are received from all.
+  struct DealerConnection {
+    std::unique_ptr<zmq::socket_t> socket;
+    std::mutex mutex;
+  };
+
+  // Failures of an endpoint. A failed endpoint is skipped until retry_time.
+  struct EndpointHealth {
+    int failures = 0;
+    std::chrono::steady_clock::time_point retry_time;
+  };
+
+  // Connection to a read replica.
+  struct ReplicaConnection {
+    std::string endpoint;
+    DealerConnection dealer;
+    // Guarded by replicas_mutex_.
+    EndpointHealth health;
+    double latency_ms = 0.0; // Moving average of the response time. 0 until measured.
+    std::map<uint64_t, std::chrono::steady_clock::time_point> in_flight; // Send times of unanswered reads.
+  };
+
   // @brief Generates the next unique command ID for request tracking.
   // @return A unique command ID.
   uint64_t __GetNextCommandId();
   
   // @brief Sends a command synchronously and waits for response.
   // @param cmd The command message to send.
+  // @param timeout_ms The time in milliseconds to wait for the response. Negative value uses the socket timeout given to Open().
   // @return The response message from the server.
-  ResponseMessage __SendCommandSync(const CommandMessage& cmd);
+  ResponseMessage __SendCommandSync(const CommandMessage& cmd, const int timeout_ms = -1);
   
   // @brief Sends a command asynchronously without waiting for response.
   // @param cmd The command message to send.
   // @param callback Optional callback to be called when response is received.
+  // @param primary_only Whether to send a read to the primary even if replicas are available.
   void __SendCommandAsync(const CommandMessage& cmd, 
-                          std::function<void(const ResponseMessage&)> callback = nullptr);
+                          std::function<void(const ResponseMessage&)> callback = nullptr,
+                          const bool primary_only = false);
                           
+  // @brief Sends a command asynchronously, or queues it for write combining if enabled.
+  // @param cmd The SET_VARIABLE or EXECUTE_TRIGGER command to send.
+  // @param callback Optional callback to be called when response is received.
+  void __SendCommandCombined(const CommandMessage& cmd, 
+                             std::function<void(const ResponseMessage&)> callback);
+
+  // @brief Sends the queued writes as one BATCH command.
+  void __FlushBatch();
+
+  // @brief Gets the poll timeout of the worker loop to wake up when the queued writes are due.
+  // @return Milliseconds until the batch is due, or -1 if no write is queued.
+  long __GetBatchPollTimeout();
+
+  // @brief Sends HELLO command.
+  // @param timeout_ms The time in milliseconds to wait for the response. 0 sends it asynchronously without waiting.
+  // @return Whether the server responded, or true if not waited for.
+  bool __Handshake(const int timeout_ms);
+
+  // @brief Stores the server info of a response of HELLO.
+  // @param response The response message.
+  // @return Whether the response was successful and contained the server info.
+  bool __UpdateServerInfo(const ResponseMessage& response);
+
+  // @brief Fetches the schema asynchronously if it differs from the cached one and no fetch is in flight.
+  // @param schema_hash The hash of the schema reported by the server.
+  void __RefreshSchema(const uint64_t schema_hash);
+
+  // @brief Replaces the cached schema with the one of a response of DESCRIBE, unless it is unchanged.
+  // @param response The response message.
+  // @return Whether the response was successful.
+  bool __ApplySchema(const ResponseMessage& response);
+
+  // @brief Checks a value against the cached schema before sending it, and gets the ID of the variable.
+  // @param name The name of the variable.
+  // @param value The value to set.
+  // @param id Set to the ID of the variable, or 0 if it is not in the cached schema.
+  // @param response Filled with the status if the value is rejected.
+  // @return Whether the value may be sent. Variables not in the cached schema are left to the server.
+  bool __ValidateValue(const std::string& name, const Value& value, uint32_t& id, ResponseMessage& response);
+
+  // @brief Sends ATOMIC_OPERATION command.
+  // @param operation The atomic operation to send.
+  // @param connection_option Whether to wait for the server's response (SyncConnection or AsyncConnection).
+  // @param callback Optional callback to be called after the server responds.
+  // @return Whether the command was successfully sent.
+  bool __SendAtomicOperation(const AtomicOperationMessage& operation, 
+                             const ConnectionOptions connection_option, 
+                             std::function<void(const ResponseMessage&)> callback);
+
+  // @brief Sends a command to the worker thread through the inproc control socket.
+  // @param command "STOP" to terminate the worker thread, "SUBSCRIBE" to subscribe pending topics.
+  void __SendControlMessage(const std::string& command);
+
+  // @brief Subscribes the names of all variables having callback. Used on (re)creation of the subscriber socket.
+  void __SubscribeAll();
+
+  // @brief Subscribes the names of variables whose callbacks were registered after the subscriber socket was created.
+  // Must be called only from the worker thread, or the thread calling ProcessEvents() in threadless mode.
+  void __SubscribePending();
+
   // @brief Main worker loop that handles incoming messages and responses.
   void __WorkerLoop();
+
+  // @brief Receives all pending responses from the dealer sockets without blocking, and dispatches them.
+  void __ProcessDealer();
+
+  // @brief Receives all pending responses from one dealer socket without blocking, and dispatches them.
+  // @param dealer The connection to receive from.
+  // @param replica The replica of the connection, or nullptr for a connection of the pool to the primary.
+  void __ProcessDealer(DealerConnection& dealer, ReplicaConnection* replica = nullptr);
+
+  // @brief Creates a dealer socket with the options of the client, and connects it.
+  // @param endpoint The endpoint to connect to.
+  // @return The connected socket.
+  std::unique_ptr<zmq::socket_t> __CreateDealerSocket(const std::string& endpoint);
+
+  // @brief Creates the dealer sockets of the pool, or recreates them on reconnection, and connects them.
+  void __OpenDealers();
+
+  // @brief Creates the dealer sockets of the replicas and connects them.
+  void __OpenReplicas();
+
+  // @brief Closes the dealer sockets of the pool and of the replicas.
+  void __CloseDealers();
+
+  // @brief Marks the current primary as failed and switches the endpoints to the next healthy primary.
+  // Does nothing if there is only one primary.
+  void __SelectPrimary();
+
+  // @brief Sends a read command to the healthy replica expected to respond first.
+  // @param cmd The command to send.
+  // @return Whether the command was sent. false if it is not a read or no replica is available.
+  bool __SendOnReplica(const CommandMessage& cmd);
+
+  // @brief Records a failure of an endpoint, postponing its next use with exponential backoff.
+  // @param health The health of the endpoint.
+  static void __RecordFailure(EndpointHealth& health);
+
+  // @brief Checks whether all dealer sockets of the pool are connected.
+  bool __DealersConnected();
+
+  // @brief Sends a command on a connection of the dealer pool.
+  // @param cmd The command message to send.
+  // @param ordered Whether to use the first connection, keeping the order of commands sent with this flag.
+  // Otherwise, the first idle connection is used.
+  void __SendOnDealer(const CommandMessage& cmd, const bool ordered);
+
+  // @brief Appends the poll items of the dealer sockets, followed by the subscriber socket.
+  // @param items The poll items to append to.
+  void __AppendPollItems(std::vector<zmq::pollitem_t>& items);
+
+  // @brief Fulfills the promise of a synchronous command or calls the callback of an asynchronous one.
+  // Callbacks are called without responses_mutex_ held.
+  // @param response The response message from the server.
+  void __DispatchResponse(const ResponseMessage& response);
+
+  // @brief Receives all pending variables from the subscriber socket without blocking, and calls their callbacks.
+  void __ProcessSubscriber();
+
+  // @brief Recreates the sockets if the connection was lost and the backoff delay has passed.
+  // @return false if the maximum attempts were reached and the client gave up, otherwise true.
+  bool __Reconnect();
+
+  // @brief Sends a heartbeat if due, or starts reconnection if the server didn't respond within the heartbeat timeout.
+  void __Heartbeat();
+
+  // @brief Handles the response of a heartbeat, resynchronizing if the epoch of the server changed.
+  // @param response The response of HELLO.
+  void __HandleHeartbeat(const ResponseMessage& response);
+
+  // @brief Sets the heartbeat options of ZeroMQ to a socket, if heartbeats are enabled.
+  // @param socket The socket to set the options to.
+  void __ApplyHeartbeatOptions(zmq::socket_t& socket);
+
+  // @brief Gets the current values of all variables and calls the callbacks of the changed ones.
+  void __Resync();
+
+  // @brief Calls the callbacks of a published or resynchronized variable. A large value, and everything
+  // received after it, is queued for the bulk thread (or ProcessEvents() in threadless mode), so that
+  // the transfer neither blocks the receiving thread nor runs with callbacks_mutex_ held.
+  // @param variable The variable message received from the server.
+  void __DispatchVariable(const VariableMessage& variable);
+
+  // @brief Reads the large value of a queued variable and calls its callbacks. A variable whose value
+  // can't be read is logged and not notified.
+  // @param variable The variable message received from the server.
+  void __NotifyQueuedVariable(const VariableMessage& variable);
+
+  // @brief Notifies the variables queued by __DispatchVariable() until the client is closed.
+  void __BulkLoop();
+
+  // @brief Notifies the variables queued by __DispatchVariable() in threadless mode.
+  void __ProcessBulkQueue();
+
+  // @brief Stops the bulk thread and drops the queued variables.
+  void __StopBulkThread();
+
+  // @brief Whether a variable has a callback. Must be called with callbacks_mutex_ held.
+  // @param name The name of the variable.
+  // @return True if a callback or a prefix callback matches the name.
+  bool __HasCallback(const std::string& name) const;
+
+  // @brief Calls the callback of a variable if its value differs from the last known one.
+  // Must be called with callbacks_mutex_ held.
+  // @param name The name of the variable.
+  // @param value The value of the variable.
+  void __NotifyVariable(const std::string& name, const Value& value);
+
+  // @brief Gets the poll timeout to wake up when the queued writes are due or the next reconnection is tried.
+  // @return Milliseconds until the next timed work, or -1 if there is none.
+  long __GetPollTimeout();
+
+  // @brief Waits for the response of a synchronous command. In threadless mode or in a callback,
+  // receives it in the calling thread.
+  // @param future The future of the response.
+  // @param timeout_ms The time in milliseconds to wait.
+  // @return ready if the response arrived, otherwise timeout.
+  std::future_status __WaitForResponse(std::future<ResponseMessage>& future, const int timeout_ms);
   
   // @brief Extracts Value from VariableMessage based on the message type.
+  // A reference to a large value is read from the bulk channel, so this must not be called with
+  // callbacks_mutex_ or schema_mutex_ held.
   // @param variable The variable message to extract value from.
-  // @return The extracted Value object.
-  Value __ExtractValue(const VariableMessage& variable);
+  // @param value Set to the extracted value.
+  // @return false if a large value could not be read.
+  bool __ExtractValue(const VariableMessage& variable, Value& value);
+
+  // @brief Reads a large value from the bulk channel, with several chunks requested ahead.
+  // @param reference The reference sent by the server instead of the value.
+  // @param value Set to the value.
+  // @return Whether the whole value was read.
+  bool __ReadLargeValue(const LargeValueMessage& reference, std::string& value);
   
   // @brief Sets Value to VariableMessage based on the value type.
   // @param variable The variable message to set value to.
   // @param value The value to set in the message.
   void __SetValueToVariableMessage(VariableMessage* variable, const Value& value);
+
+  // @brief Describes the failure of a response for logging.
+  // @param response The response message.
+  // @return The error message if the Server sent one, otherwise the name of the status code.
+  static std::string __DescribeStatus(const ResponseMessage& response);
   
   // ZeroMQ
-  zmq::context_t context_;
-  std::unique_ptr<zmq::socket_t> dealer_;
-  std::mutex dealer_mutex_;
+  std::unique_ptr<zmq::context_t> own_context_; // nullptr for a client of ClientRuntime.
+  zmq::context_t* context_; // own_context_, or the context of runtime_.
+  ClientRuntime* runtime_;
+  std::string control_endpoint_;
+  std::vector<std::unique_ptr<DealerConnection>> dealers_;
+  size_t dealer_pool_size_;
+  std::atomic<size_t> next_dealer_; // Rotating start of the search for an idle connection.
+  std::mutex responses_mutex_; // Guards pending_responses_ and async_responses_.
   std::map<uint64_t, std::promise<ResponseMessage>> pending_responses_;
   std::map<uint64_t, std::function<void(const ResponseMessage&)>> async_responses_;
   std::unique_ptr<zmq::socket_t> subscriber_;
   std::unique_ptr<zmq::socket_t> inproc_socket_;
-  std::string dealer_endpoint_;
+  std::unique_ptr<zmq::socket_t> control_socket_; // Peer of inproc_socket_, used by the other threads.
+  std::mutex control_mutex_;
+  std::string dealer_endpoint_; // Endpoints of the current primary.
   std::string sub_endpoint_;
   std::atomic<uint64_t> command_id_;
   
@@ -140,11 +852,74 @@ private:
 
   // Callbacks to be called when the value of Variable is changed by the server.
   std::unordered_map<std::string, VariableChangedCallback> slots_;
+  std::map<std::string, NamedVariableChangedCallback> prefix_slots_;
   std::unordered_map<std::string, Value> slots_last_known_values_;
+  std::vector<std::string> pending_subscriptions_; // Topics to be subscribed by the worker thread.
   std::mutex callbacks_mutex_;
   
   std::atomic<bool> opened_;
   int request_timeout_ms_;
+  bool threadless_;
+
+  // Reconnection with exponential backoff.
+  static constexpr int kMaxReconnectAttempts = 5;
+  static constexpr long kInitialReconnectDelayMs = 100;
+  static constexpr long kMaxReconnectDelayMs = 5000;
+  std::atomic<bool> need_reconnect_;
+  int reconnect_attempts_;
+  std::chrono::steady_clock::time_point last_reconnect_time_;
+
+  // Failover between primaries. The health is accessed only by the thread receiving from the dealer sockets.
+  std::vector<ServerEndpoint> primaries_;
+  std::vector<EndpointHealth> primary_health_;
+  size_t primary_index_;
+
+  // Read replicas.
+  std::vector<std::unique_ptr<ReplicaConnection>> replicas_;
+  std::mutex replicas_mutex_;
+
+  // Heartbeats. Times are accessed only by the thread receiving from the dealer sockets.
+  int heartbeat_interval_ms_;
+  int heartbeat_timeout_ms_;
+  std::chrono::steady_clock::time_point last_received_time_;
+  std::chrono::steady_clock::time_point last_heartbeat_time_;
+
+  // Server info from the last response of HELLO.
+  std::mutex server_info_mutex_;
+  ServerInfoMessage server_info_;
+
+  // Schema from the last response of DESCRIBE.
+  std::mutex schema_mutex_;
+  std::atomic<uint64_t> schema_hash_{0}; // 0 if the schema has not been fetched. Changed under schema_mutex_.
+  std::unordered_map<std::string, VariableSchema> schema_;
+  std::unordered_map<uint32_t, std::string> schema_names_; // Names of the variables by ID.
+  std::atomic<bool> schema_refreshing_{false};
+
+  // Bulk channel of large values. The socket is created on the first read.
+  static constexpr uint32_t kLargeValueChunkSize = 256 * 1024;
+  static constexpr size_t kLargeValueWindow = 4; // Chunks requested ahead.
+  std::mutex bulk_mutex_; // Guards bulk_endpoint_ and bulk_dealer_.
+  std::string bulk_endpoint_;
+  std::unique_ptr<zmq::socket_t> bulk_dealer_;
+  // Published variables waiting for their large value to be read, see __DispatchVariable().
+  std::mutex bulk_queue_mutex_;
+  std::condition_variable bulk_queue_cv_;
+  std::deque<VariableMessage> bulk_queue_;
+  size_t bulk_in_flight_ = 0; // Queued or being notified. Later variables queue behind them, to keep the order.
+  bool bulk_stopping_ = false;
+  std::thread bulk_thread_; // Started on the first large value, unless threadless.
+
+  // Write combining.
+  struct BatchedCommand {
+    CommandMessage command;
+    std::function<void(const ResponseMessage&)> callback;
+  };
+  std::mutex batch_mutex_;
+  std::vector<BatchedCommand> batch_;
+  std::unordered_map<std::string, size_t> batch_index_by_variable_; // Index in batch_ of the set of each variable.
+  std::chrono::steady_clock::time_point batch_started_;
+  int batch_max_delay_ms_;
+  size_t batch_max_size_;
 };
 
 }  // namespace proplink
@@ -3,22 +3,60 @@
 
 #include "property.pb.h"
 #include <variant>
+#include <vector>
+#include <functional>
 
-#define PROPLINK_SOCK_POOL_SIZE 1
+// Version of the messages in property.proto, reported by HELLO.
+#define PROPLINK_PROTOCOL_VERSION 1
+
+// Default number of dealer connections of a Client. See Client::SetDealerPoolSize().
+#ifndef PROPLINK_SOCK_POOL_SIZE
+#define PROPLINK_SOCK_POOL_SIZE 4
+#endif
 
 namespace proplink {
 
 using Value = std::variant<bool, double, int, std::string>;
 struct Variable {
-  Variable(const std::string& name, const Value& value, const bool& read_only = false) 
-    : name(name), value(value), read_only(read_only) {}
+  Variable(const std::string& name, const Value& value, const bool& read_only = false, 
+           const bool& coalesce = false) 
+    : name(name), value(value), read_only(read_only), coalesce(coalesce) {}
   std::string name;
   Value value;
   const bool read_only; // If true, only Server can change the value.
+  const bool coalesce; // If true, SETs from Clients waiting in the Server's queue collapse into the newest one.
 };
 using Trigger = std::string;
+// Type of a variable, which is the index of its alternative in Value.
+enum class ValueType {
+  Bool = 0,
+  Double = 1,
+  Int = 2,
+  String = 3
+};
+// Optional description of a variable reported by DESCRIBE, see Server::SetVariableMetadata().
+struct VariableMetadata {
+  std::string units;
+  bool has_range = false;
+  double minimum = 0.0; // Only if has_range.
+  double maximum = 0.0; // Only if has_range.
+};
+// Description of a variable reported by DESCRIBE, see Client::GetSchema().
+struct VariableSchema {
+  std::string name;
+  ValueType type = ValueType::Bool;
+  bool read_only = false;
+  uint32_t id = 0; // Derived from the name, so it is the same on every server and after restarts.
+  VariableMetadata metadata;
+};
 using VariableChangedCallback = std::function<void(const Value& value)>;
+// Callback of the variables registered by a prefix, which is also given the name of the changed variable.
+using NamedVariableChangedCallback = std::function<void(const std::string& name, const Value& value)>;
+// Computes the value of a variable on demand, see Server::RegisterVariable() with a provider.
+using VariableProvider = std::function<Value()>;
 using TriggerCallback = std::function<void()>;
+// Callback of a trigger which takes arguments and returns results to the Client.
+using TriggerWithArgumentsCallback = std::function<std::vector<Value>(const std::vector<Value>& arguments)>;
 enum ConnectionOptions {
   SyncConnection = 0,
   AsyncConnection = 1
@@ -0,0 +1,156 @@
+#ifndef PROPLINK_LOGGER_H_
+#define PROPLINK_LOGGER_H_
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace proplink {
+
+enum class LogLevel {
+  Debug = 0,
+  Info = 1,
+  Warning = 2,
+  Error = 3,
+  Off = 4
+};
+
+struct LogRecord {
+  LogLevel level;
+  std::chrono::system_clock::time_point time;
+  std::string message;
+};
+
+// Destination of log records. Write() is called from one thread at a time.
+class LogSink {
+ public:
+  virtual ~LogSink() = default;
+  virtual void Write(const LogRecord& record) = 0;
+};
+
+// Writes log records to stderr. Default sink of the Logger.
+class StderrSink : public LogSink {
+ public:
+  void Write(const LogRecord& record) override;
+};
+
+// Rate limiting state of one PROPLINK_LOG call site.
+struct LogSite {
+  std::atomic<int64_t> window_start_ms{0};
+  std::atomic<uint32_t> count{0};
+  std::atomic<uint32_t> suppressed{0};
+};
+
+// Process-wide logger used by Server and Client.
+// Records are queued to a fixed-size ring buffer and written to the sink by a background thread,
+// so that logging never blocks the caller on I/O. Records are dropped when the buffer is full.
+class Logger {
+ public:
+  // @brief Gets the process-wide logger. The asynchronous backend is started on first use.
+  static Logger& Instance();
+
+  // @brief Sets the minimum severity to log. Defaults to Warning.
+  // @param level The minimum severity. LogLevel::Off disables logging.
+  void SetLevel(LogLevel level);
+
+  // @brief Checks whether a record of the severity would be logged.
+  // @param level The severity of the record.
+  bool IsEnabled(LogLevel level) const {
+    return level >= level_.load(std::memory_order_relaxed) && level != LogLevel::Off;
+  }
+
+  // @brief Replaces the sink. Records already queued are written to the new sink.
+  // @param sink The sink to write records to. nullptr discards all records.
+  void SetSink(std::shared_ptr<LogSink> sink);
+
+  // @brief Limits how often one call site logs. Records over the limit are counted, and the count is
+  // appended to the next record logged from the call site.
+  // @param max_records The number of records per window. 0 disables rate limiting.
+  // @param window_ms The length of the window in milliseconds.
+  void SetRateLimit(uint32_t max_records, uint32_t window_ms);
+
+  // @brief Switches between asynchronous and synchronous writing.
+  // Disabling flushes the queued records and stops the background thread.
+  // @param async Whether to write records from the background thread.
+  // @param capacity The number of records the ring buffer holds.
+  void SetAsync(bool async, size_t capacity = 1024);
+
+  // @brief Waits until all queued records are written to the sink.
+  void Flush();
+
+  // @brief Checks the rate limit of a call site. Used by PROPLINK_LOG.
+  // @param site The rate limiting state of the call site.
+  // @param suppressed Set to the number of records suppressed since the last admitted one.
+  // @return Whether the record should be logged.
+  bool Admit(LogSite& site, uint32_t& suppressed);
+
+  // @brief Logs a record. Used by PROPLINK_LOG.
+  // @param level The severity of the record.
+  // @param message The message of the record.
+  void Log(LogLevel level, std::string message);
+
+ private:
+  Logger();
+  ~Logger() = delete;
+
+  // @brief Background loop that moves records from the ring buffer to the sink.
+  void __WriterLoop();
+
+  // @brief Writes a record to the sink. Must be called with sink_mutex_ held.
+  void __Write(const LogRecord& record);
+
+  std::atomic<LogLevel> level_{LogLevel::Warning};
+  std::atomic<uint32_t> rate_limit_records_{10};
+  std::atomic<uint32_t> rate_limit_window_ms_{1000};
+
+  std::mutex async_mutex_; // Serializes SetAsync().
+
+  std::mutex sink_mutex_;
+  std::shared_ptr<LogSink> sink_;
+
+  // Ring buffer of queued records. head_ is the next to write to the sink, size_ the number of queued records.
+  std::mutex queue_mutex_;
+  std::condition_variable queue_cv_;
+  std::condition_variable flushed_cv_;
+  std::vector<LogRecord> ring_;
+  size_t head_ = 0;
+  size_t size_ = 0;
+  size_t writing_ = 0; // Records taken out of the ring buffer and not yet written.
+  uint64_t dropped_ = 0;
+  bool async_ = false;
+  std::thread writer_thread_;
+};
+
+}
+
+// Logs a record built by streaming 'expr', e.g. PROPLINK_LOG(proplink::LogLevel::Error, "Bad name: " << name).
+// The message is not built unless the severity is enabled and the call site is within its rate limit.
+#define PROPLINK_LOG(level, expr)                                                                  \
+  do {                                                                                             \
+    ::proplink::Logger& proplink_logger_ = ::proplink::Logger::Instance();                         \
+    static ::proplink::LogSite proplink_log_site_;                                                 \
+    uint32_t proplink_suppressed_ = 0;                                                             \
+    if (proplink_logger_.IsEnabled(level) &&                                                       \
+        proplink_logger_.Admit(proplink_log_site_, proplink_suppressed_)) {                        \
+      std::ostringstream proplink_stream_;                                                         \
+      proplink_stream_ << expr;                                                                    \
+      if (proplink_suppressed_ > 0) {                                                              \
+        proplink_stream_ << " (" << proplink_suppressed_ << " similar messages suppressed)";        \
+      }                                                                                            \
+      proplink_logger_.Log(level, proplink_stream_.str());                                         \
+    }                                                                                              \
+  } while (0)
+
+#define PROPLINK_LOG_DEBUG(expr) PROPLINK_LOG(::proplink::LogLevel::Debug, expr)
+#define PROPLINK_LOG_INFO(expr) PROPLINK_LOG(::proplink::LogLevel::Info, expr)
+#define PROPLINK_LOG_WARNING(expr) PROPLINK_LOG(::proplink::LogLevel::Warning, expr)
+#define PROPLINK_LOG_ERROR(expr) PROPLINK_LOG(::proplink::LogLevel::Error, expr)
+
+#endif
@@ -0,0 +1,156 @@
+#ifndef PROPLINK_REFLECTION_H_
+#define PROPLINK_REFLECTION_H_
+
+#include <atomic>
+#include <cstddef>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <variant>
+#include "core.h"
+
+namespace proplink {
+
+// Gets the class and the field type of a pointer to data member.
+template <typename>
+struct MemberPointerTraits;
+
+template <typename C, typename T>
+struct MemberPointerTraits<T C::*> {
+  using Class = C;
+  using Type = T;
+};
+
+template <auto Member>
+using MemberClass = typename MemberPointerTraits<decltype(Member)>::Class;
+
+template <auto Member>
+using MemberType = typename MemberPointerTraits<decltype(Member)>::Type;
+
+// Field of a struct declared by PROPLINK_STRUCT. The name of its variable is "<Type>.<field>".
+template <auto Member>
+struct StructField {
+  static_assert(std::is_same<MemberType<Member>, bool>::value || std::is_same<MemberType<Member>, double>::value ||
+                std::is_same<MemberType<Member>, int>::value || std::is_same<MemberType<Member>, std::string>::value,
+                "Fields of PROPLINK_STRUCT must be bool, double, int or std::string");
+  static constexpr auto member = Member;
+  const char* name;
+};
+
+// @brief Gets the fields of a struct declared by PROPLINK_STRUCT, as a tuple of StructField.
+template <typename T>
+constexpr auto StructFields() {
+  // Found by argument-dependent lookup in the namespace of T.
+  return ProplinkStructFields(static_cast<const T*>(nullptr));
+}
+
+// @brief Gets the number of fields of a struct declared by PROPLINK_STRUCT.
+template <typename T>
+constexpr size_t FieldCount() {
+  return std::tuple_size<decltype(StructFields<T>())>::value;
+}
+
+namespace detail {
+
+inline std::atomic<size_t> next_struct_index{0};
+
+template <auto Member, typename Fields, size_t I = 0>
+constexpr size_t FieldIndex() {
+  static_assert(I < std::tuple_size<Fields>::value, "The member is not declared by PROPLINK_STRUCT");
+  if constexpr (std::is_same<std::tuple_element_t<I, Fields>, StructField<Member>>::value) {
+    return I;
+  } else {
+    return FieldIndex<Member, Fields, I + 1>();
+  }
+}
+
+}  // namespace detail
+
+// @brief Gets the index of a field in its PROPLINK_STRUCT, which identifies it at compile time.
+// e.g. FieldIndex<&Config::offset>() is 1 for PROPLINK_STRUCT(Config, gain, offset, enabled).
+template <auto Member>
+constexpr size_t FieldIndex() {
+  return detail::FieldIndex<Member, decltype(StructFields<MemberClass<Member>>())>();
+}
+
+// @brief Gets a dense index of a struct declared by PROPLINK_STRUCT, assigned on the first call for it,
+// e.g. to keep a table of its fields in a vector.
+template <typename T>
+size_t StructIndex() {
+  static const size_t index = detail::next_struct_index++;
+  return index;
+}
+
+// @brief Gets the name of the variable of a field, computed at compile time.
+// e.g. FieldName<&Config::gain>() is "Config.gain".
+template <auto Member>
+constexpr const char* FieldName() {
+  return std::get<FieldIndex<Member>()>(StructFields<MemberClass<Member>>()).name;
+}
+
+// @brief Converts the value of a field to Value, holding exactly the type of the field.
+template <auto Member>
+Value FieldValue(const MemberType<Member>& value) {
+  return Value(std::in_place_type<MemberType<Member>>, value);
+}
+
+// @brief Calls a function with each StructField of a struct declared by PROPLINK_STRUCT, in the declared order.
+// @param function The function taking a StructField. Its member is decltype(field)::member.
+template <typename T, typename Function>
+void ForEachField(Function&& function) {
+  std::apply([&function](auto... fields) { (function(fields), ...); }, StructFields<T>());
+}
+
+}  // namespace proplink
+
+// Declares the fields of a struct to be exposed as typed variables, in the namespace of the struct.
+// Up to 32 fields of type bool, double, int or std::string.
+// e.g. struct Config { double gain; double offset; bool enabled; };
+//      PROPLINK_STRUCT(Config, gain, offset, enabled)
+#define PROPLINK_STRUCT(Type, ...)                                                                         \
+  [[maybe_unused]] inline constexpr auto ProplinkStructFields(const Type*) {                               \
+    return std::make_tuple(                                                                                \
+        PROPLINK_EXPAND_(PROPLINK_CONCAT_(PROPLINK_FIELDS_, PROPLINK_COUNT_(__VA_ARGS__))(Type, __VA_ARGS__))); \
+  }
+
+#define PROPLINK_FIELD_(Type, field) ::proplink::StructField<&Type::field>{ #Type "." #field }
+#define PROPLINK_EXPAND_(x) x
+#define PROPLINK_CONCAT_(a, b) PROPLINK_CONCAT_IMPL_(a, b)
+#define PROPLINK_CONCAT_IMPL_(a, b) a##b
+#define PROPLINK_COUNT_(...) PROPLINK_EXPAND_(PROPLINK_COUNT_N_(__VA_ARGS__, 32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17, 16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1))
+#define PROPLINK_COUNT_N_(_1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12, _13, _14, _15, _16, _17, _18, _19, _20, _21, _22, _23, _24, _25, _26, _27, _28, _29, _30, _31, _32, N, ...) N
+#define PROPLINK_FIELDS_1(Type, field) PROPLINK_FIELD_(Type, field)
+#define PROPLINK_FIELDS_2(Type, field, ...) PROPLINK_FIELD_(Type, field), PROPLINK_EXPAND_(PROPLINK_FIELDS_1(Type, __VA_ARGS__))
+#define PROPLINK_FIELDS_3(Type, field, ...) PROPLINK_FIELD_(Type, field), PROPLINK_EXPAND_(PROPLINK_FIELDS_2(Type, __VA_ARGS__))
+#define PROPLINK_FIELDS_4(Type, field, ...) PROPLINK_FIELD_(Type, field), PROPLINK_EXPAND_(PROPLINK_FIELDS_3(Type, __VA_ARGS__))
+#define PROPLINK_FIELDS_5(Type, field, ...) PROPLINK_FIELD_(Type, field), PROPLINK_EXPAND_(PROPLINK_FIELDS_4(Type, __VA_ARGS__))
+#define PROPLINK_FIELDS_6(Type, field, ...) PROPLINK_FIELD_(Type, field), PROPLINK_EXPAND_(PROPLINK_FIELDS_5(Type, __VA_ARGS__))
+#define PROPLINK_FIELDS_7(Type, field, ...) PROPLINK_FIELD_(Type, field), PROPLINK_EXPAND_(PROPLINK_FIELDS_6(Type, __VA_ARGS__))
+#define PROPLINK_FIELDS_8(Type, field, ...) PROPLINK_FIELD_(Type, field), PROPLINK_EXPAND_(PROPLINK_FIELDS_7(Type, __VA_ARGS__))
+#define PROPLINK_FIELDS_9(Type, field, ...) PROPLINK_FIELD_(Type, field), PROPLINK_EXPAND_(PROPLINK_FIELDS_8(Type, __VA_ARGS__))
+#define PROPLINK_FIELDS_10(Type, field, ...) PROPLINK_FIELD_(Type, field), PROPLINK_EXPAND_(PROPLINK_FIELDS_9(Type, __VA_ARGS__))
+#define PROPLINK_FIELDS_11(Type, field, ...) PROPLINK_FIELD_(Type, field), PROPLINK_EXPAND_(PROPLINK_FIELDS_10(Type, __VA_ARGS__))
+#define PROPLINK_FIELDS_12(Type, field, ...) PROPLINK_FIELD_(Type, field), PROPLINK_EXPAND_(PROPLINK_FIELDS_11(Type, __VA_ARGS__))
+#define PROPLINK_FIELDS_13(Type, field, ...) PROPLINK_FIELD_(Type, field), PROPLINK_EXPAND_(PROPLINK_FIELDS_12(Type, __VA_ARGS__))
+#define PROPLINK_FIELDS_14(Type, field, ...) PROPLINK_FIELD_(Type, field), PROPLINK_EXPAND_(PROPLINK_FIELDS_13(Type, __VA_ARGS__))
+#define PROPLINK_FIELDS_15(Type, field, ...) PROPLINK_FIELD_(Type, field), PROPLINK_EXPAND_(PROPLINK_FIELDS_14(Type, __VA_ARGS__))
+#define PROPLINK_FIELDS_16(Type, field, ...) PROPLINK_FIELD_(Type, field), PROPLINK_EXPAND_(PROPLINK_FIELDS_15(Type, __VA_ARGS__))
+#define PROPLINK_FIELDS_17(Type, field, ...) PROPLINK_FIELD_(Type, field), PROPLINK_EXPAND_(PROPLINK_FIELDS_16(Type, __VA_ARGS__))
+#define PROPLINK_FIELDS_18(Type, field, ...) PROPLINK_FIELD_(Type, field), PROPLINK_EXPAND_(PROPLINK_FIELDS_17(Type, __VA_ARGS__))
+#define PROPLINK_FIELDS_19(Type, field, ...) PROPLINK_FIELD_(Type, field), PROPLINK_EXPAND_(PROPLINK_FIELDS_18(Type, __VA_ARGS__))
+#define PROPLINK_FIELDS_20(Type, field, ...) PROPLINK_FIELD_(Type, field), PROPLINK_EXPAND_(PROPLINK_FIELDS_19(Type, __VA_ARGS__))
+#define PROPLINK_FIELDS_21(Type, field, ...) PROPLINK_FIELD_(Type, field), PROPLINK_EXPAND_(PROPLINK_FIELDS_20(Type, __VA_ARGS__))
+#define PROPLINK_FIELDS_22(Type, field, ...) PROPLINK_FIELD_(Type, field), PROPLINK_EXPAND_(PROPLINK_FIELDS_21(Type, __VA_ARGS__))
+#define PROPLINK_FIELDS_23(Type, field, ...) PROPLINK_FIELD_(Type, field), PROPLINK_EXPAND_(PROPLINK_FIELDS_22(Type, __VA_ARGS__))
+#define PROPLINK_FIELDS_24(Type, field, ...) PROPLINK_FIELD_(Type, field), PROPLINK_EXPAND_(PROPLINK_FIELDS_23(Type, __VA_ARGS__))
+#define PROPLINK_FIELDS_25(Type, field, ...) PROPLINK_FIELD_(Type, field), PROPLINK_EXPAND_(PROPLINK_FIELDS_24(Type, __VA_ARGS__))
+#define PROPLINK_FIELDS_26(Type, field, ...) PROPLINK_FIELD_(Type, field), PROPLINK_EXPAND_(PROPLINK_FIELDS_25(Type, __VA_ARGS__))
+#define PROPLINK_FIELDS_27(Type, field, ...) PROPLINK_FIELD_(Type, field), PROPLINK_EXPAND_(PROPLINK_FIELDS_26(Type, __VA_ARGS__))
+#define PROPLINK_FIELDS_28(Type, field, ...) PROPLINK_FIELD_(Type, field), PROPLINK_EXPAND_(PROPLINK_FIELDS_27(Type, __VA_ARGS__))
+#define PROPLINK_FIELDS_29(Type, field, ...) PROPLINK_FIELD_(Type, field), PROPLINK_EXPAND_(PROPLINK_FIELDS_28(Type, __VA_ARGS__))
+#define PROPLINK_FIELDS_30(Type, field, ...) PROPLINK_FIELD_(Type, field), PROPLINK_EXPAND_(PROPLINK_FIELDS_29(Type, __VA_ARGS__))
+#define PROPLINK_FIELDS_31(Type, field, ...) PROPLINK_FIELD_(Type, field), PROPLINK_EXPAND_(PROPLINK_FIELDS_30(Type, __VA_ARGS__))
+#define PROPLINK_FIELDS_32(Type, field, ...) PROPLINK_FIELD_(Type, field), PROPLINK_EXPAND_(PROPLINK_FIELDS_31(Type, __VA_ARGS__))
+
+#endif  // PROPLINK_REFLECTION_H_
@@ -0,0 +1,50 @@
+#ifndef PROPLINK_SEQLOCK_H_
+#define PROPLINK_SEQLOCK_H_
+
+#include <atomic>
+#include <cstdint>
+#include <thread>
+
+namespace proplink {
+
+// Sequence lock guarding a block of memory written by one producer thread, which never waits for readers.
+// Readers copy the block and retry if a write overlapped the copy, so the block must be trivially copyable.
+// e.g. producer: lock.WriteBegin(); block.x = 1.0; block.y = 2.0; lock.WriteEnd();
+class SeqLock {
+public:
+  // @brief Marks the start of a write. Must be paired with WriteEnd(), from one thread at a time.
+  void WriteBegin() {
+    sequence_.store(sequence_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+  }
+
+  // @brief Marks the end of a write, publishing it to the readers.
+  void WriteEnd() {
+    sequence_.store(sequence_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+  }
+
+  // @brief Marks the start of a read, waiting while a write is in progress.
+  // @return The sequence to pass to ReadRetry().
+  uint32_t ReadBegin() const {
+    uint32_t sequence;
+    while ((sequence = sequence_.load(std::memory_order_acquire)) & 1) {
+      std::this_thread::yield();
+    }
+    return sequence;
+  }
+
+  // @brief Checks whether a write overlapped the read started by ReadBegin().
+  // @param sequence The sequence returned by ReadBegin().
+  // @return Whether the copied data must be discarded and read again.
+  bool ReadRetry(const uint32_t sequence) const {
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return sequence_.load(std::memory_order_relaxed) != sequence;
+  }
+
+private:
+  std::atomic<uint32_t> sequence_{0}; // Odd while a write is in progress.
+};
+
+}  // namespace proplink
+
+#endif  // PROPLINK_SEQLOCK_H_
@@ -7,16 +7,32 @@
 #include <atomic>
 #include <functional>
 #include <unordered_map>
+#include <unordered_set>
 #include <string>
 #include <vector>
 #include <memory>
 #include <future>
 #include <set>
+#include <map>
+#include <chrono>
+#include <condition_variable>
+#include <type_traits>
 #include "core.h"
+#include "reflection.h"
+#include "seqlock.h"
 #include "thread_pool.h"
 
 namespace proplink {
 
+// Replication state of a replica Server, see Server::GetReplicationStatus().
+struct ReplicationStatus {
+  bool synchronized = false; // Bootstrapped from a snapshot and following the change stream of the primary.
+  uint64_t applied_sequence = 0; // Sequence of the last change applied.
+  uint64_t primary_sequence = 0; // Latest sequence announced by the primary.
+  int64_t lag_ms = 0; // Time from the primary sending the last applied change to applying it, by wall clocks.
+  uint64_t snapshots = 0; // Number of snapshots applied, including the first.
+};
+
 class Server {
  public:
   // @brief Constructs a server with both internal and external endpoints.
@@ -60,22 +76,89 @@ class Server {
    * IMPORTANT: Using the wrong format will cause type mismatch errors when calling SetVariable later.
    * Example: If a variable is registered as an int, calling SetVariable("name", 0.3) will fail
    * with a type mismatch error.
-   * @param variable The variable to register with name, value, and read_only flag.
+   * If the variable is registered with coalesce flag, SETs from Clients which are still waiting in the queue
+   * are superseded by a newer SET of the same variable, so the callback only sees the latest value.
+   * The superseded requests are acknowledged with message "Variable update superseded".
+   * @param variable The variable to register with name, value, read_only and coalesce flags.
    * @param callback Optional callback to be invoked when the variable is changed by a client.
    */
   void RegisterVariable(const Variable& variable, 
                         VariableChangedCallback callback = nullptr);
   
+  // @brief Registers a variable whose value is computed by a provider only when it is read, e.g. disk usage
+  // or a hardware read too expensive to compute continuously. GET, GET_ALL and GetVariable() call the provider
+  // if the cached value is older than 'ttl_ms'. Concurrent reads wait for the one evaluation in progress
+  // instead of calling the provider again. A value which differs from the last one is published.
+  // The variable is read-only for Clients. Calling RegisterVariable() with a Variable of the same name
+  // replaces the provider.
+  // The provider is called once here, so that the schema reports the type of its values from the start.
+  // If it throws, the variable starts as false, and the next read calls the provider again.
+  // @param name The name of the variable.
+  // @param provider The function computing the value. It is called without any lock of the server held.
+  // @param ttl_ms The time in milliseconds a computed value is reused. 0 only shares concurrent evaluations.
+  void RegisterVariable(const std::string& name, VariableProvider provider, const int ttl_ms = 1000);
+
+  // @brief Registers a variable bound to an atomic in application memory, so that the producer only stores to it.
+  // GETs read the memory directly, and the sampler thread compares it with the last published value every
+  // sampling interval and publishes the changes. The variable is read-only for Clients.
+  // Calling RegisterVariable() with the same name unbinds it.
+  // @param name The name of the variable.
+  // @param source The memory holding the value, which must outlive the binding.
+  void BindVariable(const std::string& name, const std::atomic<double>* source);
+
+  // @brief Registers a variable bound to an atomic in application memory. See the overload for std::atomic<double>.
+  // @param name The name of the variable.
+  // @param source The memory holding the value, which must outlive the binding.
+  void BindVariable(const std::string& name, const std::atomic<int>* source);
+
+  // @brief Registers a variable bound to a field of a block guarded by a SeqLock, so that several fields
+  // written together are also read together. See the overload for std::atomic<double>.
+  // @param name The name of the variable.
+  // @param lock The SeqLock the producer holds while writing the block.
+  // @param field The field of the block, of type double, int or bool. It must outlive the binding.
+  template <typename T>
+  void BindVariable(const std::string& name, const SeqLock& lock, const T& field) {
+    static_assert(std::is_same<T, double>::value || std::is_same<T, int>::value || std::is_same<T, bool>::value,
+                  "Bound fields must be double, int or bool");
+    __BindVariable(name, [&lock, &field]() -> Value {
+      T value;
+      uint32_t sequence;
+      do {
+        sequence = lock.ReadBegin();
+        value = field;
+      } while (lock.ReadRetry(sequence));
+      return value;
+    });
+  }
+
+  // @brief Sets how often the sampler thread checks the variables bound to application memory. Defaults to 10 ms.
+  // Must be called before Start().
+  // @param interval_ms The interval in milliseconds.
+  void SetSamplingInterval(const int interval_ms) { sampling_interval_ms_ = interval_ms > 0 ? interval_ms : 1; }
+
   // @brief Registers a trigger with a callback function.
   // Callback function is only called when trigger is executed by the Client.
   // @param trigger The trigger name to register.
   // @param callback The callback function to be invoked when the trigger is executed.
   void RegisterTrigger(const Trigger& trigger, 
                        TriggerCallback callback);
+
+  // @brief Registers a trigger whose callback takes arguments and returns results.
+  // The arguments sent by the Client are passed to the callback, and the returned values are sent back
+  // in the response, so that a parameterized action needs only one round trip.
+  // @param trigger The trigger name to register.
+  // @param callback The callback function to be invoked with the arguments when the trigger is executed.
+  void RegisterTrigger(const Trigger& trigger, 
+                       TriggerWithArgumentsCallback callback);
   
   // @brief Gets all registered variables as a name-value map.
   // @return Map containing all variable names and their current values.
   std::unordered_map<std::string, Value> GetVariables();
+
+  // @brief Gets some variables in one critical section, so that they belong to one version of the store.
+  // @param names The names of the variables.
+  // @return Map of the variables which are registered, by name.
+  std::unordered_map<std::string, Value> GetVariables(const std::vector<std::string>& names);
   
   // @brief Gets the value of a specific variable.
   // @param name The name of the variable to retrieve.
@@ -85,19 +168,202 @@ class Server {
   // @brief Sets the value of a variable from the server side.
   // Note that "read_only" variable can be changed by Server.
   // Also, registered callback is only called when variable is changed by the Client.
-  // This method publishes the change to all connected clients.
+  // This method publishes the change to the clients subscribed to the variable.
+  // If no client is subscribed to it, nothing is serialized nor sent.
   // @param name The name of the variable to set.
   // @param value The new value for the variable.
   void SetVariable(const std::string& name, const Value& value);
 
+  // @brief Registers every field of a struct declared by PROPLINK_STRUCT as a variable named "<Type>.<field>".
+  // @param initial The initial values of the fields.
+  // @param read_only Whether the variables are read-only for Clients.
+  template <typename T>
+  void RegisterStruct(const T& initial, const bool read_only = false) {
+    ForEachField<T>([this, &initial, read_only](auto field) {
+      constexpr auto member = decltype(field)::member;
+      RegisterVariable(Variable(field.name, FieldValue<member>(initial.*member), read_only));
+    });
+    // Resolves the variables of the fields now, so that Get() and GetStruct() don't look them up by name.
+    std::lock_guard<std::mutex> lock(variables_mutex_);
+    __GetStructSlots<T>();
+  }
+
+  // @brief Gets the value of a field registered by RegisterStruct(), typed at compile time.
+  // The variable is indexed by the field, without lookup by name unless it is provided, see RegisterVariable().
+  // e.g. double gain = server.Get<&Config::gain>();
+  // @return The value of the field, or a value-initialized one if it is not registered or has another type.
+  template <auto Member>
+  MemberType<Member> Get() {
+    Value value;
+    std::shared_ptr<const std::string> large_value;
+    bool read = false;
+    {
+      std::lock_guard<std::mutex> lock(variables_mutex_);
+      const std::vector<PropertyWithCallback*>* slots = __GetStructSlots<MemberClass<Member>>();
+      read = slots && __ReadSlot(*(*slots)[FieldIndex<Member>()], value, large_value);
+    }
+    if (!read) {
+      value = GetVariable(FieldName<Member>());
+    } else if (large_value) {
+      value = *large_value; // Copied after unlocking.
+    }
+    const auto* typed = std::get_if<MemberType<Member>>(&value);
+    return typed ? *typed : MemberType<Member>{};
+  }
+
+  // @brief Sets the value of a field registered by RegisterStruct() from the server side. See SetVariable().
+  // @param value The new value of the field.
+  template <auto Member>
+  void Set(const MemberType<Member>& value) {
+    SetVariable(FieldName<Member>(), FieldValue<Member>(value));
+  }
+
+  // @brief Gets the values of all fields of a struct registered by RegisterStruct(), read together so that
+  // a concurrent write is not seen halfway.
+  // @return The struct, whose fields which are not registered or have another type are value-initialized.
+  template <typename T>
+  T GetStruct() {
+    std::vector<Value> values(FieldCount<T>());
+    std::vector<std::shared_ptr<const std::string>> large_values(values.size());
+    bool read = false;
+    {
+      std::lock_guard<std::mutex> lock(variables_mutex_);
+      const std::vector<PropertyWithCallback*>* slots = __GetStructSlots<T>();
+      read = slots != nullptr;
+      for (size_t i = 0; read && i < values.size(); i++) {
+        read = __ReadSlot(*(*slots)[i], values[i], large_values[i]);
+      }
+    }
+    if (read) {
+      // Copied after unlocking.
+      for (size_t i = 0; i < values.size(); i++) {
+        if (large_values[i]) values[i] = *large_values[i];
+      }
+    } else {
+      values.assign(values.size(), Value());
+      std::vector<std::string> names;
+      ForEachField<T>([&names](auto field) { names.push_back(field.name); });
+      const std::unordered_map<std::string, Value> values_by_name = GetVariables(names);
+      for (size_t i = 0; i < values.size(); i++) {
+        auto it = values_by_name.find(names[i]);
+        if (it != values_by_name.end()) values[i] = it->second;
+      }
+    }
+    T result{};
+    size_t index = 0;
+    ForEachField<T>([&result, &values, &index](auto field) {
+      constexpr auto member = decltype(field)::member;
+      if (const auto* typed = std::get_if<MemberType<member>>(&values[index])) result.*member = *typed;
+      index++;
+    });
+    return result;
+  }
+
+  // @brief Sets the units and the range of a variable reported by DESCRIBE. They are descriptive, and not enforced.
+  // @param name The name of the registered variable.
+  // @param metadata The units and the range.
+  void SetVariableMetadata(const std::string& name, const VariableMetadata& metadata);
+
+  // @brief Sets the identity reported to Clients by HELLO. Defaults to the internal router endpoint.
+  // Must be called before Start().
+  // @param server_id The identity of the server.
+  void SetServerId(const std::string& server_id) { server_id_ = server_id; }
+
+  // @brief Enables or disables human-readable messages in responses. Disabled by default,
+  // so that responses carry only the status code and no string is built or sent.
+  // Must be called before Start().
+  // @param verbose Whether to set message and error_message of responses.
+  void SetVerboseResponses(bool verbose) { verbose_responses_ = verbose; }
+
+  // @brief Publishes every change of variables as a sequenced stream, so that replicas can follow this server.
+  // Must be called before Start().
+  // @param replication_endpoint The endpoint to bind the publisher of the change stream to.
+  void EnableReplication(const std::string& replication_endpoint) { replication_endpoint_ = replication_endpoint; }
+
+  // @brief Serves string values larger than a threshold on a separate bulk channel, so that they don't hold up
+  // the other requests and publications. Responses and publications carry a small reference instead, and
+  // Clients read the value in chunks from the bulk endpoint, see Client::SetBulkEndpoint().
+  // A large value is kept in immutable storage, which readers and transfers share without copying it.
+  // Must be called before Start().
+  // @param bulk_endpoint The endpoint to bind the router socket of the bulk channel to.
+  // @param threshold_bytes The size in bytes above which a string value is sent by reference.
+  void EnableBulkChannel(const std::string& bulk_endpoint, const size_t threshold_bytes = 64 * 1024);
+
+  // @brief Makes this server a replica of a primary. The replica bootstraps from a snapshot of the variables
+  // of the primary, then applies its change stream, taking a new snapshot on a gap or a restart of the primary.
+  // GETs and watches are served from the local copy, and changes are published to the local subscribers.
+  // Writes and triggers are forwarded to the primary, or rejected with NOT_ALLOWED.
+  // Must be called before Start().
+  // @param primary_router_endpoint The router endpoint of the primary, used for snapshots and forwarded commands.
+  // @param primary_replication_endpoint The endpoint given to EnableReplication() of the primary.
+  // @param forward_writes Whether to forward writes and triggers to the primary.
+  void SetReplicaOf(const std::string& primary_router_endpoint, 
+                    const std::string& primary_replication_endpoint, 
+                    bool forward_writes = true);
+
+  // @brief Gets the replication state of a replica, e.g. to export the replication lag as a metric.
+  // @return The replication state. Default values if this server is not a replica.
+  ReplicationStatus GetReplicationStatus();
+
 private:
+  // Cache of a variable registered with a provider. Shared so that evaluations run without variables_mutex_.
+  struct ProvidedValue {
+    VariableProvider provider;
+    std::chrono::milliseconds ttl;
+    std::mutex mutex; // Guards the members below.
+    std::condition_variable evaluated_cv;
+    bool evaluating = false;
+    bool valid = false; // Whether the value in the store was computed and expires at 'expiry'.
+    std::chrono::steady_clock::time_point expiry;
+  };
   struct PropertyWithCallback {
-    Value value;
+    Value value; // An empty string while the value is held by large_value.
     bool read_only;
     VariableChangedCallback callback;
+    std::function<Value()> reader; // Reads the application memory the variable is bound to, or nullptr.
+    std::shared_ptr<ProvidedValue> provider; // Computes the value on demand, or nullptr.
+    uint64_t version = 0; // Version of the store when the variable was last changed.
+    uint32_t id = 0; // ID reported by DESCRIBE, see __AssignVariableId().
+    // String value larger than the threshold of the bulk channel, or nullptr, see __MakeLargeValue().
+    // Replaced but never modified, so that readers and transfers share it by copying the pointer.
+    std::shared_ptr<const std::string> large_value;
+    VariableMetadata metadata;
+    // Number of subscribed topics on each publisher that match this variable.
+    size_t internal_subscribers = 0;
+    size_t external_subscribers = 0;
   };
   struct TriggerWithCallback {
     TriggerCallback callback;
+    TriggerWithArgumentsCallback callback_with_arguments;
+  };
+  // Where to send the response of a command.
+  struct Requester {
+    zmq::socket_t* router_socket;
+    std::vector<char> identity;
+    std::vector<char> empty;
+  };
+  struct PendingResponse {
+    Requester requester;
+    ResponseMessage response;
+  };
+  // Identical read commands waiting for one evaluation.
+  struct ReadFlight {
+    CommandMessage command; // Without command_id.
+    std::vector<std::pair<Requester, uint64_t>> requesters; // Requester and its command_id.
+  };
+  // SET_VARIABLE command of a coalesced variable waiting in the queue.
+  struct PendingSet {
+    CommandMessage command;
+    Requester requester;
+  };
+  // WATCH_VARIABLES command parked until a watched variable changes.
+  struct Watch {
+    Requester requester;
+    uint64_t command_id;
+    uint64_t since_version;
+    std::vector<std::string> names;
+    bool has_deadline = false;
+    std::multimap<std::chrono::steady_clock::time_point, std::shared_ptr<Watch>>::iterator deadline;
   };
 
 private:
@@ -107,10 +373,308 @@ private:
   // @brief Main worker loop that handles incoming messages and control signals.
   void __WorkerLoop();
   
+  // @brief Receives a subscribe/unsubscribe notification from an XPUB socket and
+  // updates the subscriber counts of the matching variables.
+  // Must be called only from the worker thread.
+  // @param publisher The XPUB socket that received the notification.
+  // @param topics The set of active topics of the publisher.
+  // @param subscribers The member of PropertyWithCallback that counts the publisher's subscribers.
+  void __HandleSubscription(zmq::socket_t* publisher, 
+                            std::unordered_set<std::string>& topics, 
+                            size_t PropertyWithCallback::*subscribers);
+
+  // @brief Counts the topics that match the name of a variable. ZeroMQ matches topics by prefix.
+  // @param topics The set of active topics of a publisher.
+  // @param name The name of the variable.
+  // @return The number of topics in 'topics' which are prefixes of 'name'.
+  static size_t __CountMatchingTopics(const std::unordered_set<std::string>& topics, 
+                                      const std::string& name);
+
   // @brief Handles incoming router messages by parsing and dispatching to thread pool.
   // @param router_socket The router socket that received the message.
   void __HandleRouterMessage(zmq::socket_t* router_socket);
   
+  // @brief Sends a response to the client which sent the command.
+  // @param requester The router socket and identity of the client.
+  // @param response The response message to send.
+  void __SendResponse(const Requester& requester, const ResponseMessage& response);
+
+  // @brief Sends a response serialized without command_id, prepending the command_id of the requester.
+  // @param requester The router socket and identity of the client.
+  // @param command_id The command_id of the requester.
+  // @param serialized_response The response message serialized without command_id.
+  void __SendResponse(const Requester& requester, 
+                      const uint64_t command_id, 
+                      const std::string& serialized_response);
+
+  // @brief Checks whether a command is a read which can share its evaluation with identical commands.
+  // @param command The command message to check.
+  // @return Whether the command is GET_VARIABLE, GET_ALL_VARIABLES or GET_ALL_TRIGGERS.
+  static bool __IsCoalescibleRead(const CommandMessage& command);
+
+  // @brief Enqueues a read command to the thread pool, or joins an identical one still waiting in the queue.
+  // The joined commands are answered by one evaluation and one serialized payload.
+  // @param command The read command.
+  // @param requester The client to respond to.
+  void __EnqueueCoalescedRead(const CommandMessage& command, const Requester& requester);
+
+  // @brief Enqueues a SET_VARIABLE command of a coalesced variable to the thread pool. If a SET of the same variable
+  // is still waiting in the queue, it is replaced by this one and acknowledged as superseded.
+  // @param command The SET_VARIABLE command.
+  // @param requester The client to respond to.
+  void __EnqueueCoalescedSet(const CommandMessage& command, const Requester& requester);
+
+  // @brief Publishes the value of a variable to its subscribers. Must be called with variables_mutex_ held.
+  // @param name The name of the variable.
+  // @param property The variable to publish.
+  void __PublishVariable(const std::string& name, const PropertyWithCallback& property);
+
+  // @brief Registers a variable whose value is read from application memory.
+  // @param name The name of the variable.
+  // @param reader The function reading the value. It is called with variables_mutex_ held.
+  void __BindVariable(const std::string& name, std::function<Value()> reader);
+
+  // @brief Removes the reader or the provider of a variable. Must be called with variables_mutex_ held.
+  // @param name The name of the variable.
+  // @param property The variable.
+  void __UnbindVariable(const std::string& name, PropertyWithCallback& property);
+
+  // @brief Computes the value of a variable if it has a provider and its cached value expired.
+  // Must be called without variables_mutex_ held.
+  // @param name The name of the variable.
+  void __RefreshProvidedVariable(const std::string& name);
+
+  // @brief Computes the values of all provided variables whose cached values expired, e.g. before GET_ALL.
+  // Must be called without variables_mutex_ held.
+  void __RefreshProvidedVariables();
+
+  // @brief Calls the provider of a variable unless its value is fresh, and stores and publishes the value if it
+  // changed. If another thread is calling the provider, waits for it to store the value instead.
+  // @param name The name of the variable.
+  // @param provided The cache of the variable.
+  void __EvaluateProvider(const std::string& name, ProvidedValue& provided);
+
+  // @brief Starts the sampler thread if it is not running and any variable is bound.
+  void __StartSampler();
+
+  // @brief Loop of the sampler thread, which calls __SampleBoundVariables() every sampling interval.
+  void __SamplerLoop();
+
+  // @brief Reads the variables bound to application memory, and publishes the changed ones.
+  // All of them are sampled in one critical section, and the watches are answered after it.
+  void __SampleBoundVariables();
+
+  // @brief Publishes a change of a variable to the replicas. Must be called with variables_mutex_ held.
+  // @param name The name of the variable.
+  // @param property The changed variable.
+  void __ReplicateVariable(const std::string& name, const PropertyWithCallback& property);
+
+  // @brief Sends a replication message on the replication publisher. Must be called with variables_mutex_ held.
+  // @param message The message to send.
+  void __SendReplicationMessage(const ReplicationMessage& message);
+
+  // @brief Handles REPLICATION_SNAPSHOT command, responding with all variables and the sequence of the last change.
+  // @param command The command message.
+  // @param response The response message to populate with the snapshot.
+  void __HandleReplicationSnapshot(const CommandMessage& command, ResponseMessage& response);
+
+  // @brief Sends the replication heartbeat of a primary, and restarts the bootstrap of a replica whose
+  // primary went silent or didn't answer the snapshot. Called from the worker thread on every iteration.
+  void __ServeReplication();
+
+  // @brief Gets the poll timeout of the worker loop to wake up for __ServeReplication().
+  // @return Milliseconds until the next replication timer, or -1 if replication is not used.
+  long __GetReplicationPollTimeout();
+
+  // @brief Requests a snapshot from the primary. Changes received until it arrives are buffered.
+  void __RequestSnapshot();
+
+  // @brief Receives all pending responses from the primary: the snapshot, or responses of forwarded commands.
+  void __HandlePrimaryResponses();
+
+  // @brief Receives all pending messages of the change stream of the primary.
+  void __HandleReplicationStream();
+
+  // @brief Applies a snapshot of the primary, then the changes buffered while it was awaited.
+  // @param response The response of REPLICATION_SNAPSHOT.
+  void __ApplySnapshot(const ResponseMessage& response);
+
+  // @brief Applies a message of the change stream, or requests a snapshot on a gap or a new epoch.
+  // @param message The message of the change stream.
+  void __ApplyReplicationMessage(const ReplicationMessage& message);
+
+  // @brief Applies a variable of the primary. Must be called with variables_mutex_ held.
+  // @param variable The variable message of the primary.
+  // @param value The value extracted from the message before locking, the empty string if large_value is set.
+  // @param large_value The large value, see __MakeLargeValue(), or nullptr.
+  // @param responses The responses of the completed watches to be sent after variables_mutex_ is released.
+  // @param force Applies the variable even if its version is the current one, e.g. in a snapshot of a new epoch.
+  void __ApplyReplicatedVariable(const VariableMessage& variable, Value value, 
+                                 std::shared_ptr<const std::string> large_value, 
+                                 std::vector<PendingResponse>& responses, 
+                                 const bool force = false);
+
+  // @brief Checks whether a replica sends a command to its primary instead of handling it.
+  // @param command The command message to check.
+  // @return Whether the command is a write, a trigger or GET_ALL_TRIGGERS.
+  static bool __IsForwardedCommand(const CommandMessage& command);
+
+  // @brief Forwards a command of a client to the primary, or rejects it if forwarding is disabled.
+  // @param command The command message.
+  // @param requester The client to respond to.
+  void __ForwardToPrimary(const CommandMessage& command, const Requester& requester);
+
+  // @brief Handles HELLO command in the worker thread, responding with the identity, epoch and capabilities.
+  // @param command The command message.
+  // @param requester The client to respond to.
+  void __HandleHello(const CommandMessage& command, const Requester& requester);
+
+  // @brief Replaces the IDs addressing variables in a command with their names, recursively for operations.
+  // @param command The command message.
+  // @param lock The deferred lock of variables_mutex_, locked only if the command has IDs.
+  void __ResolveVariableIds(CommandMessage& command, std::unique_lock<std::mutex>& lock);
+
+  // @brief Assigns the ID of a new variable, a hash of its name so that it is the same on every server.
+  // A colliding hash is incremented. Must be called with variables_mutex_ held.
+  // @param name The name of the variable.
+  // @param property The variable.
+  void __AssignVariableId(const std::string& name, PropertyWithCallback& property);
+
+  // @brief Gets the hash of the schema reported by DESCRIBE. It is recomputed only if the schema changed,
+  // see schema_generation_.
+  // Must be called with variables_mutex_ held.
+  // @return The hash, which is never 0.
+  uint64_t __GetSchemaHash();
+
+  // @brief Fills a VariableSchemaMessage with the description of a variable.
+  // @param schema The message to fill.
+  // @param name The name of the variable.
+  // @param property The variable.
+  static void __FillSchemaMessage(VariableSchemaMessage* schema, const std::string& name, 
+                                  const PropertyWithCallback& property);
+
+  // @brief Handles WATCH_VARIABLES command in the worker thread.
+  // Responds immediately if any watched variable has changed since the given version,
+  // otherwise parks the command until one changes or it times out.
+  // @param command The command message containing variable names, since_version and timeout_ms.
+  // @param requester The client to respond to.
+  void __HandleWatchVariables(const CommandMessage& command, const Requester& requester);
+
+  // @brief Completes the watches on a changed variable. Must be called with variables_mutex_ held.
+  // @param name The name of the changed variable.
+  // @param responses The responses to be sent after variables_mutex_ is released.
+  void __CollectWatches(const std::string& name, std::vector<PendingResponse>& responses);
+
+  // @brief Removes a watch from watches_by_name_ and watch_deadlines_. Must be called with watches_mutex_ held.
+  // @param watch The watch to remove.
+  void __RemoveWatch(const std::shared_ptr<Watch>& watch);
+
+  // @brief Responds to the watches whose timeout has expired.
+  void __ExpireWatches();
+
+  // @brief Gets the poll timeout of the worker loop to wake up at the earliest watch deadline.
+  // @return Milliseconds until the earliest deadline, or -1 if no watch has deadline.
+  long __GetWatchPollTimeout();
+
+  // @brief Fills a VariableMessage with the name, read_only, version and value of a variable.
+  // A large value is replaced with a reference to the bulk channel. Must be called with variables_mutex_ held.
+  // @param variable The variable message to fill.
+  // @param name The name of the variable.
+  // @param property The variable.
+  // @param full_value Whether to include a large value itself, e.g. for replicas.
+  void __FillVariableMessage(VariableMessage* variable, 
+                             const std::string& name, 
+                             const PropertyWithCallback& property,
+                             const bool full_value = false);
+
+  // @brief Sets the value of a variable to a VariableMessage, or a reference if it is large.
+  // Must be called with variables_mutex_ held.
+  // @param variable The variable message to set value to.
+  // @param property The variable.
+  void __SetPropertyValueToVariableMessage(VariableMessage* variable, const PropertyWithCallback& property);
+
+  // @brief Gets the variables of the fields of a struct registered by RegisterStruct(). They are looked up
+  // by name on the first call, and after a variable was removed. Must be called with variables_mutex_ held.
+  // @return The variables by field index, or nullptr if a field is not registered.
+  template <typename T>
+  const std::vector<PropertyWithCallback*>* __GetStructSlots() {
+    const size_t index = StructIndex<T>();
+    if (index >= struct_slots_.size()) struct_slots_.resize(index + 1);
+    std::vector<PropertyWithCallback*>& slots = struct_slots_[index];
+    if (slots.empty()) {
+      std::vector<PropertyWithCallback*> found;
+      ForEachField<T>([this, &found](auto field) {
+        auto it = variables_.find(field.name);
+        if (it != variables_.end()) found.push_back(&it->second);
+      });
+      if (found.size() != FieldCount<T>()) return nullptr;
+      slots = std::move(found);
+    }
+    return &slots;
+  }
+
+  // @brief Reads a variable found by __GetStructSlots(). Must be called with variables_mutex_ held.
+  // @param property The variable.
+  // @param value Set to the value, unless it is large.
+  // @param large_value Set to the large value, to be copied after unlocking, or nullptr.
+  // @return false if the variable is provided, so that it must be read by name to be computed.
+  static bool __ReadSlot(const PropertyWithCallback& property, Value& value, 
+                         std::shared_ptr<const std::string>& large_value);
+
+  // @brief Gets the large value of a variable, and keeps it readable on the bulk channel.
+  // Must be called with variables_mutex_ held.
+  // @param property The variable.
+  // @return The large value, whose ID on the bulk channel is the version of the variable, or nullptr if the
+  // value is not large.
+  std::shared_ptr<const std::string> __GetLargeValue(const PropertyWithCallback& property);
+
+  // @brief Whether a string value is larger than the threshold of the bulk channel.
+  // @param value The value.
+  // @return False if the bulk channel is disabled.
+  bool __IsLargeValue(const std::string& value) const {
+    return large_value_threshold_ > 0 && value.size() > large_value_threshold_;
+  }
+
+  // @brief Moves a string value larger than the threshold of the bulk channel into immutable storage.
+  // Only moves, so that it may be called with variables_mutex_ held. The value is copied from the caller
+  // or the command before locking.
+  // @param value The value, left as an empty string if it is moved.
+  // @return The storage, or nullptr if the value is not large.
+  std::shared_ptr<const std::string> __MakeLargeValue(Value& value) const;
+
+  // @brief Sets the value of a variable. Must be called with variables_mutex_ held.
+  // @param property The variable.
+  // @param value The value, the empty string if large_value is set.
+  // @param large_value The large value, or nullptr.
+  static void __StoreValue(PropertyWithCallback& property, Value value, 
+                           std::shared_ptr<const std::string> large_value);
+
+  // @brief Whether a variable holds a value. Must be called with variables_mutex_ held.
+  // @param property The variable.
+  // @param value The value, the empty string if large_value is set.
+  // @param large_value The large value, or nullptr.
+  // @return True if the values are equal.
+  static bool __HasValue(const PropertyWithCallback& property, const Value& value, 
+                         const std::shared_ptr<const std::string>& large_value);
+
+  // @brief Gets a value, which copies a large value. Called after variables_mutex_ is unlocked, with the
+  // value and the large value copied under it.
+  // @param value The value, the empty string if large_value is set.
+  // @param large_value The large value, or nullptr.
+  // @return The value.
+  static Value __LoadValue(const Value& value, const std::shared_ptr<const std::string>& large_value) {
+    return large_value ? Value(*large_value) : value;
+  }
+
+  // @brief Handles a READ_LARGE_VALUE request on the bulk channel in the worker thread. The chunk is sent
+  // as a frame referencing the immutable storage, without copying it.
+  void __HandleBulkRequest();
+
+  // @brief Sets Value to VariableMessage based on the value type.
+  // @param variable The variable message to set value to.
+  // @param value The value to set in the message.
+  static void __SetValueToVariableMessage(VariableMessage* variable, const Value& value);
+
   // @brief Processes a command message and returns appropriate response.
   // @param command The command message to process.
   // @return Response message containing the result of the command.
@@ -126,11 +690,78 @@ private:
   // @param response The response message to populate with success status or error.
   void __HandleSetVariable(const CommandMessage& command, ResponseMessage& response);
   
+  // @brief Handles ATOMIC_OPERATION command, which reads and modifies a variable inside one critical section.
+  // A large value is modified outside it, and committed only if the variable did not change meanwhile.
+  // @param command The command message containing the atomic operation.
+  // @param response The response message to populate with the resulting value, or the current value and error on failure.
+  void __HandleAtomicOperation(const CommandMessage& command, ResponseMessage& response);
+
+  // @brief Handles TRANSACTION command. SET_VARIABLE, ATOMIC_OPERATION and EXECUTE_TRIGGER operations are
+  // validated and applied to copies of the variables outside the lock, and committed all-or-nothing inside
+  // one critical section if none of the variables changed meanwhile, then the callbacks run in order.
+  // @param command The command message containing the operations.
+  // @param response The response message to populate with the result of each operation.
+  void __HandleTransaction(const CommandMessage& command, ResponseMessage& response);
+
+  // @brief Handles BATCH command, which packs independent SET_VARIABLE, ATOMIC_OPERATION and EXECUTE_TRIGGER
+  // operations into one message. Each operation is applied in order as if it was sent alone.
+  // @param command The command message containing the operations.
+  // @param response The response message to populate with the result of each operation.
+  void __HandleBatch(const CommandMessage& command, ResponseMessage& response);
+
+  // @brief Assigns the value of VariableMessage to a variable with type checking.
+  // @param name The name of the variable, used for error message.
+  // @param prop The variable message containing new value.
+  // @param value The value of the variable to assign to.
+  // @param changed Set to true if the value is changed.
+  // @param error_message Set to the reason of failure, unless it is nullptr.
+  // @return OK, or TYPE_MISMATCH if the types don't match.
+  static ResponseMessage::StatusCode __AssignValue(const std::string& name, 
+                                                   const VariableMessage& prop, 
+                                                   Value& value, 
+                                                   bool& changed, 
+                                                   std::string* error_message);
+
+  // @brief Applies an atomic operation to the value of a variable. Must be called with variables_mutex_ held.
+  // @param name The name of the variable, used for error message.
+  // @param operation The atomic operation to apply.
+  // @param value The value of the variable to modify.
+  // @param version The version of the variable, compared by COMPARE_AND_SET_VERSION.
+  // @param changed Set to true if the value is changed.
+  // @param error_message Set to the reason of failure, unless it is nullptr.
+  // @return OK if the operation was applied, otherwise the reason of failure.
+  static ResponseMessage::StatusCode __ApplyAtomicOperation(const std::string& name, 
+                                                            const AtomicOperationMessage& operation, 
+                                                            Value& value, 
+                                                            const uint64_t version, 
+                                                            bool& changed, 
+                                                            std::string* error_message);
+
+  // @brief Invokes the callback of a variable changed by the Client, and reports its exception to the response.
+  // @param callback The callback of the variable.
+  // @param value The new value of the variable.
+  // @param response The response message to populate with error if the callback throws.
+  // @return Whether the callback returned without exception.
+  bool __InvokeVariableCallback(const VariableChangedCallback& callback, 
+                                const Value& value, 
+                                ResponseMessage& response) const;
+
   // @brief Handles GET_ALL_VARIABLES command.
   // @param command The command message.
   // @param response The response message to populate with all variables data.
   void __HandleGetAllVariables(const CommandMessage& command, ResponseMessage& response);
   
+  // @brief Handles GET_VARIABLES command. All values are read in one critical section, so they belong to one
+  // version of the store. Only the values are copied in it, and the response is built after it.
+  // @param command The command message containing the names of the variables.
+  // @param response The response message to populate with the variables and the version of the store.
+  void __HandleGetVariables(const CommandMessage& command, ResponseMessage& response);
+
+  // @brief Handles DESCRIBE command. The schema is sent only if it differs from the one cached by the client.
+  // @param command The command message containing the hash of the cached schema.
+  // @param response The response message to populate with the schema.
+  void __HandleDescribe(const CommandMessage& command, ResponseMessage& response);
+
   // @brief Handles GET_ALL_TRIGGERS command.
   // @param command The command message.
   // @param response The response message to populate with all trigger names.
@@ -142,9 +773,46 @@ private:
   void __HandleExecuteTrigger(const CommandMessage& command, ResponseMessage& response);
   
   // @brief Executes a trigger by calling its registered callback.
-  // @param trigger_name The name of the trigger to execute.
+  // @param trigger The trigger message containing name and arguments.
+  // @param response The response message to populate with the results or error.
   // @return Whether the trigger was found and executed successfully.
-  bool __ExecuteTrigger(const std::string& trigger_name);
+  bool __ExecuteTrigger(const TriggerMessage& trigger, ResponseMessage& response);
+
+  // @brief Calls the callback of a trigger with the arguments of the trigger message.
+  // @param callback The registered callbacks of the trigger.
+  // @param trigger The trigger message containing arguments.
+  // @param response The response message to populate with the results, or error if the callback throws.
+  // @return Whether the callback returned without exception.
+  bool __InvokeTriggerCallback(const TriggerWithCallback& callback, 
+                               const TriggerMessage& trigger, 
+                               ResponseMessage& response) const;
+
+  // @brief Sets the status code of a response. The human-readable message is made and set
+  // only if verbose responses are enabled, so that the common path doesn't build strings.
+  // @param response The response message to set the status to.
+  // @param status The status code. OK, SUPERSEDED and EXPIRED are reported as success.
+  // @param make_message Function returning the human-readable message.
+  template <typename MessageMaker>
+  void __SetStatus(ResponseMessage& response, 
+                   const ResponseMessage::StatusCode status, 
+                   MessageMaker&& make_message) const {
+    const bool success = status == ResponseMessage::OK || 
+                         status == ResponseMessage::SUPERSEDED || 
+                         status == ResponseMessage::EXPIRED;
+    response.set_success(success);
+    response.set_status(status);
+    if (!verbose_responses_) return;
+    if (success) {
+      response.set_message(make_message());
+    } else {
+      response.set_error_message(make_message());
+    }
+  }
+
+  // @brief Extracts Value from VariableMessage based on the message type.
+  // @param variable The variable message to extract value from.
+  // @return The extracted Value object.
+  static Value __ExtractValue(const VariableMessage& variable);
 
 private:
   zmq::context_t context_;
@@ -162,16 +830,100 @@ private:
   std::string external_pub_endpoint_;
   std::unique_ptr<zmq::socket_t> internal_publisher_; 
   std::unique_ptr<zmq::socket_t> external_publisher_;
+  // Topics subscribed on each publisher. Guarded by variables_mutex_, like the publishers themselves.
+  std::unordered_set<std::string> internal_topics_;
+  std::unordered_set<std::string> external_topics_;
   
   ThreadPool thread_pool_;
   std::thread worker_thread_;
   std::atomic<bool> running_;
+  bool verbose_responses_ = false;
+  std::string server_id_;
+  uint64_t epoch_ = 0; // Set on every Start().
   
+  // Read commands enqueued and not yet evaluated, keyed by the serialized command without command_id.
+  std::mutex read_flights_mutex_;
+  std::unordered_map<std::string, std::shared_ptr<ReadFlight>> read_flights_;
+
+  // Names of variables registered with coalesce flag, and their SETs waiting in the queue.
+  // Kept apart from variables_ so that the worker thread does not contend for variables_mutex_.
+  std::mutex pending_sets_mutex_;
+  std::unordered_set<std::string> coalesced_variables_;
+  std::unordered_map<std::string, PendingSet> pending_sets_;
+
   std::mutex variables_mutex_;
   std::unordered_map<std::string, PropertyWithCallback> variables_;
+  // Variables of the fields of the structs by StructIndex() and field index, see __GetStructSlots().
+  // Elements of variables_ keep their address until erased, which clears this.
+  std::vector<std::vector<PropertyWithCallback*>> struct_slots_;
+  uint64_t version_ = 0; // Incremented on every change of variables. Guarded by variables_mutex_.
+
+  // Parked WATCH_VARIABLES commands. Lock order: variables_mutex_, then watches_mutex_.
+  std::mutex watches_mutex_;
+  std::unordered_map<std::string, std::vector<std::shared_ptr<Watch>>> watches_by_name_;
+  std::multimap<std::chrono::steady_clock::time_point, std::shared_ptr<Watch>> watch_deadlines_;
+  // Number of parked watches of each requester, by router socket and identity. Beyond the limit,
+  // WATCH_VARIABLES is answered NOT_ALLOWED, so that one peer can't park watches without bound.
+  static constexpr size_t kMaxWatchesPerRequester = 64;
+  std::map<std::pair<const zmq::socket_t*, std::vector<char>>, size_t> watches_per_requester_;
   
   std::mutex triggers_mutex_;
   std::unordered_map<std::string, TriggerWithCallback> triggers_;
+
+  // Bulk channel of large values.
+  static constexpr long kLargeValueRetentionMs = 30000; // Time a large value stays readable after its last reference.
+  static constexpr uint32_t kMaxLargeValueChunkSize = 1024 * 1024;
+  struct LargeValueEntry {
+    std::shared_ptr<const std::string> data;
+    std::chrono::steady_clock::time_point expiry;
+  };
+  std::string bulk_endpoint_;
+  size_t large_value_threshold_ = 0; // 0 if the bulk channel is disabled.
+  std::unique_ptr<zmq::socket_t> bulk_router_; // Used only by the worker thread.
+  std::mutex large_values_mutex_; // Guards large_values_. Locked after variables_mutex_.
+  std::unordered_map<uint64_t, LargeValueEntry> large_values_; // Readable large values by ID.
+
+  // Replication. The publisher of a primary is guarded by variables_mutex_, like the other publishers.
+  // The sockets and state of a replica are used only by the worker thread.
+  static constexpr long kReplicationHeartbeatMs = 1000;
+  std::string replication_endpoint_;
+  std::unique_ptr<zmq::socket_t> replication_publisher_;
+  uint64_t replication_sequence_ = 0; // Sequence of the last published change. Guarded by variables_mutex_.
+  std::chrono::steady_clock::time_point last_replication_heartbeat_;
+
+  std::string primary_router_endpoint_; // Empty unless this server is a replica.
+  std::string primary_replication_endpoint_;
+  bool forward_writes_ = true;
+  std::unique_ptr<zmq::socket_t> primary_dealer_;
+  std::unique_ptr<zmq::socket_t> replication_subscriber_;
+  uint64_t primary_epoch_ = 0;
+  uint64_t applied_sequence_ = 0;
+  uint64_t snapshot_command_id_ = 0; // Command ID of the awaited snapshot, or 0.
+  std::chrono::steady_clock::time_point snapshot_requested_time_;
+  std::chrono::steady_clock::time_point last_stream_time_;
+  std::vector<ReplicationMessage> stream_buffer_; // Changes received while the snapshot is awaited.
+  uint64_t next_primary_command_id_ = 1;
+  // Commands forwarded to the primary, by the command ID sent to the primary.
+  std::unordered_map<uint64_t, std::pair<Requester, uint64_t>> forwarded_commands_;
+
+  std::mutex replication_status_mutex_;
+  ReplicationStatus replication_status_;
+
+  // Sampling of the variables bound to application memory.
+  int sampling_interval_ms_ = 10;
+  std::vector<std::string> bound_variables_; // Guarded by variables_mutex_.
+  std::vector<std::string> provided_variables_; // Variables having a provider. Guarded by variables_mutex_.
+
+  // Schema reported by DESCRIBE. Guarded by variables_mutex_.
+  std::unordered_map<uint32_t, std::string> variable_ids_; // Names of the variables by ID.
+  uint64_t schema_hash_ = 0;
+  // Incremented when a variable is registered or removed, or its type, read_only or metadata changes,
+  // but not when only its value changes.
+  uint64_t schema_generation_ = 0;
+  uint64_t schema_hash_generation_ = UINT64_MAX; // schema_generation_ when schema_hash_ was computed.
+  std::mutex sampler_mutex_; // Guards sampler_thread_ and the wait of the sampler thread.
+  std::condition_variable sampler_cv_;
+  std::thread sampler_thread_;
 };
 
 }
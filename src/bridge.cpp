@@ -0,0 +1,103 @@
+#include "bridge.h"
+#include "logger.h"
+
+namespace proplink {
+
+Bridge::Bridge(const std::string& a_dealer_endpoint, const std::string& a_sub_endpoint,
+               const std::string& b_dealer_endpoint, const std::string& b_sub_endpoint)
+    : a_(a_dealer_endpoint, a_sub_endpoint, runtime_),
+      b_(b_dealer_endpoint, b_sub_endpoint, runtime_),
+      forwarded_(0),
+      suppressed_(0) {
+}
+
+Bridge::~Bridge() {
+  Stop();
+}
+
+Bridge& Bridge::MapVariable(const std::string& from, const std::string& to, const BridgeDirection direction) {
+  const int from_side = static_cast<int>(direction);
+  __GetClient(from_side).RegisterCallback(from, [this, from_side, from, to](const Value& value) {
+    __Forward(from_side, from, to, value);
+  });
+  return *this;
+}
+
+Bridge& Bridge::MapPrefix(const std::string& from_prefix, const std::string& to_prefix,
+                          const BridgeDirection direction) {
+  const int from_side = static_cast<int>(direction);
+  __GetClient(from_side).RegisterPrefixCallback(from_prefix,
+      [this, from_side, from_prefix, to_prefix](const std::string& name, const Value& value) {
+        __Forward(from_side, name, to_prefix + name.substr(from_prefix.size()), value);
+      });
+  return *this;
+}
+
+bool Bridge::Start(const int max_delay_ms, const size_t max_batch_size) {
+  a_.SetWriteCombining(max_delay_ms, max_batch_size);
+  b_.SetWriteCombining(max_delay_ms, max_batch_size);
+  if (!a_.Open() || !b_.Open()) {
+    PROPLINK_LOG_ERROR("Bridge failed to connect to both servers");
+    Stop();
+    return false;
+  }
+  // The subscriptions only deliver changes, so the mapped variables start from the current values.
+  a_.Resync();
+  b_.Resync();
+  return true;
+}
+
+void Bridge::Stop() {
+  a_.Close();
+  b_.Close();
+  std::lock_guard<std::mutex> lock(written_mutex_);
+  written_[0].clear();
+  written_[1].clear();
+}
+
+void Bridge::__Forward(const int from_side, const std::string& from_name, const std::string& to_name,
+                       const Value& value) {
+  const int to_side = 1 - from_side;
+  const auto now = std::chrono::steady_clock::now();
+  {
+    std::lock_guard<std::mutex> lock(written_mutex_);
+    // The source publishing the value the bridge wrote to it, through a mapping of the other direction
+    // and a callback of the server setting it again.
+    auto echo = written_[from_side].find(from_name);
+    if (echo != written_[from_side].end()) {
+      const bool is_echo = echo->second.expiry >= now && echo->second.value == value;
+      written_[from_side].erase(echo); // Later changes of the source are its own.
+      if (is_echo) {
+        suppressed_++;
+        return;
+      }
+    }
+    auto written = written_[to_side].find(to_name);
+    if (written != written_[to_side].end() && written->second.expiry >= now && written->second.value == value) {
+      suppressed_++;
+      return;
+    }
+    // Until the SET is answered, the window counts from now. Write combining delays the SET.
+    written_[to_side][to_name] = { value, now + std::chrono::milliseconds(kEchoWindowMs) };
+  }
+
+  forwarded_++;
+  __GetClient(to_side).SetVariable(to_name, value, AsyncConnection,
+      [this, to_side, to_name, value](const ResponseMessage& response) {
+        std::lock_guard<std::mutex> lock(written_mutex_);
+        auto written = written_[to_side].find(to_name);
+        // Unless a later write or the echo replaced or removed the entry.
+        if (written == written_[to_side].end() || !(written->second.value == value)) return;
+        if (response.success()) {
+          // An echo, if any, is published right after the write.
+          written->second.expiry = std::chrono::steady_clock::now() + std::chrono::milliseconds(kEchoWindowMs);
+          return;
+        }
+        PROPLINK_LOG_WARNING("Bridge failed to set '" << to_name << "': " <<
+                             ResponseMessage::StatusCode_Name(response.status()));
+        // Not written, so the next publication of the same value is not an echo.
+        written_[to_side].erase(written);
+      });
+}
+
+}  // namespace proplink
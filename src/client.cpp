@@ -1,6 +1,9 @@
 #include "client.h"
+#include "logger.h"
 #include <iostream>
 #include <chrono>
+#include <algorithm>
+#include <sstream>
 
 #ifdef _WIN32
 #include <windows.h>
@@ -58,76 +61,326 @@ std::string GenerateUniqueIdentity() {
 }
 #endif
 
+Transaction& Transaction::SetVariable(const std::string& name, const Value& value) {
+  operations_.push_back({ CommandMessage::SET_VARIABLE, AtomicOperationMessage::COMPARE_AND_SET_VALUE, 
+                          name, value, Value{}, 0, {} });
+  return *this;
+}
+
+Transaction& Transaction::CompareAndSetVariable(const std::string& name, const Value& expected, const Value& desired) {
+  operations_.push_back({ CommandMessage::ATOMIC_OPERATION, AtomicOperationMessage::COMPARE_AND_SET_VALUE, 
+                          name, desired, expected, 0, {} });
+  return *this;
+}
+
+Transaction& Transaction::CompareAndSetVariableVersion(const std::string& name, const uint64_t expected_version, 
+                                                       const Value& desired) {
+  operations_.push_back({ CommandMessage::ATOMIC_OPERATION, AtomicOperationMessage::COMPARE_AND_SET_VERSION, 
+                          name, desired, Value{}, expected_version, {} });
+  return *this;
+}
+
+Transaction& Transaction::AddToVariable(const std::string& name, const Value& delta) {
+  operations_.push_back({ CommandMessage::ATOMIC_OPERATION, AtomicOperationMessage::ADD, 
+                          name, delta, Value{}, 0, {} });
+  return *this;
+}
+
+Transaction& Transaction::ToggleVariable(const std::string& name) {
+  operations_.push_back({ CommandMessage::ATOMIC_OPERATION, AtomicOperationMessage::TOGGLE, 
+                          name, Value{}, Value{}, 0, {} });
+  return *this;
+}
+
+Transaction& Transaction::ExecuteTrigger(const std::string& trigger_name, const std::vector<Value>& arguments) {
+  operations_.push_back({ CommandMessage::EXECUTE_TRIGGER, AtomicOperationMessage::COMPARE_AND_SET_VALUE, 
+                          trigger_name, Value{}, Value{}, 0, arguments });
+  return *this;
+}
+
+size_t Transaction::size() const { return operations_.size(); }
+
+namespace {
+
+// Names an inproc endpoint uniquely, since inproc endpoints collide between objects sharing a context.
+std::string MakeControlEndpoint(const void* owner) {
+  std::ostringstream endpoint;
+  endpoint << "inproc://proplink-control-" << owner;
+  return endpoint.str();
+}
+
+}
+
+ClientRuntime::ClientRuntime()
+    : context_(1),
+      control_endpoint_(MakeControlEndpoint(this)),
+      running_(false),
+      iteration_(0) {
+}
+
+ClientRuntime::~ClientRuntime() {
+  Stop();
+}
+
+bool ClientRuntime::Start() {
+  std::lock_guard<std::mutex> lock(start_mutex_);
+  if (running_) return true;
+  try {
+    inproc_socket_ = std::make_unique<zmq::socket_t>(context_, ZMQ_PAIR);
+    inproc_socket_->bind(control_endpoint_);
+    {
+      std::lock_guard<std::mutex> control_lock(control_mutex_);
+      control_socket_ = std::make_unique<zmq::socket_t>(context_, ZMQ_PAIR);
+      control_socket_->connect(control_endpoint_);
+    }
+    running_ = true;
+    worker_thread_ = std::thread(&ClientRuntime::__WorkerLoop, this);
+    return true;
+  } catch (const zmq::error_t& e) {
+    PROPLINK_LOG_ERROR("ZeroMQ error in ClientRuntime::Start(): " << e.what() << " (errno: " << e.num() << ")");
+    if (inproc_socket_) inproc_socket_->close();
+    std::lock_guard<std::mutex> control_lock(control_mutex_);
+    control_socket_.reset();
+    return false;
+  }
+}
+
+void ClientRuntime::Stop() {
+  std::lock_guard<std::mutex> lock(start_mutex_);
+  if (!running_) return;
+  running_ = false;
+  __Wake();
+  if (worker_thread_.joinable()) worker_thread_.join();
+  if (inproc_socket_) inproc_socket_->close();
+  std::lock_guard<std::mutex> control_lock(control_mutex_);
+  control_socket_.reset();
+}
+
+bool ClientRuntime::__Attach(Client* client) {
+  if (!Start()) return false;
+  {
+    std::lock_guard<std::mutex> lock(clients_mutex_);
+    clients_.push_back(client);
+  }
+  __Wake();
+  return true;
+}
+
+void ClientRuntime::__Detach(Client* client) {
+  uint64_t iteration;
+  {
+    std::lock_guard<std::mutex> lock(clients_mutex_);
+    clients_.erase(std::remove(clients_.begin(), clients_.end(), client), clients_.end());
+    iteration = iteration_;
+  }
+  // Called from a callback, the worker loop checks the membership before touching the client again.
+  if (!running_ || std::this_thread::get_id() == worker_thread_.get_id()) return;
+
+  // Otherwise, waits until the worker loop takes a new snapshot of clients_, which excludes the client.
+  __Wake();
+  std::unique_lock<std::mutex> lock(clients_mutex_);
+  iteration_cv_.wait(lock, [this, iteration] { return iteration_ != iteration || !running_; });
+}
+
+bool ClientRuntime::__IsAttached(const Client* client) {
+  std::lock_guard<std::mutex> lock(clients_mutex_);
+  return std::find(clients_.begin(), clients_.end(), client) != clients_.end();
+}
+
+void ClientRuntime::__Wake() {
+  std::lock_guard<std::mutex> lock(control_mutex_);
+  if (!control_socket_) return;
+  control_socket_->send(zmq::message_t(), ZMQ_DONTWAIT);
+}
+
+void ClientRuntime::__WorkerLoop() {
+  std::vector<Client*> clients;
+  std::vector<zmq::pollitem_t> items;
+  std::vector<size_t> first_items; // Index in items of the first item of each client.
+  while (running_) {
+    {
+      std::lock_guard<std::mutex> lock(clients_mutex_);
+      clients = clients_;
+      iteration_++;
+    }
+    iteration_cv_.notify_all();
+
+    // Timed work of each client, and the sockets to poll, which reconnection may have replaced.
+    long timeout = -1;
+    items.clear();
+    first_items.clear();
+    items.push_back({ static_cast<void*>(*inproc_socket_), 0, ZMQ_POLLIN, 0 });
+    for (auto it = clients.begin(); it != clients.end();) {
+      Client* client = *it;
+      if (!__IsAttached(client) || !client->running_) {
+        it = clients.erase(it);
+        continue;
+      }
+      client->__Heartbeat();
+      if (!client->__Reconnect()) {
+        it = clients.erase(it);
+        continue;
+      }
+      client->__SubscribePending();
+      if (client->__GetBatchPollTimeout() == 0) client->__FlushBatch();
+      const long client_timeout = client->__GetPollTimeout();
+      if (client_timeout >= 0) timeout = timeout < 0 ? client_timeout : std::min(timeout, client_timeout);
+      first_items.push_back(items.size());
+      client->__AppendPollItems(items);
+      ++it;
+    }
+
+    zmq::poll(items, timeout);
+
+    if (items[0].revents & ZMQ_POLLIN) {
+      // Only wakes the loop up. Drains all, since several threads may have sent.
+      zmq::message_t msg;
+      while (inproc_socket_->recv(&msg, ZMQ_DONTWAIT)) {}
+    }
+    for (size_t i = 0; i < clients.size(); i++) {
+      Client* client = clients[i];
+      // Items of the dealers of the client, followed by its subscriber.
+      const auto first = items.begin() + first_items[i];
+      const auto last = (i + 1 < clients.size() ? items.begin() + first_items[i + 1] : items.end()) - 1;
+      // A callback of another client may have closed this one.
+      if (std::any_of(first, last, [](const zmq::pollitem_t& item) { return item.revents & ZMQ_POLLIN; }) &&
+          __IsAttached(client)) {
+        client->__ProcessDealer();
+      }
+      if ((last->revents & ZMQ_POLLIN) && __IsAttached(client)) {
+        client->__ProcessSubscriber();
+      }
+    }
+  }
+  iteration_cv_.notify_all();
+}
+
 Client::Client(const std::string& dealer_endpoint, const std::string& sub_endpoint)
-    : dealer_endpoint_(dealer_endpoint),
-      sub_endpoint_(sub_endpoint), 
-      context_(1),
+    : Client({ ServerEndpoint{ dealer_endpoint, sub_endpoint } }, nullptr) {
+}
+
+Client::Client(const std::string& dealer_endpoint, const std::string& sub_endpoint, ClientRuntime& runtime)
+    : Client({ ServerEndpoint{ dealer_endpoint, sub_endpoint } }, &runtime) {
+}
+
+Client::Client(const std::vector<ServerEndpoint>& endpoints)
+    : Client(endpoints, nullptr) {
+}
+
+Client::Client(const std::vector<ServerEndpoint>& endpoints, ClientRuntime& runtime)
+    : Client(endpoints, &runtime) {
+}
+
+Client::Client(const std::vector<ServerEndpoint>& endpoints, ClientRuntime* runtime)
+    : own_context_(runtime ? nullptr : std::make_unique<zmq::context_t>(1)),
+      context_(runtime ? &runtime->context_ : own_context_.get()),
+      runtime_(runtime),
+      control_endpoint_(MakeControlEndpoint(this)),
+      dealer_pool_size_(PROPLINK_SOCK_POOL_SIZE),
+      next_dealer_(0),
       opened_(false),
       command_id_(0),
-      request_timeout_ms_(1000) {
+      request_timeout_ms_(1000),
+      threadless_(false),
+      need_reconnect_(false),
+      reconnect_attempts_(0),
+      primary_index_(0),
+      heartbeat_interval_ms_(0),
+      heartbeat_timeout_ms_(0),
+      batch_max_delay_ms_(0),
+      batch_max_size_(1) {
+  for (const auto& endpoint : endpoints) {
+    if (endpoint.replica) {
+      replicas_.push_back(std::make_unique<ReplicaConnection>());
+      replicas_.back()->endpoint = endpoint.dealer_endpoint;
+    } else {
+      primaries_.push_back(endpoint);
+    }
+  }
+  primary_health_.resize(primaries_.size());
+  if (!primaries_.empty()) {
+    dealer_endpoint_ = primaries_.front().dealer_endpoint;
+    sub_endpoint_ = primaries_.front().sub_endpoint;
+  }
 }
 
 Client::~Client() {
   Close();
 }
 
-bool Client::Open(const int socket_timeout_ms) {
+bool Client::Open(const int socket_timeout_ms, const int wait_for_server_ms) {
   if (opened_) {
     return true;
   }
+  if (primaries_.empty()) {
+    PROPLINK_LOG_ERROR("No primary endpoint to connect to");
+    return false;
+  }
   
   try {
     request_timeout_ms_ = socket_timeout_ms;
 
     //std::cout << "Creating socket to connect to " << dealer_endpoint_ << std::endl;
-    dealer_ = std::make_unique<zmq::socket_t>(context_, ZMQ_DEALER);
-
-    int hwm = 1000;
-    dealer_->setsockopt(ZMQ_SNDHWM, &hwm, sizeof(hwm));
-    dealer_->setsockopt(ZMQ_RCVHWM, &hwm, sizeof(hwm));
-
-    dealer_->setsockopt(ZMQ_RCVTIMEO, &request_timeout_ms_, sizeof(request_timeout_ms_));
-    dealer_->setsockopt(ZMQ_SNDTIMEO, &request_timeout_ms_, sizeof(request_timeout_ms_));
-
-#ifdef _WIN32
-    std::string identity = GenerateUniqueIdentity();
-    dealer_->setsockopt(ZMQ_IDENTITY, identity.c_str(), identity.length());
-#endif
-
-    dealer_->connect(dealer_endpoint_);
-
-    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    __OpenDealers();
+    __OpenReplicas();
     
-    subscriber_ = std::make_unique<zmq::socket_t>(context_, ZMQ_SUB);
-    subscriber_->setsockopt(ZMQ_SUBSCRIBE, "", 0); // Subscribes all messages.
+    subscriber_ = std::make_unique<zmq::socket_t>(*context_, ZMQ_SUB);
+    __ApplyHeartbeatOptions(*subscriber_);
+    __SubscribeAll(); // Subscribes only the variables having callback.
     subscriber_->connect(sub_endpoint_);
     
-    inproc_socket_ = std::make_unique<zmq::socket_t>(context_, ZMQ_PAIR);
-    inproc_socket_->bind("inproc://control");
+    if (!threadless_ && !runtime_) {
+      inproc_socket_ = std::make_unique<zmq::socket_t>(*context_, ZMQ_PAIR);
+      inproc_socket_->bind(control_endpoint_);
+      std::lock_guard<std::mutex> lock(control_mutex_);
+      control_socket_ = std::make_unique<zmq::socket_t>(*context_, ZMQ_PAIR);
+      control_socket_->connect(control_endpoint_);
+    }
 
-    if (dealer_->connected() && subscriber_->connected()) {
+    if (__DealersConnected() && subscriber_->connected()) {
       opened_ = true;
       running_ = true;
-      worker_thread_ = std::thread(&Client::__WorkerLoop, this);
+      need_reconnect_ = false;
+      reconnect_attempts_ = 0;
+      last_received_time_ = std::chrono::steady_clock::now();
+      last_heartbeat_time_ = last_received_time_;
+      if (runtime_) {
+        // The runtime's worker thread services the sockets from now on.
+        if (!runtime_->__Attach(this)) {
+          opened_ = false;
+          running_ = false;
+          __CloseDealers();
+          subscriber_->close();
+        }
+      } else if (!threadless_) {
+        worker_thread_ = std::thread(&Client::__WorkerLoop, this);
+      }
     } else {
-      std::cerr << "Failed to connect to server" << std::endl;
-      if (dealer_) dealer_->close();
+      PROPLINK_LOG_ERROR("Failed to connect to server");
+      __CloseDealers();
       if (subscriber_) subscriber_->close();
       if (inproc_socket_) inproc_socket_->close();
+      if (control_socket_) control_socket_->close();
+    }
+    if (opened_ && !__Handshake(wait_for_server_ms)) {
+      PROPLINK_LOG_ERROR("Server did not respond within " << wait_for_server_ms << " ms");
+      Close();
     }
     return opened_;
   } catch (const zmq::error_t& e) {
-    std::cerr << "ZeroMQ error in Open(): " << e.what() << " (errno: " << e.num() << ")" << std::endl;
-    if (dealer_) dealer_->close();
+    PROPLINK_LOG_ERROR("ZeroMQ error in Open(): " << e.what() << " (errno: " << e.num() << ")");
+    __CloseDealers();
     if (subscriber_) subscriber_->close();
     if (inproc_socket_) inproc_socket_->close();
+    if (control_socket_) control_socket_->close();
     opened_ = false;
     return false;
   } catch (const std::exception& e) {
-    std::cerr << "Exception in Open(): " << e.what() << std::endl;
-    if (dealer_) dealer_->close();
+    PROPLINK_LOG_ERROR("Exception in Open(): " << e.what());
+    __CloseDealers();
     if (subscriber_) subscriber_->close();
     if (inproc_socket_) inproc_socket_->close();
+    if (control_socket_) control_socket_->close();
     opened_ = false;
     return false;
   }
@@ -135,42 +388,59 @@ bool Client::Open(const int socket_timeout_ms) {
 
 void Client::Close() {
   if (running_) {
+    __FlushBatch(); // Writes waiting for combining are not dropped.
     running_ = false;
 
-    zmq::socket_t s(context_, ZMQ_PAIR);
-    s.connect("inproc://control");
-    zmq::message_t msg(5);
-    memcpy(msg.data(), "STOP", 5);
-    s.send(msg);
+    if (runtime_) {
+      runtime_->__Detach(this);
+    } else {
+      __SendControlMessage("STOP");
+    }
 
     if (worker_thread_.joinable()) worker_thread_.join();
-    if (dealer_) dealer_->close();
+    __StopBulkThread();
+    __CloseDealers();
+    {
+      std::lock_guard<std::mutex> bulk_lock(bulk_mutex_);
+      bulk_dealer_.reset();
+    }
     if (subscriber_) subscriber_->close();
     if (inproc_socket_) inproc_socket_->close();
+    std::lock_guard<std::mutex> lock(control_mutex_);
+    control_socket_.reset();
   }
   if (opened_) opened_ = false;
 }
 
 Value Client::GetVariable(const std::string& name) {
+  return __GetVariable(name, 0);
+}
+
+Value Client::__GetVariable(const std::string& name, const uint32_t id) {
   if (!opened_ && !Open()) {
-    std::cerr << "Not connected to server" << std::endl;
+    PROPLINK_LOG_WARNING("Not connected to server");
     return Value{};
   }
   
   CommandMessage cmd;
   cmd.set_command_id(__GetNextCommandId());
   cmd.set_command_type(CommandMessage::GET_VARIABLE);
-  cmd.set_variable_name(name);
+  if (id != 0) {
+    cmd.mutable_variable()->set_id(id);
+  } else {
+    cmd.set_variable_name(name);
+  }
   
   ResponseMessage response = __SendCommandSync(cmd);
   
-  if (response.success() && response.has_variable()) {
-    return __ExtractValue(response.variable());
+  Value value;
+  if (response.success() && response.has_variable() && __ExtractValue(response.variable(), value)) {
+    return value;
   }
   
   if (!response.success()) {
-    std::cerr << "Error getting variable '" << name << "': " 
-              << response.error_message() << std::endl;
+    PROPLINK_LOG_ERROR("Error getting variable '" << name << "': " 
+                       << __DescribeStatus(response));
   }
   
   return Value{};
@@ -179,7 +449,7 @@ Value Client::GetVariable(const std::string& name) {
 bool Client::GetVariable(const std::string& name,
                    std::function<void(const ResponseMessage&)> callback) {
   if (!opened_ && !Open()) {
-    std::cerr << "Not connected to server" << std::endl;
+    PROPLINK_LOG_WARNING("Not connected to server");
     return false;
   }
   
@@ -196,31 +466,104 @@ std::unordered_map<std::string, Value> Client::GetAllVariables() {
   std::unordered_map<std::string, Value> result;
   
   if (!opened_ && !Open()) {
-    std::cerr << "Not connected to server" << std::endl;
+    PROPLINK_LOG_WARNING("Not connected to server");
     return result;
   }
   
   CommandMessage cmd;
   cmd.set_command_id(__GetNextCommandId());
   cmd.set_command_type(CommandMessage::GET_ALL_VARIABLES);
+  {
+    std::lock_guard<std::mutex> lock(schema_mutex_);
+    cmd.set_schema_hash(schema_hash_);
+  }
   
   ResponseMessage response = __SendCommandSync(cmd);
   
+  if (response.success()) {
+    // Names are resolved under the lock, and large values are read after it.
+    std::vector<std::pair<std::string, const VariableMessage*>> variables;
+    variables.reserve(response.variables_size());
+    {
+      std::lock_guard<std::mutex> lock(schema_mutex_);
+      for (int i = 0; i < response.variables_size(); i++) {
+        const VariableMessage& var = response.variables(i);
+        if (!var.name().empty()) {
+          variables.emplace_back(var.name(), &var);
+          continue;
+        }
+        // Compact, since the schema is current.
+        auto it = schema_names_.find(var.id());
+        if (it != schema_names_.end()) variables.emplace_back(it->second, &var);
+      }
+    }
+    for (const auto& [name, var] : variables) {
+      Value value;
+      if (__ExtractValue(*var, value)) result[name] = std::move(value);
+    }
+  } else {
+    PROPLINK_LOG_ERROR("Error getting all variables: " << __DescribeStatus(response));
+  }
+  // Fetches the schema if it changed, so that the next response is compact.
+  if (response.has_schema()) __RefreshSchema(response.schema().hash());
+  
+  return result;
+}
+
+std::unordered_map<std::string, Value> Client::GetVariables(const std::vector<std::string>& names, uint64_t& version) {
+  return __GetVariables(names, {}, version);
+}
+
+std::unordered_map<std::string, Value> Client::__GetVariables(const std::vector<std::string>& names, 
+                                                              const std::vector<uint32_t>& ids, uint64_t& version) {
+  std::unordered_map<std::string, Value> result;
+
+  if (!opened_ && !Open()) {
+    PROPLINK_LOG_WARNING("Not connected to server");
+    return result;
+  }
+
+  CommandMessage cmd;
+  cmd.set_command_id(__GetNextCommandId());
+  cmd.set_command_type(CommandMessage::GET_VARIABLES);
+  for (const auto& name : names) cmd.add_variable_names(name);
+  for (const uint32_t id : ids) cmd.add_variable_ids(id);
+
+  ResponseMessage response = __SendCommandSync(cmd);
+
   if (response.success()) {
     for (int i = 0; i < response.variables_size(); i++) {
       const VariableMessage& var = response.variables(i);
-      result[var.name()] = __ExtractValue(var);
+      Value value;
+      if (__ExtractValue(var, value)) result[var.name()] = std::move(value);
     }
+    version = response.version();
   } else {
-    std::cerr << "Error getting all variables: " << response.error_message() << std::endl;
+    PROPLINK_LOG_ERROR("Error getting variables: " << __DescribeStatus(response));
   }
-  
+
   return result;
 }
 
+bool Client::GetVariables(const std::vector<std::string>& names, 
+                          std::function<void(const ResponseMessage&)> callback) {
+  if (!opened_ && !Open()) {
+    PROPLINK_LOG_WARNING("Not connected to server");
+    return false;
+  }
+
+  CommandMessage cmd;
+  cmd.set_command_id(__GetNextCommandId());
+  cmd.set_command_type(CommandMessage::GET_VARIABLES);
+  for (const auto& name : names) cmd.add_variable_names(name);
+
+  __SendCommandAsync(cmd, callback);
+  return true;
+}
+
 bool Client::GetAllVariables(std::function<void(const ResponseMessage&)> callback) {
   if (!opened_ && !Open()) {
-    std::cerr << "Not connected to server" << std::endl;
+    PROPLINK_LOG_WARNING("Not connected to server");
     return false;
   }
   
@@ -236,7 +579,7 @@ std::vector<std::string> Client::GetAllTriggers() {
   std::vector<std::string> result;
   
   if (!opened_ && !Open()) {
-    std::cerr << "Not connected to server" << std::endl;
+    PROPLINK_LOG_WARNING("Not connected to server");
     return result;
   }
   
@@ -252,7 +595,7 @@ std::vector<std::string> Client::GetAllTriggers() {
       result.push_back(trigger.name());
     }
   } else {
-    std::cerr << "Error getting all triggers: " << response.error_message() << std::endl;
+    PROPLINK_LOG_ERROR("Error getting all triggers: " << __DescribeStatus(response));
   }
   
   return result;
@@ -260,7 +603,7 @@ std::vector<std::string> Client::GetAllTriggers() {
 
 bool Client::GetAllTriggers(std::function<void(const ResponseMessage&)> callback) {
   if (!opened_ && !Open()) {
-    std::cerr << "Not connected to server" << std::endl;
+    PROPLINK_LOG_WARNING("Not connected to server");
     return false;
   }
   
@@ -277,7 +620,7 @@ bool Client::SetVariable(const std::string& name,
                          const ConnectionOptions connection_option, 
                          std::function<void(const ResponseMessage&)> callback) {
   if (!opened_ && !Open()) {
-    std::cerr << "Not connected to server" << std::endl;
+    PROPLINK_LOG_WARNING("Not connected to server");
     return false;
   }
   
@@ -285,10 +628,152 @@ bool Client::SetVariable(const std::string& name,
   cmd.set_command_id(__GetNextCommandId());
   cmd.set_command_type(CommandMessage::SET_VARIABLE);
   
+  uint32_t id = 0;
+  ResponseMessage rejected;
+  if (!__ValidateValue(name, value, id, rejected)) {
+    PROPLINK_LOG_ERROR("Error setting variable '" << name << "': " << __DescribeStatus(rejected));
+    if (callback) callback(rejected);
+    return false;
+  }
+
   VariableMessage* var = cmd.mutable_variable();
-  var->set_name(name);
+  if (id != 0) {
+    var->set_id(id);
+  } else {
+    var->set_name(name);
+  }
   __SetValueToVariableMessage(var, value);
   
+  if (connection_option == AsyncConnection) {
+    __SendCommandCombined(cmd, callback);
+    return true;
+  } else {
+    ResponseMessage response = __SendCommandSync(cmd);
+    if (callback) callback(response);
+    return true;
+  }
+}
+
+bool Client::CompareAndSetVariable(const std::string& name, 
+                                   const Value& expected, 
+                                   const Value& desired, 
+                                   const ConnectionOptions connection_option, 
+                                   std::function<void(const ResponseMessage&)> callback) {
+  AtomicOperationMessage operation;
+  operation.set_operation_type(AtomicOperationMessage::COMPARE_AND_SET_VALUE);
+  operation.mutable_operand()->set_name(name);
+  __SetValueToVariableMessage(operation.mutable_operand(), desired);
+  __SetValueToVariableMessage(operation.mutable_expected(), expected);
+  return __SendAtomicOperation(operation, connection_option, callback);
+}
+
+bool Client::CompareAndSetVariableVersion(const std::string& name, 
+                                          const uint64_t expected_version, 
+                                          const Value& desired, 
+                                          const ConnectionOptions connection_option, 
+                                          std::function<void(const ResponseMessage&)> callback) {
+  AtomicOperationMessage operation;
+  operation.set_operation_type(AtomicOperationMessage::COMPARE_AND_SET_VERSION);
+  operation.mutable_operand()->set_name(name);
+  __SetValueToVariableMessage(operation.mutable_operand(), desired);
+  operation.set_expected_version(expected_version);
+  return __SendAtomicOperation(operation, connection_option, callback);
+}
+
+bool Client::AddToVariable(const std::string& name, 
+                           const Value& delta, 
+                           const ConnectionOptions connection_option, 
+                           std::function<void(const ResponseMessage&)> callback) {
+  AtomicOperationMessage operation;
+  operation.set_operation_type(AtomicOperationMessage::ADD);
+  operation.mutable_operand()->set_name(name);
+  __SetValueToVariableMessage(operation.mutable_operand(), delta);
+  return __SendAtomicOperation(operation, connection_option, callback);
+}
+
+bool Client::ToggleVariable(const std::string& name, 
+                            const ConnectionOptions connection_option, 
+                            std::function<void(const ResponseMessage&)> callback) {
+  AtomicOperationMessage operation;
+  operation.set_operation_type(AtomicOperationMessage::TOGGLE);
+  operation.mutable_operand()->set_name(name);
+  return __SendAtomicOperation(operation, connection_option, callback);
+}
+
+bool Client::AppendToVariable(const std::string& name, 
+                              const std::string& suffix, 
+                              const ConnectionOptions connection_option, 
+                              std::function<void(const ResponseMessage&)> callback) {
+  AtomicOperationMessage operation;
+  operation.set_operation_type(AtomicOperationMessage::APPEND);
+  operation.mutable_operand()->set_name(name);
+  operation.mutable_operand()->set_string_value(suffix);
+  return __SendAtomicOperation(operation, connection_option, callback);
+}
+
+bool Client::__SendAtomicOperation(const AtomicOperationMessage& operation, 
+                                   const ConnectionOptions connection_option, 
+                                   std::function<void(const ResponseMessage&)> callback) {
+  if (!opened_ && !Open()) {
+    PROPLINK_LOG_WARNING("Not connected to server");
+    return false;
+  }
+
+  CommandMessage cmd;
+  cmd.set_command_id(__GetNextCommandId());
+  cmd.set_command_type(CommandMessage::ATOMIC_OPERATION);
+  *cmd.mutable_atomic_operation() = operation;
+
+  if (connection_option == AsyncConnection) {
+    __SendCommandAsync(cmd, callback);
+    return true;
+  } else {
+    ResponseMessage response = __SendCommandSync(cmd);
+    if (callback) callback(response);
+    return true;
+  }
+}
+
+bool Client::ExecuteTransaction(const Transaction& transaction, 
+                                const ConnectionOptions connection_option, 
+                                std::function<void(const ResponseMessage&)> callback) {
+  if (!opened_ && !Open()) {
+    PROPLINK_LOG_WARNING("Not connected to server");
+    return false;
+  }
+
+  CommandMessage cmd;
+  cmd.set_command_id(__GetNextCommandId());
+  cmd.set_command_type(CommandMessage::TRANSACTION);
+
+  for (const auto& operation : transaction.operations_) {
+    CommandMessage* op = cmd.add_operations();
+    op->set_command_id(__GetNextCommandId());
+    op->set_command_type(operation.command_type);
+    if (operation.command_type == CommandMessage::SET_VARIABLE) {
+      VariableMessage* var = op->mutable_variable();
+      var->set_name(operation.name);
+      __SetValueToVariableMessage(var, operation.value);
+    } else if (operation.command_type == CommandMessage::ATOMIC_OPERATION) {
+      AtomicOperationMessage* atomic = op->mutable_atomic_operation();
+      atomic->set_operation_type(operation.operation_type);
+      atomic->mutable_operand()->set_name(operation.name);
+      if (operation.operation_type != AtomicOperationMessage::TOGGLE) {
+        __SetValueToVariableMessage(atomic->mutable_operand(), operation.value);
+      }
+      if (operation.operation_type == AtomicOperationMessage::COMPARE_AND_SET_VALUE) {
+        __SetValueToVariableMessage(atomic->mutable_expected(), operation.expected);
+      }
+      atomic->set_expected_version(operation.expected_version);
+    } else {
+      TriggerMessage* trigger = op->mutable_trigger();
+      trigger->set_name(operation.name);
+      for (const auto& argument : operation.arguments) {
+        __SetValueToVariableMessage(trigger->add_arguments(), argument);
+      }
+    }
+  }
+
   if (connection_option == AsyncConnection) {
     __SendCommandAsync(cmd, callback);
     return true;
@@ -303,7 +788,7 @@ bool Client::ExecuteTrigger(const std::string& trigger_name,
                             const ConnectionOptions connection_option, 
                             std::function<void(const ResponseMessage&)> callback) {
   if (!opened_ && !Open()) {
-    std::cerr << "Not connected to server" << std::endl;
+    PROPLINK_LOG_WARNING("Not connected to server");
     return false;
   }
   
@@ -315,7 +800,7 @@ bool Client::ExecuteTrigger(const std::string& trigger_name,
   trigger->set_name(trigger_name);
   
   if (connection_option == AsyncConnection) {
-    __SendCommandAsync(cmd, callback);
+    __SendCommandCombined(cmd, callback);
     return true;
   }
   else {
@@ -325,74 +810,570 @@ bool Client::ExecuteTrigger(const std::string& trigger_name,
   }
 }
 
-bool Client::IsOpened() const { return opened_; }
+std::unordered_map<std::string, Value> Client::WatchVariables(const std::vector<std::string>& names, 
+                                                              uint64_t& version, 
+                                                              const int timeout_ms) {
+  std::unordered_map<std::string, Value> result;
 
-void Client::RegisterCallback(const std::string& name, 
-                              VariableChangedCallback callback) {
-  std::lock_guard<std::mutex> lock(callbacks_mutex_);
-  slots_[name] = callback;
-  slots_last_known_values_[name] = Value();
-}
+  if (!opened_ && !Open()) {
+    PROPLINK_LOG_WARNING("Not connected to server");
+    return result;
+  }
 
-uint64_t Client::__GetNextCommandId() {
-  return command_id_++;
+  CommandMessage cmd;
+  cmd.set_command_id(__GetNextCommandId());
+  cmd.set_command_type(CommandMessage::WATCH_VARIABLES);
+  for (const auto& name : names) cmd.add_variable_names(name);
+  cmd.set_since_version(version);
+  // The caller would block without bound, even after a disconnect, so 0 is the request timeout here.
+  const int watch_timeout_ms = timeout_ms > 0 ? timeout_ms : request_timeout_ms_;
+  cmd.set_timeout_ms(watch_timeout_ms);
+
+  // The server holds the response up to watch_timeout_ms, so wait that much longer than usual.
+  ResponseMessage response = __SendCommandSync(cmd, watch_timeout_ms + request_timeout_ms_);
+
+  if (response.success()) {
+    for (int i = 0; i < response.variables_size(); i++) {
+      const VariableMessage& var = response.variables(i);
+      Value value;
+      if (__ExtractValue(var, value)) result[var.name()] = std::move(value);
+    }
+    version = response.version();
+  } else {
+    PROPLINK_LOG_ERROR("Error watching variables: " << __DescribeStatus(response));
+  }
+
+  return result;
 }
 
-ResponseMessage Client::__SendCommandSync(const CommandMessage& cmd) {
-  const uint64_t cmd_id = cmd.command_id();
-  /*
-  std::cout << "__SendCommandSync id=" << cmd.command_id() << " : ";
-  switch (cmd.command_type()) {
-    case CommandMessage::GET_ALL_TRIGGERS: 
-      std::cout << "GET_ALL_TRIGGERS" << std::endl; break;
-    case CommandMessage::SET_VARIABLE: 
-      std::cout << "SET_VARIABLE" << std::endl; break;
-    case CommandMessage::GET_VARIABLE: 
-      std::cout << "GET_VARIABLE" << std::endl; break;
-    case CommandMessage::GET_ALL_VARIABLES: 
-      std::cout << "GET_ALL_VARIABLES" << std::endl; break;
-    case CommandMessage::EXECUTE_TRIGGER: 
-      std::cout << "EXECUTE_TRIGGER" << std::endl; break;
+bool Client::WatchVariables(const std::vector<std::string>& names, 
+                            const uint64_t since_version, 
+                            const int timeout_ms, 
+                            std::function<void(const ResponseMessage&)> callback) {
+  if (!opened_ && !Open()) {
+    PROPLINK_LOG_WARNING("Not connected to server");
+    return false;
   }
-  */
-  std::promise<ResponseMessage> response_promise;
-  std::future<ResponseMessage> response_future = response_promise.get_future();
-  try {
-    std::lock_guard<std::mutex> lock(dealer_mutex_);
-    pending_responses_[cmd_id] = std::move(response_promise);
-    dealer_->send(zmq::message_t(), ZMQ_SNDMORE);
-    zmq::message_t request(cmd.ByteSizeLong());
-    cmd.SerializeToArray(request.data(), request.size());
-    dealer_->send(request);
+
+  CommandMessage cmd;
+  cmd.set_command_id(__GetNextCommandId());
+  cmd.set_command_type(CommandMessage::WATCH_VARIABLES);
+  for (const auto& name : names) cmd.add_variable_names(name);
+  cmd.set_since_version(since_version);
+  cmd.set_timeout_ms(timeout_ms);
+
+  __SendCommandAsync(cmd, callback);
+  return true;
+}
+
+bool Client::ExecuteTrigger(const std::string& trigger_name, 
+                            const std::vector<Value>& arguments, 
+                            const ConnectionOptions connection_option, 
+                            std::function<void(const ResponseMessage&)> callback) {
+  if (!opened_ && !Open()) {
+    PROPLINK_LOG_WARNING("Not connected to server");
+    return false;
   }
-  catch (const zmq::error_t& e) {
+  
+  CommandMessage cmd;
+  cmd.set_command_id(__GetNextCommandId());
+  cmd.set_command_type(CommandMessage::EXECUTE_TRIGGER);
+  
+  TriggerMessage* trigger = cmd.mutable_trigger();
+  trigger->set_name(trigger_name);
+  for (const auto& argument : arguments) {
+    __SetValueToVariableMessage(trigger->add_arguments(), argument);
+  }
+  
+  if (connection_option == AsyncConnection) {
+    __SendCommandCombined(cmd, callback);
+    return true;
+  }
+  else {
+    ResponseMessage response = __SendCommandSync(cmd);
+    if (callback) callback(response);
+    return true;
+  }
+}
+
+std::vector<Value> Client::CallTrigger(const std::string& trigger_name, 
+                                       const std::vector<Value>& arguments) {
+  std::vector<Value> result;
+
+  if (!opened_ && !Open()) {
+    PROPLINK_LOG_WARNING("Not connected to server");
+    return result;
+  }
+
+  CommandMessage cmd;
+  cmd.set_command_id(__GetNextCommandId());
+  cmd.set_command_type(CommandMessage::EXECUTE_TRIGGER);
+
+  TriggerMessage* trigger = cmd.mutable_trigger();
+  trigger->set_name(trigger_name);
+  for (const auto& argument : arguments) {
+    __SetValueToVariableMessage(trigger->add_arguments(), argument);
+  }
+
+  ResponseMessage response = __SendCommandSync(cmd);
+
+  if (response.success()) {
+    for (int i = 0; i < response.trigger_results_size(); i++) {
+      Value value;
+      if (!__ExtractValue(response.trigger_results(i), value)) {
+        // Results are positional, so none is returned rather than a shifted list.
+        result.clear();
+        break;
+      }
+      result.push_back(std::move(value));
+    }
+  } else {
+    PROPLINK_LOG_ERROR("Error executing trigger '" << trigger_name << "': " 
+                       << __DescribeStatus(response));
+  }
+
+  return result;
+}
+
+bool Client::IsOpened() const { return opened_; }
+
+bool Client::Ping(const int timeout_ms) {
+  if (!IsOpened()) {
+    PROPLINK_LOG_WARNING("Not connected to server");
+    return false;
+  }
+  return __Handshake(timeout_ms < 0 ? request_timeout_ms_ : timeout_ms);
+}
+
+ServerInfoMessage Client::GetServerInfo() {
+  std::lock_guard<std::mutex> lock(server_info_mutex_);
+  return server_info_;
+}
+
+bool Client::__Handshake(const int timeout_ms) {
+  CommandMessage cmd;
+  cmd.set_command_id(__GetNextCommandId());
+  cmd.set_command_type(CommandMessage::HELLO);
+
+  if (timeout_ms <= 0) {
+    // Doesn't wait, the identity of the server is known when the response arrives.
+    __SendCommandAsync(cmd, [this](const ResponseMessage& response) { __UpdateServerInfo(response); });
+    return true;
+  }
+  ResponseMessage response = __SendCommandSync(cmd, timeout_ms);
+  return __UpdateServerInfo(response);
+}
+
+bool Client::__UpdateServerInfo(const ResponseMessage& response) {
+  if (!response.success() || !response.has_server_info()) return false;
+  {
+    std::lock_guard<std::mutex> lock(server_info_mutex_);
+    server_info_ = response.server_info();
+  }
+  // 0 if the server doesn't support DESCRIBE.
+  if (response.server_info().schema_hash() != 0) __RefreshSchema(response.server_info().schema_hash());
+  return true;
+}
+
+bool Client::Describe() {
+  if (!opened_ && !Open()) {
+    PROPLINK_LOG_WARNING("Not connected to server");
+    return false;
+  }
+
+  CommandMessage cmd;
+  cmd.set_command_id(__GetNextCommandId());
+  cmd.set_command_type(CommandMessage::DESCRIBE);
+  {
+    std::lock_guard<std::mutex> lock(schema_mutex_);
+    cmd.set_schema_hash(schema_hash_);
+  }
+
+  ResponseMessage response = __SendCommandSync(cmd);
+  if (!__ApplySchema(response)) {
+    PROPLINK_LOG_ERROR("Error describing variables: " << __DescribeStatus(response));
+    return false;
+  }
+  return true;
+}
+
+std::vector<VariableSchema> Client::GetSchema() {
+  std::lock_guard<std::mutex> lock(schema_mutex_);
+  std::vector<VariableSchema> result;
+  result.reserve(schema_.size());
+  for (const auto& it : schema_) {
+    result.push_back(it.second);
+  }
+  return result;
+}
+
+void Client::__RefreshSchema(const uint64_t schema_hash) {
+  {
+    std::lock_guard<std::mutex> lock(schema_mutex_);
+    if (schema_hash == schema_hash_) return;
+  }
+  if (schema_refreshing_.exchange(true)) return;
+
+  CommandMessage cmd;
+  cmd.set_command_id(__GetNextCommandId());
+  cmd.set_command_type(CommandMessage::DESCRIBE);
+  {
+    std::lock_guard<std::mutex> lock(schema_mutex_);
+    cmd.set_schema_hash(schema_hash_);
+  }
+  try {
+    // From the primary, which also serves the compact reads.
+    __SendCommandAsync(cmd, [this](const ResponseMessage& response) {
+      __ApplySchema(response);
+      schema_refreshing_ = false;
+    }, true);
+  } catch (const zmq::error_t& e) {
+    schema_refreshing_ = false;
+    PROPLINK_LOG_WARNING("Failed to describe variables: " << e.what());
+  }
+}
+
+bool Client::__ApplySchema(const ResponseMessage& response) {
+  if (!response.success() || !response.has_schema()) return false;
+  std::lock_guard<std::mutex> lock(schema_mutex_);
+  // No variables if the hash sent in the command is current.
+  if (response.schema().hash() == schema_hash_) return true;
+  schema_hash_ = response.schema().hash();
+  schema_.clear();
+  schema_names_.clear();
+  for (const auto& message : response.schema().variables()) {
+    VariableSchema& schema = schema_[message.name()];
+    schema.name = message.name();
+    schema.type = static_cast<ValueType>(message.type());
+    schema.read_only = message.read_only();
+    schema.id = message.id();
+    schema.metadata.units = message.units();
+    schema.metadata.has_range = message.has_range();
+    schema.metadata.minimum = message.minimum();
+    schema.metadata.maximum = message.maximum();
+    schema_names_[message.id()] = message.name();
+  }
+  return true;
+}
+
+bool Client::__ValidateValue(const std::string& name, const Value& value, uint32_t& id, ResponseMessage& response) {
+  std::lock_guard<std::mutex> lock(schema_mutex_);
+  auto it = schema_.find(name);
+  if (it == schema_.end()) return true;
+  const VariableSchema& schema = it->second;
+  if (schema.read_only) {
+    response.set_status(ResponseMessage::READ_ONLY);
+    response.set_error_message("Variable is read only: " + name);
+  } else if (static_cast<size_t>(schema.type) != value.index()) {
+    response.set_status(ResponseMessage::TYPE_MISMATCH);
+    response.set_error_message("Type mismatch: Variable '" + name + "' has another type in the schema");
+  } else {
+    id = schema.id;
+    return true;
+  }
+  response.set_success(false);
+  return false;
+}
+
+void Client::SetHeartbeat(const int interval_ms, const int timeout_ms) {
+  if (opened_) return;
+  heartbeat_interval_ms_ = interval_ms > 0 ? interval_ms : 0;
+  heartbeat_timeout_ms_ = timeout_ms > 0 ? timeout_ms : 3 * heartbeat_interval_ms_;
+}
+
+void Client::SetBulkEndpoint(const std::string& bulk_endpoint) {
+  std::lock_guard<std::mutex> lock(bulk_mutex_);
+  bulk_endpoint_ = bulk_endpoint;
+  bulk_dealer_.reset();
+}
+
+bool Client::__ReadLargeValue(const LargeValueMessage& reference, std::string& value) {
+  std::lock_guard<std::mutex> lock(bulk_mutex_);
+  if (bulk_endpoint_.empty()) {
+    PROPLINK_LOG_WARNING("Large value of " << reference.size() << " bytes not read, no bulk endpoint is set");
+    return false;
+  }
+  try {
+    if (!bulk_dealer_) bulk_dealer_ = __CreateDealerSocket(bulk_endpoint_);
+    value.resize(reference.size());
+    // Command ID, offset and length of the chunks requested. The server responds in order.
+    std::deque<std::tuple<uint64_t, uint64_t, uint32_t>> pending;
+    uint64_t requested = 0;
+    uint64_t received = 0;
+    while (received < reference.size()) {
+      while (pending.size() < kLargeValueWindow && requested < reference.size()) {
+        CommandMessage cmd;
+        cmd.set_command_id(__GetNextCommandId());
+        cmd.set_command_type(CommandMessage::READ_LARGE_VALUE);
+        *cmd.mutable_large_value() = reference;
+        cmd.set_offset(requested);
+        cmd.set_length(static_cast<uint32_t>(std::min<uint64_t>(kLargeValueChunkSize, reference.size() - requested)));
+        zmq::message_t request(cmd.ByteSizeLong());
+        cmd.SerializeToArray(request.data(), request.size());
+        if (!bulk_dealer_->send(zmq::message_t(), ZMQ_SNDMORE) || !bulk_dealer_->send(request)) {
+          throw std::runtime_error("Send timeout");
+        }
+        pending.emplace_back(cmd.command_id(), requested, cmd.length());
+        requested += cmd.length();
+      }
+
+      zmq::message_t empty;
+      zmq::message_t header;
+      zmq::message_t chunk;
+      if (!bulk_dealer_->recv(&empty) || !bulk_dealer_->recv(&header) || !bulk_dealer_->recv(&chunk)) {
+        throw std::runtime_error("Response timeout");
+      }
+      ResponseMessage response;
+      response.ParseFromArray(header.data(), header.size());
+      const auto [command_id, offset, length] = pending.front();
+      pending.pop_front();
+      if (response.command_id() != command_id) throw std::runtime_error("Unexpected response");
+      if (!response.success()) throw std::runtime_error(__DescribeStatus(response));
+      if (chunk.size() != length) throw std::runtime_error("Truncated chunk");
+      memcpy(&value[offset], chunk.data(), chunk.size());
+      received += chunk.size();
+    }
+    return true;
+  } catch (const std::exception& e) {
+    PROPLINK_LOG_ERROR("Failed to read large value of " << reference.size() << " bytes: " << e.what());
+    // Responses still in flight must not be taken for the ones of the next read.
+    bulk_dealer_.reset();
+    return false;
+  }
+}
+
+void Client::SetDealerPoolSize(const size_t pool_size) {
+  if (!opened_ && dealers_.empty()) dealer_pool_size_ = pool_size > 0 ? pool_size : 1;
+}
+
+void Client::SetThreadless(const bool threadless) {
+  if (!opened_ && !runtime_) threadless_ = threadless;
+}
+
+void Client::SetWriteCombining(const int max_delay_ms, const size_t max_batch_size) {
+  {
+    std::lock_guard<std::mutex> lock(batch_mutex_);
+    batch_max_delay_ms_ = max_delay_ms;
+    batch_max_size_ = max_batch_size > 0 ? max_batch_size : 1;
+  }
+  if (max_delay_ms <= 0) __FlushBatch();
+}
+
+void Client::__SendCommandCombined(const CommandMessage& cmd, 
+                                   std::function<void(const ResponseMessage&)> callback) {
+  bool combining = false;
+  bool superseded = false;
+  uint64_t superseded_id = 0;
+  std::function<void(const ResponseMessage&)> superseded_callback;
+  bool first_in_window = false;
+  bool flush = false;
+  {
+    std::lock_guard<std::mutex> lock(batch_mutex_);
+    combining = batch_max_delay_ms_ > 0;
+    if (combining) {
+      // Variables addressed by ID are keyed by the ID, prefixed with NUL so that it can't collide with names.
+      const std::string key = cmd.variable().name().empty() ? 
+                              std::string(1, '\0') + std::to_string(cmd.variable().id()) : cmd.variable().name();
+      auto it = cmd.command_type() == CommandMessage::SET_VARIABLE ? 
+                batch_index_by_variable_.find(key) : batch_index_by_variable_.end();
+      if (it != batch_index_by_variable_.end()) {
+        // A later set of the same variable within the window drops the earlier one, and is appended
+        // so that it stays after the writes queued in between.
+        const size_t index = it->second;
+        superseded = true;
+        superseded_id = batch_[index].command.command_id();
+        superseded_callback = std::move(batch_[index].callback);
+        batch_.erase(batch_.begin() + index);
+        for (auto& entry : batch_index_by_variable_) {
+          if (entry.second > index) entry.second--;
+        }
+      }
+      if (cmd.command_type() == CommandMessage::SET_VARIABLE) {
+        batch_index_by_variable_[key] = batch_.size();
+      }
+      batch_.push_back({ cmd, callback });
+      if (batch_.size() == 1 && !superseded) {
+        batch_started_ = std::chrono::steady_clock::now();
+        first_in_window = true;
+      }
+      flush = batch_.size() >= batch_max_size_;
+    }
+  }
+
+  if (!combining) {
+    __SendCommandAsync(cmd, callback);
+    return;
+  }
+
+  if (superseded && superseded_callback) {
+    ResponseMessage response;
+    response.set_command_id(superseded_id);
+    response.set_success(true);
+    response.set_status(ResponseMessage::SUPERSEDED);
+    superseded_callback(response);
+  }
+
+  if (flush) {
+    __FlushBatch();
+  } else if (first_in_window && running_) {
+    // Wakes the worker thread up to recompute its poll timeout.
+    __SendControlMessage("BATCH");
+  }
+}
+
+void Client::__FlushBatch() {
+  std::vector<BatchedCommand> batch;
+  {
+    std::lock_guard<std::mutex> lock(batch_mutex_);
+    if (batch_.empty()) return;
+    batch.swap(batch_);
+    batch_index_by_variable_.clear();
+  }
+
+  if (batch.size() == 1) {
+    __SendCommandAsync(batch.front().command, batch.front().callback);
+    return;
+  }
+
+  CommandMessage cmd;
+  cmd.set_command_id(__GetNextCommandId());
+  cmd.set_command_type(CommandMessage::BATCH);
+  {
+    std::lock_guard<std::mutex> lock(responses_mutex_);
+    for (auto& batched : batch) {
+      // The result of each operation is dispatched by its own command_id.
+      if (batched.callback) async_responses_[batched.command.command_id()] = std::move(batched.callback);
+      *cmd.add_operations() = std::move(batched.command);
+    }
+  }
+  __SendCommandAsync(cmd);
+}
+
+long Client::__GetBatchPollTimeout() {
+  std::lock_guard<std::mutex> lock(batch_mutex_);
+  if (batch_.empty()) return -1;
+  auto remaining = batch_max_delay_ms_ - std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - batch_started_).count();
+  return remaining > 0 ? static_cast<long>(remaining) : 0;
+}
+
+void Client::RegisterCallback(const std::string& name, 
+                              VariableChangedCallback callback) {
+  {
+    std::lock_guard<std::mutex> lock(callbacks_mutex_);
+    slots_[name] = callback;
+    slots_last_known_values_.erase(name); // The first value is always notified.
+    pending_subscriptions_.push_back(name);
+  }
+  // The subscriber socket belongs to the worker thread, so let it subscribe the new topic.
+  if (running_) __SendControlMessage("SUBSCRIBE");
+}
+
+void Client::RegisterPrefixCallback(const std::string& prefix, 
+                                    NamedVariableChangedCallback callback) {
+  {
+    std::lock_guard<std::mutex> lock(callbacks_mutex_);
+    prefix_slots_[prefix] = callback;
+    pending_subscriptions_.push_back(prefix); // ZeroMQ matches topics by prefix.
+  }
+  if (running_) __SendControlMessage("SUBSCRIBE");
+}
+
+void Client::__SendControlMessage(const std::string& command) {
+  if (runtime_) {
+    // The runtime subscribes pending topics and recomputes poll timeouts on every wake-up.
+    runtime_->__Wake();
+    return;
+  }
+  std::lock_guard<std::mutex> lock(control_mutex_);
+  if (!control_socket_) return;
+  zmq::message_t msg(command.data(), command.size());
+  control_socket_->send(msg);
+}
+
+void Client::__SubscribeAll() {
+  std::lock_guard<std::mutex> lock(callbacks_mutex_);
+  for (const auto& slot : slots_) {
+    subscriber_->setsockopt(ZMQ_SUBSCRIBE, slot.first.data(), slot.first.size());
+  }
+  for (const auto& slot : prefix_slots_) {
+    subscriber_->setsockopt(ZMQ_SUBSCRIBE, slot.first.data(), slot.first.size());
+  }
+  pending_subscriptions_.clear();
+}
+
+void Client::__SubscribePending() {
+  std::lock_guard<std::mutex> lock(callbacks_mutex_);
+  for (const auto& name : pending_subscriptions_) {
+    subscriber_->setsockopt(ZMQ_SUBSCRIBE, name.data(), name.size());
+  }
+  pending_subscriptions_.clear();
+}
+
+uint64_t Client::__GetNextCommandId() {
+  return command_id_++;
+}
+
+ResponseMessage Client::__SendCommandSync(const CommandMessage& cmd, const int timeout_ms) {
+  const uint64_t cmd_id = cmd.command_id();
+  /*
+  std::cout << "__SendCommandSync id=" << cmd.command_id() << " : ";
+  switch (cmd.command_type()) {
+    case CommandMessage::GET_ALL_TRIGGERS: 
+      std::cout << "GET_ALL_TRIGGERS" << std::endl; break;
+    case CommandMessage::SET_VARIABLE: 
+      std::cout << "SET_VARIABLE" << std::endl; break;
+    case CommandMessage::GET_VARIABLE: 
+      std::cout << "GET_VARIABLE" << std::endl; break;
+    case CommandMessage::GET_ALL_VARIABLES: 
+      std::cout << "GET_ALL_VARIABLES" << std::endl; break;
+    case CommandMessage::EXECUTE_TRIGGER: 
+      std::cout << "EXECUTE_TRIGGER" << std::endl; break;
+  }
+  */
+  // Writes waiting for combining are sent first, so that this command doesn't overtake them.
+  __FlushBatch();
+  std::promise<ResponseMessage> response_promise;
+  std::future<ResponseMessage> response_future = response_promise.get_future();
+  {
+    std::lock_guard<std::mutex> lock(responses_mutex_);
+    pending_responses_[cmd_id] = std::move(response_promise);
+  }
+  try {
+    // Any connection of the pool, since the caller waits for this response before sending the next.
+    if (!__SendOnReplica(cmd)) __SendOnDealer(cmd, false);
+  }
+  catch (const zmq::error_t& e) {
     if (e.num() == EAGAIN) {
-      std::cerr << "Send timeout for command ID " << cmd_id << std::endl;
+      PROPLINK_LOG_WARNING("Send timeout for command ID " << cmd_id);
       
-      std::lock_guard<std::mutex> lock(dealer_mutex_);
+      std::lock_guard<std::mutex> lock(responses_mutex_);
       pending_responses_.erase(cmd_id);
       
       ResponseMessage timeout_response;
       timeout_response.set_command_id(cmd_id);
       timeout_response.set_success(false);
+      timeout_response.set_status(ResponseMessage::SEND_FAILED);
       timeout_response.set_error_message("Send timeout");
       return timeout_response;
     } else {
-      std::cerr << "ZeroMQ error in SendCommandSync: " << e.what() << " (errno: " << e.num() << ")" << std::endl;
+      PROPLINK_LOG_ERROR("ZeroMQ error in SendCommandSync: " << e.what() << " (errno: " << e.num() << ")");
       
-      std::lock_guard<std::mutex> lock(dealer_mutex_);
+      std::lock_guard<std::mutex> lock(responses_mutex_);
       pending_responses_.erase(cmd_id);
       
       ResponseMessage error_response;
       error_response.set_command_id(cmd_id);
       error_response.set_success(false);
+      error_response.set_status(ResponseMessage::SEND_FAILED);
       error_response.set_error_message(std::string("ZeroMQ error: ") + e.what());
       return error_response;
     }
   }
   
   try {
-    auto status = response_future.wait_for(std::chrono::milliseconds(request_timeout_ms_));
+    const int wait_ms = timeout_ms < 0 ? request_timeout_ms_ : timeout_ms;
+    auto status = __WaitForResponse(response_future, wait_ms);
     
     if (status == std::future_status::ready) {
       auto response = response_future.get();
@@ -401,31 +1382,34 @@ ResponseMessage Client::__SendCommandSync(const CommandMessage& cmd) {
       
       // pending_responses에서 제거
       {
-        std::lock_guard<std::mutex> lock(dealer_mutex_);
+        std::lock_guard<std::mutex> lock(responses_mutex_);
         pending_responses_.erase(cmd_id);
       }
       
       ResponseMessage timeout_response;
       timeout_response.set_command_id(cmd_id);
       timeout_response.set_success(false);
+      timeout_response.set_status(ResponseMessage::TIMED_OUT);
       timeout_response.set_error_message("Response timeout");
       return timeout_response;
     }
   }
   catch (const std::exception& e) {
     // Exceptions from future.get()
-    std::cerr << "Exception while waiting for response: " << e.what() << std::endl;
+    PROPLINK_LOG_ERROR("Exception while waiting for response: " << e.what());
     
     ResponseMessage error_response;
     error_response.set_command_id(cmd_id);
     error_response.set_success(false);
+    error_response.set_status(ResponseMessage::CONNECTION_LOST);
     error_response.set_error_message(std::string("Response error: ") + e.what());
     return error_response;
   }
 }
 
 void Client::__SendCommandAsync(const CommandMessage& cmd, 
-                                std::function<void(const ResponseMessage&)> callback) {
+                                std::function<void(const ResponseMessage&)> callback,
+                                const bool primary_only) {
   const int64_t cmd_id = cmd.command_id();
   /*
   std::cout << "__SendCommandAsync id=" << cmd.command_id() << " : ";
@@ -442,230 +1426,732 @@ void Client::__SendCommandAsync(const CommandMessage& cmd,
       std::cout << "EXECUTE_TRIGGER" << std::endl; break;
   }
   */
-  {
-    std::lock_guard<std::mutex> lock(dealer_mutex_);
-    if (callback) async_responses_[cmd_id] = callback;
-    dealer_->send(zmq::message_t(), ZMQ_SNDMORE);
-    zmq::message_t request(cmd.ByteSizeLong());
-    cmd.SerializeToArray(request.data(), request.size());
-    dealer_->send(request);
+  // Writes waiting for combining are sent first, so that this command doesn't overtake them.
+  // __FlushBatch() itself sends with the batch already taken, so this returns at once there.
+  __FlushBatch();
+  if (callback) {
+    std::lock_guard<std::mutex> lock(responses_mutex_);
+    async_responses_[cmd_id] = callback;
   }
+  // Always the first connection, so that asynchronous commands reach the server in the order they were sent.
+  // Reads on replicas are not ordered with the writes on the primary.
+  if (primary_only || !__SendOnReplica(cmd)) __SendOnDealer(cmd, true);
 }
 
-void Client::__WorkerLoop() {
-  //std::cout << "Client started with endpoints: " << sub_endpoint_ << " (SUB)" << std::endl;
-            
-  zmq::pollitem_t items[] = {
-    { static_cast<void*>(*dealer_), 0, ZMQ_POLLIN, 0 },
-    { static_cast<void*>(*subscriber_), 0, ZMQ_POLLIN, 0 },
-    { static_cast<void*>(*inproc_socket_), 0, ZMQ_POLLIN, 0 }
-  };
-  zmq::pollitem_t& dealer_poll = items[0];
-  zmq::pollitem_t& subscriber_poll = items[1];
-  zmq::pollitem_t& inproc_socket_poll = items[2];
-
-  // Variables for reconnection.
-  int reconnect_attempts = 0;
-  const int max_reconnect_attempts = 5;
-  const int initial_reconnect_delay_ms = 100;
-  const int max_reconnect_delay_ms = 5000;
-  auto last_reconnect_time = std::chrono::steady_clock::now();
-  bool need_reconnect = false;
+void Client::__OpenDealers() {
+  if (dealers_.empty()) {
+    for (size_t i = 0; i < dealer_pool_size_; i++) {
+      dealers_.push_back(std::make_unique<DealerConnection>());
+    }
+  }
+  for (auto& dealer : dealers_) {
+    std::lock_guard<std::mutex> lock(dealer->mutex);
+    if (dealer->socket) dealer->socket->close();
+    dealer->socket = __CreateDealerSocket(dealer_endpoint_);
+  }
+}
 
-  while (running_) {
-    if (need_reconnect) {
-      if (reconnect_attempts < max_reconnect_attempts) {
-        int delay_ms = std::min(
-            initial_reconnect_delay_ms * (1 << reconnect_attempts),
-            max_reconnect_delay_ms);
-        
-        auto now = std::chrono::steady_clock::now();
-        auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
-            now - last_reconnect_time).count();
-        
-        if (elapsed >= delay_ms) {
-          //std::cout << "Attempting to reconnect (attempt " << reconnect_attempts + 1 << " of " << max_reconnect_attempts << ")..." << std::endl;
-          
-          try {
-            dealer_->close();
-            subscriber_->close();
-            
-            dealer_ = std::make_unique<zmq::socket_t>(context_, ZMQ_DEALER);
-            dealer_->setsockopt(ZMQ_RCVTIMEO, &request_timeout_ms_, sizeof(request_timeout_ms_));
-            dealer_->setsockopt(ZMQ_SNDTIMEO, &request_timeout_ms_, sizeof(request_timeout_ms_));
-            dealer_->connect(dealer_endpoint_);
-            
-            subscriber_ = std::make_unique<zmq::socket_t>(context_, ZMQ_SUB);
-            subscriber_->setsockopt(ZMQ_SUBSCRIBE, "", 0);
-            subscriber_->setsockopt(ZMQ_RCVTIMEO, &request_timeout_ms_, sizeof(request_timeout_ms_));
-            subscriber_->connect(sub_endpoint_);
-            
-            items[0] = { static_cast<void*>(*dealer_), 0, ZMQ_POLLIN, 0 };
-            items[1] = { static_cast<void*>(*subscriber_), 0, ZMQ_POLLIN, 0 };
-            
-            // std::cout << "Reconnection successful" << std::endl;
-            reconnect_attempts = 0;
-            need_reconnect = false;
-            opened_ = true;
-            
-            // Sends error message to pending requests.
-            std::lock_guard<std::mutex> lock(dealer_mutex_);
-            for (auto& [cmd_id, promise] : pending_responses_) {
-              ResponseMessage error_response;
-              error_response.set_command_id(cmd_id);
-              error_response.set_success(false);
-              error_response.set_error_message("Connection reset during operation");
-              promise.set_value(error_response);
-            }
-            pending_responses_.clear();
-            
-            // Sends error message to async requests.
-            for (auto& [cmd_id, callback] : async_responses_) {
-              if (callback) {
-                ResponseMessage error_response;
-                error_response.set_command_id(cmd_id);
-                error_response.set_success(false);
-                error_response.set_error_message("Connection reset during operation");
-                callback(error_response);
-              }
-            }
-            async_responses_.clear();
-          }
-          catch (const zmq::error_t& e) {
-            std::cerr << "Failed to reconnect: " << e.what() << std::endl;
-            reconnect_attempts++;
-            last_reconnect_time = std::chrono::steady_clock::now();
-          }
-        }
-      }
-      else {
-        std::cerr << "Max reconnection attempts reached. Giving up." << std::endl;
-        opened_ = false;
-        
-        // Sends failure to all requests.
-        std::lock_guard<std::mutex> lock(dealer_mutex_);
-        for (auto& [cmd_id, promise] : pending_responses_) {
-          ResponseMessage error_response;
-          error_response.set_command_id(cmd_id);
-          error_response.set_success(false);
-          error_response.set_error_message("Failed to reconnect after maximum attempts");
-          promise.set_value(error_response);
-        }
-        pending_responses_.clear();
-        async_responses_.clear();
-        
-        running_ = false;
-        break;
-      }
+void Client::__OpenReplicas() {
+  // Not recreated on reconnection, since ZeroMQ reconnects them by itself.
+  for (auto& replica : replicas_) {
+    std::lock_guard<std::mutex> lock(replica->dealer.mutex);
+    if (replica->dealer.socket) replica->dealer.socket->close();
+    replica->dealer.socket = __CreateDealerSocket(replica->endpoint);
+  }
+}
+
+std::unique_ptr<zmq::socket_t> Client::__CreateDealerSocket(const std::string& endpoint) {
+  auto socket = std::make_unique<zmq::socket_t>(*context_, ZMQ_DEALER);
+
+  int hwm = 1000;
+  socket->setsockopt(ZMQ_SNDHWM, &hwm, sizeof(hwm));
+  socket->setsockopt(ZMQ_RCVHWM, &hwm, sizeof(hwm));
+
+  socket->setsockopt(ZMQ_RCVTIMEO, &request_timeout_ms_, sizeof(request_timeout_ms_));
+  socket->setsockopt(ZMQ_SNDTIMEO, &request_timeout_ms_, sizeof(request_timeout_ms_));
+  __ApplyHeartbeatOptions(*socket);
+
+#ifdef _WIN32
+  std::string identity = GenerateUniqueIdentity();
+  socket->setsockopt(ZMQ_IDENTITY, identity.c_str(), identity.length());
+#endif
+
+  socket->connect(endpoint);
+  return socket;
+}
+
+void Client::__CloseDealers() {
+  for (auto& dealer : dealers_) {
+    std::lock_guard<std::mutex> lock(dealer->mutex);
+    if (dealer->socket) dealer->socket->close();
+  }
+  for (auto& replica : replicas_) {
+    std::lock_guard<std::mutex> lock(replica->dealer.mutex);
+    if (replica->dealer.socket) replica->dealer.socket->close();
+  }
+}
+
+void Client::__SelectPrimary() {
+  if (primaries_.size() < 2) return;
+  __RecordFailure(primary_health_[primary_index_]);
+
+  // The next primary which is not waiting for retry, or else the one whose retry comes first.
+  const auto now = std::chrono::steady_clock::now();
+  size_t selected = (primary_index_ + 1) % primaries_.size();
+  for (size_t i = 1; i <= primaries_.size(); i++) {
+    const size_t index = (primary_index_ + i) % primaries_.size();
+    if (primary_health_[index].retry_time <= now) {
+      selected = index;
+      break;
     }
-    
-    zmq::poll(items, 3, -1);
-    if (dealer_poll.revents & ZMQ_POLLIN) {
-      try {
-        zmq::message_t empty;
-        zmq::message_t reply;
-        {
-          std::lock_guard<std::mutex> lock(dealer_mutex_);
-          dealer_->recv(&empty);
-          dealer_->recv(&reply);
-        }
-        
-        ResponseMessage response;
-        response.ParseFromArray(reply.data(), reply.size());
-        uint64_t cmd_id = response.command_id();
-        
-        // Handles sync communication.
-        {
-          std::lock_guard<std::mutex> lock(dealer_mutex_);
-          auto it = pending_responses_.find(cmd_id);
-          if (it != pending_responses_.end()) {
-            it->second.set_value(response);
-            pending_responses_.erase(it);
-            continue;
-          }
-        }
-        
-        // Handles async communication.
-        {
-          std::lock_guard<std::mutex> lock(dealer_mutex_);
-          auto it = async_responses_.find(cmd_id);
-          if (it != async_responses_.end()) {
-            if (it->second) it->second(response);
-            async_responses_.erase(it);
-          }
+    if (primary_health_[index].retry_time < primary_health_[selected].retry_time) selected = index;
+  }
+  primary_index_ = selected;
+  dealer_endpoint_ = primaries_[selected].dealer_endpoint;
+  sub_endpoint_ = primaries_[selected].sub_endpoint;
+  PROPLINK_LOG_WARNING("Failing over to " << dealer_endpoint_);
+}
+
+bool Client::__SendOnReplica(const CommandMessage& cmd) {
+  if (replicas_.empty()) return false;
+  // Compact reads and reads by ID use the schema cached from the primary, which may differ from the replica's.
+  if (cmd.schema_hash() != 0) return false;
+  if (cmd.command_type() == CommandMessage::GET_VARIABLE && cmd.variable_name().empty()) return false;
+  // Not GET_VARIABLES, since replicas apply the operations of a transaction one by one.
+  if (cmd.command_type() != CommandMessage::GET_VARIABLE &&
+      cmd.command_type() != CommandMessage::GET_ALL_VARIABLES &&
+      cmd.command_type() != CommandMessage::GET_ALL_TRIGGERS) {
+    return false;
+  }
+
+  const auto now = std::chrono::steady_clock::now();
+  ReplicaConnection* selected = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(replicas_mutex_);
+    double selected_cost = 0.0;
+    for (auto& replica : replicas_) {
+      // Reads unanswered within the timeout count as a failure.
+      bool expired = false;
+      for (auto it = replica->in_flight.begin(); it != replica->in_flight.end();) {
+        if (now - it->second < std::chrono::milliseconds(request_timeout_ms_)) {
+          ++it;
+          continue;
         }
+        it = replica->in_flight.erase(it);
+        expired = true;
       }
-      catch (const zmq::error_t& e) {
-        if (e.num() == EAGAIN) {
-          std::cerr << "Receive timeout on dealer socket" << std::endl;
-          need_reconnect = true;
-          last_reconnect_time = std::chrono::steady_clock::now();
-        } else {
-          std::cerr << "ZeroMQ error in dealer recv: " << e.what() << " (errno: " << e.num() << ")" << std::endl;
-          need_reconnect = true;
-          last_reconnect_time = std::chrono::steady_clock::now();
-        }
+      if (expired) __RecordFailure(replica->health);
+      if (replica->health.retry_time > now) continue;
+
+      // Expected time to respond, counting the reads already waiting. Unmeasured replicas are tried first.
+      const double cost = replica->latency_ms * (replica->in_flight.size() + 1);
+      if (!selected || cost < selected_cost) {
+        selected = replica.get();
+        selected_cost = cost;
       }
     }
+    if (!selected) return false;
+    selected->in_flight[cmd.command_id()] = now;
+  }
+
+  zmq::message_t request(cmd.ByteSizeLong());
+  cmd.SerializeToArray(request.data(), request.size());
+  try {
+    std::lock_guard<std::mutex> lock(selected->dealer.mutex);
+    selected->dealer.socket->send(zmq::message_t(), ZMQ_SNDMORE);
+    selected->dealer.socket->send(request);
+    return true;
+  } catch (const zmq::error_t& e) {
+    PROPLINK_LOG_WARNING("Failed to send to replica " << selected->endpoint << ": " << e.what());
+    std::lock_guard<std::mutex> lock(replicas_mutex_);
+    selected->in_flight.erase(cmd.command_id());
+    __RecordFailure(selected->health);
+    return false;
+  }
+}
+
+void Client::__RecordFailure(EndpointHealth& health) {
+  const int shift = std::min(health.failures, 6);
+  health.failures++;
+  health.retry_time = std::chrono::steady_clock::now() + 
+                      std::chrono::milliseconds(std::min(kInitialReconnectDelayMs << shift, kMaxReconnectDelayMs));
+}
+
+bool Client::__DealersConnected() {
+  for (auto& dealer : dealers_) {
+    std::lock_guard<std::mutex> lock(dealer->mutex);
+    if (!dealer->socket || !dealer->socket->connected()) return false;
+  }
+  return !dealers_.empty();
+}
+
+void Client::__SendOnDealer(const CommandMessage& cmd, const bool ordered) {
+  // Serialized before taking the lock of the connection.
+  zmq::message_t request(cmd.ByteSizeLong());
+  cmd.SerializeToArray(request.data(), request.size());
+
+  if (dealers_.empty()) throw zmq::error_t();
+  DealerConnection* dealer = dealers_.front().get();
+  std::unique_lock<std::mutex> lock;
+  if (!ordered && dealers_.size() > 1) {
+    // Takes the first idle connection starting from a rotating index, or waits for that one if all are busy.
+    const size_t start = next_dealer_++ % dealers_.size();
+    for (size_t i = 0; i < dealers_.size() && !lock.owns_lock(); i++) {
+      DealerConnection* candidate = dealers_[(start + i) % dealers_.size()].get();
+      lock = std::unique_lock<std::mutex>(candidate->mutex, std::try_to_lock);
+      if (lock.owns_lock()) dealer = candidate;
+    }
+    if (!lock.owns_lock()) dealer = dealers_[start].get();
+  }
+  if (!lock.owns_lock()) lock = std::unique_lock<std::mutex>(dealer->mutex);
+
+  dealer->socket->send(zmq::message_t(), ZMQ_SNDMORE);
+  dealer->socket->send(request);
+}
+
+void Client::__AppendPollItems(std::vector<zmq::pollitem_t>& items) {
+  for (auto& dealer : dealers_) {
+    items.push_back({ static_cast<void*>(*dealer->socket), 0, ZMQ_POLLIN, 0 });
+  }
+  for (auto& replica : replicas_) {
+    items.push_back({ static_cast<void*>(*replica->dealer.socket), 0, ZMQ_POLLIN, 0 });
+  }
+  items.push_back({ static_cast<void*>(*subscriber_), 0, ZMQ_POLLIN, 0 });
+}
+
+void Client::__WorkerLoop() {
+  //std::cout << "Client started with endpoints: " << sub_endpoint_ << " (SUB)" << std::endl;
+  std::vector<zmq::pollitem_t> items;
+  while (running_) {
+    __Heartbeat();
+    if (!__Reconnect()) break;
+
+    // Rebuilt every iteration, since reconnection replaces the sockets.
+    // The dealers of the pool come first, then the subscriber and the inproc socket.
+    items.clear();
+    __AppendPollItems(items);
+    items.push_back({ static_cast<void*>(*inproc_socket_), 0, ZMQ_POLLIN, 0 });
+    const zmq::pollitem_t& subscriber_poll = items[items.size() - 2];
+    const zmq::pollitem_t& inproc_socket_poll = items.back();
+
+    zmq::poll(items, __GetPollTimeout());
+    if (__GetBatchPollTimeout() == 0) __FlushBatch();
+    if (std::any_of(items.begin(), items.end() - 2, 
+                    [](const zmq::pollitem_t& item) { return item.revents & ZMQ_POLLIN; })) {
+      __ProcessDealer();
+    }
     if (subscriber_poll.revents & ZMQ_POLLIN) {
-      try {
-        zmq::message_t zmqmsg;
-        subscriber_->recv(&zmqmsg);
-        
-        VariableMessage varmsg;
-        if (varmsg.ParseFromArray(zmqmsg.data(), zmqmsg.size())) {
-          const std::string& name = varmsg.name();
-          std::lock_guard<std::mutex> lock(callbacks_mutex_);
-          auto it = slots_.find(name);
-          if (it != slots_.end()) {
-            Value value = __ExtractValue(varmsg);
-            const bool& read_only = varmsg.read_only();
-            
-            // Callback function is only be called when changed value is different from the previous one. 
-            auto last_value_it = slots_last_known_values_.find(name);
-            if (last_value_it != slots_last_known_values_.end() && last_value_it->second == value) {
-              continue;
-            }
-            else {
-              it->second(value);
-            }
-          }
-        }
-      }
-      catch (const zmq::error_t& e) {
-        if (e.num() == EAGAIN) {
-          std::cerr << "Receive timeout on subscriber socket" << std::endl;
-          // SUB socket timeout may not be a fatal error, so continue without reconnecting.
-        } else {
-          std::cerr << "ZeroMQ error in subscriber recv: " << e.what() << " (errno: " << e.num() << ")" << std::endl;
-          need_reconnect = true;
-          last_reconnect_time = std::chrono::steady_clock::now();
-        }
-      }
+      __ProcessSubscriber();
     }
     if (inproc_socket_poll.revents & ZMQ_POLLIN) {
       zmq::message_t msg;
       inproc_socket_->recv(&msg);
       //std::cout << "Inproc msg recved: " << msg << std::endl;
+      const std::string command(static_cast<const char*>(msg.data()), msg.size());
+      if (command == "SUBSCRIBE") {
+        __SubscribePending();
+        continue;
+      }
+      if (command == "BATCH") continue; // Poll timeout is recomputed.
       break;
     }
   }
   //std::cout << "Worker thread stopped" << std::endl;
 }
 
-Value Client::__ExtractValue(const VariableMessage& variable) {
+long Client::ProcessEvents() {
+  if (!threadless_ || !running_) return -1;
+  __Heartbeat();
+  if (!__Reconnect()) return -1;
+  __SubscribePending();
+  if (__GetBatchPollTimeout() == 0) __FlushBatch();
+  __ProcessDealer();
+  __ProcessSubscriber();
+  __ProcessBulkQueue();
+  return __GetPollTimeout();
+}
+
+std::vector<zmq::fd_t> Client::GetFileDescriptors() {
+  std::vector<zmq::fd_t> fds;
+  if (!opened_) return fds;
+  zmq::fd_t fd;
+  size_t fd_size = sizeof(fd);
+  for (auto& dealer : dealers_) {
+    std::lock_guard<std::mutex> lock(dealer->mutex);
+    dealer->socket->getsockopt(ZMQ_FD, &fd, &fd_size);
+    fds.push_back(fd);
+  }
+  for (auto& replica : replicas_) {
+    std::lock_guard<std::mutex> lock(replica->dealer.mutex);
+    replica->dealer.socket->getsockopt(ZMQ_FD, &fd, &fd_size);
+    fds.push_back(fd);
+  }
+  subscriber_->getsockopt(ZMQ_FD, &fd, &fd_size);
+  fds.push_back(fd);
+  return fds;
+}
+
+std::future_status Client::__WaitForResponse(std::future<ResponseMessage>& future, const int timeout_ms) {
+  // The thread which would receive the response is the calling thread itself in threadless mode,
+  // or when called from a callback. Then the calling thread receives it, instead of waiting until timeout.
+  const std::thread::id receiving_thread = runtime_ ? runtime_->worker_thread_.get_id() : worker_thread_.get_id();
+  if (!threadless_ && std::this_thread::get_id() != receiving_thread) {
+    return future.wait_for(std::chrono::milliseconds(timeout_ms));
+  }
+
+  const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+  while (future.wait_for(std::chrono::milliseconds(0)) != std::future_status::ready) {
+    const long remaining = static_cast<long>(std::chrono::duration_cast<std::chrono::milliseconds>(
+        deadline - std::chrono::steady_clock::now()).count());
+    if (remaining <= 0) return std::future_status::timeout;
+    std::vector<zmq::pollitem_t> items;
+    __AppendPollItems(items);
+    items.pop_back(); // The subscriber.
+    // Polls in short slices, in case ProcessEvents() on another thread receives the response.
+    if (zmq::poll(items, std::min(remaining, 10L)) > 0) __ProcessDealer();
+  }
+  return std::future_status::ready;
+}
+
+long Client::__GetPollTimeout() {
+  long timeout = __GetBatchPollTimeout();
+  if (need_reconnect_) {
+    const long delay_ms = std::min(kInitialReconnectDelayMs * (1 << reconnect_attempts_), kMaxReconnectDelayMs);
+    const long elapsed = static_cast<long>(std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - last_reconnect_time_).count());
+    const long remaining = std::max(delay_ms - elapsed, 0L);
+    timeout = timeout < 0 ? remaining : std::min(timeout, remaining);
+  } else if (heartbeat_interval_ms_ > 0) {
+    // Wakes up to send the next heartbeat, or to declare the server dead.
+    const auto now = std::chrono::steady_clock::now();
+    const auto next_heartbeat = std::max(last_received_time_, last_heartbeat_time_) + 
+                                std::chrono::milliseconds(heartbeat_interval_ms_);
+    const auto deadline = last_received_time_ + std::chrono::milliseconds(heartbeat_timeout_ms_);
+    const long remaining = std::max(static_cast<long>(std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::min(next_heartbeat, deadline) - now).count()), 0L);
+    timeout = timeout < 0 ? remaining : std::min(timeout, remaining);
+  }
+  return timeout;
+}
+
+void Client::__ApplyHeartbeatOptions(zmq::socket_t& socket) {
+#ifdef ZMQ_HEARTBEAT_IVL
+  // Lets ZeroMQ also drop dead connections of the transport, including the subscriber's.
+  if (heartbeat_interval_ms_ > 0) {
+    socket.setsockopt(ZMQ_HEARTBEAT_IVL, &heartbeat_interval_ms_, sizeof(heartbeat_interval_ms_));
+    socket.setsockopt(ZMQ_HEARTBEAT_TIMEOUT, &heartbeat_timeout_ms_, sizeof(heartbeat_timeout_ms_));
+  }
+#endif
+}
+
+void Client::__Heartbeat() {
+  if (heartbeat_interval_ms_ <= 0 || need_reconnect_) return;
+  const auto now = std::chrono::steady_clock::now();
+  if (now - last_received_time_ >= std::chrono::milliseconds(heartbeat_timeout_ms_)) {
+    PROPLINK_LOG_WARNING("No response from server for " << heartbeat_timeout_ms_ << " ms, reconnecting");
+    need_reconnect_ = true;
+    // Reconnects right away, which fails the outstanding requests.
+    last_reconnect_time_ = now - std::chrono::milliseconds(kMaxReconnectDelayMs);
+    return;
+  }
+  // Only sent while nothing else is received from the server.
+  if (now - std::max(last_received_time_, last_heartbeat_time_) < std::chrono::milliseconds(heartbeat_interval_ms_)) {
+    return;
+  }
+  last_heartbeat_time_ = now;
+  CommandMessage cmd;
+  cmd.set_command_id(__GetNextCommandId());
+  cmd.set_command_type(CommandMessage::HELLO);
+  try {
+    __SendCommandAsync(cmd, [this](const ResponseMessage& response) { __HandleHeartbeat(response); });
+  } catch (const zmq::error_t& e) {
+    // Not being able to send is handled like no response.
+    PROPLINK_LOG_WARNING("Failed to send heartbeat: " << e.what());
+  }
+}
+
+void Client::__HandleHeartbeat(const ResponseMessage& response) {
+  if (!response.has_server_info()) return;
+  uint64_t previous_epoch;
+  {
+    std::lock_guard<std::mutex> lock(server_info_mutex_);
+    previous_epoch = server_info_.epoch();
+  }
+  __UpdateServerInfo(response);
+  // The server restarted without the connection being noticed as lost.
+  if (previous_epoch != 0 && response.server_info().epoch() != previous_epoch) {
+    PROPLINK_LOG_INFO("Server restarted, resynchronizing");
+    __Resync();
+  }
+}
+
+void Client::__Resync() {
+  {
+    std::lock_guard<std::mutex> lock(callbacks_mutex_);
+    if (slots_.empty() && prefix_slots_.empty()) return;
+  }
+  CommandMessage cmd;
+  cmd.set_command_id(__GetNextCommandId());
+  cmd.set_command_type(CommandMessage::GET_ALL_VARIABLES);
+  try {
+    // From the primary, whose subscription delivers the following changes.
+    __SendCommandAsync(cmd, [this](const ResponseMessage& response) {
+      if (!response.success()) return;
+      for (const auto& variable : response.variables()) {
+        __DispatchVariable(variable);
+      }
+    }, true);
+  } catch (const zmq::error_t& e) {
+    PROPLINK_LOG_WARNING("Failed to resynchronize: " << e.what());
+  }
+}
+
+bool Client::__Reconnect() {
+  if (!need_reconnect_) return true;
+
+  // Each primary gets the attempts.
+  if (reconnect_attempts_ >= kMaxReconnectAttempts * static_cast<int>(primaries_.size())) {
+    PROPLINK_LOG_ERROR("Max reconnection attempts reached. Giving up.");
+    opened_ = false;
+
+    // Sends failure to all requests.
+    std::lock_guard<std::mutex> lock(responses_mutex_);
+    for (auto& [cmd_id, promise] : pending_responses_) {
+      ResponseMessage error_response;
+      error_response.set_command_id(cmd_id);
+      error_response.set_success(false);
+      error_response.set_status(ResponseMessage::CONNECTION_LOST);
+      error_response.set_error_message("Failed to reconnect after maximum attempts");
+      promise.set_value(error_response);
+    }
+    pending_responses_.clear();
+    async_responses_.clear();
+
+    running_ = false;
+    return false;
+  }
+
+  const long delay_ms = std::min(kInitialReconnectDelayMs * (1 << reconnect_attempts_), kMaxReconnectDelayMs);
+  const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - last_reconnect_time_).count();
+  if (elapsed < delay_ms) return true;
+
+  //std::cout << "Attempting to reconnect (attempt " << reconnect_attempts_ + 1 << " of " << kMaxReconnectAttempts << ")..." << std::endl;
+  std::map<uint64_t, std::function<void(const ResponseMessage&)>> async_responses;
+  try {
+    __SelectPrimary();
+    __OpenDealers();
+
+    // The subscription follows the primary.
+    subscriber_->close();
+    subscriber_ = std::make_unique<zmq::socket_t>(*context_, ZMQ_SUB);
+    __ApplyHeartbeatOptions(*subscriber_);
+    __SubscribeAll();
+    subscriber_->setsockopt(ZMQ_RCVTIMEO, &request_timeout_ms_, sizeof(request_timeout_ms_));
+    subscriber_->connect(sub_endpoint_);
+
+    // std::cout << "Reconnection successful" << std::endl;
+    reconnect_attempts_ = 0;
+    need_reconnect_ = false;
+    opened_ = true;
+
+    // Sends error message to pending requests.
+    std::lock_guard<std::mutex> lock(responses_mutex_);
+    for (auto& [cmd_id, promise] : pending_responses_) {
+      ResponseMessage error_response;
+      error_response.set_command_id(cmd_id);
+      error_response.set_success(false);
+      error_response.set_status(ResponseMessage::CONNECTION_LOST);
+      error_response.set_error_message("Connection reset during operation");
+      promise.set_value(error_response);
+    }
+    pending_responses_.clear();
+    async_responses.swap(async_responses_);
+  }
+  catch (const zmq::error_t& e) {
+    PROPLINK_LOG_ERROR("Failed to reconnect: " << e.what());
+    reconnect_attempts_++;
+    last_reconnect_time_ = std::chrono::steady_clock::now();
+    return true;
+  }
+
+  // Sends error message to async requests. Called without responses_mutex_, so that callbacks can send commands.
+  for (auto& [cmd_id, callback] : async_responses) {
+    if (callback) {
+      ResponseMessage error_response;
+      error_response.set_command_id(cmd_id);
+      error_response.set_success(false);
+      error_response.set_status(ResponseMessage::CONNECTION_LOST);
+      error_response.set_error_message("Connection reset during operation");
+      callback(error_response);
+    }
+  }
+
+  // Changes published while disconnected are lost, so callbacks catch up with the current values.
+  last_received_time_ = std::chrono::steady_clock::now();
+  last_heartbeat_time_ = last_received_time_;
+  __Resync();
+  return true;
+}
+
+void Client::__ProcessDealer() {
+  for (auto& dealer : dealers_) {
+    __ProcessDealer(*dealer);
+  }
+  for (auto& replica : replicas_) {
+    __ProcessDealer(replica->dealer, replica.get());
+  }
+}
+
+void Client::__ProcessDealer(DealerConnection& dealer, ReplicaConnection* replica) {
+  // Drains all responses, since ZMQ_FD of threadless mode is edge-triggered.
+  while (true) {
+    zmq::message_t empty;
+    zmq::message_t reply;
+    try {
+      std::lock_guard<std::mutex> lock(dealer.mutex);
+      if (!dealer.socket->recv(&empty, ZMQ_DONTWAIT)) return;
+      dealer.socket->recv(&reply);
+      if (!replica) {
+        last_received_time_ = std::chrono::steady_clock::now();
+        primary_health_[primary_index_].failures = 0;
+      }
+    }
+    catch (const zmq::error_t& e) {
+      if (replica) {
+        // Replicas are only avoided for a while, the primary keeps serving the reads.
+        PROPLINK_LOG_WARNING("ZeroMQ error in replica recv: " << e.what() << " (errno: " << e.num() << ")");
+        std::lock_guard<std::mutex> lock(replicas_mutex_);
+        __RecordFailure(replica->health);
+        return;
+      }
+      if (e.num() == EAGAIN) {
+        PROPLINK_LOG_WARNING("Receive timeout on dealer socket");
+      } else {
+        PROPLINK_LOG_ERROR("ZeroMQ error in dealer recv: " << e.what() << " (errno: " << e.num() << ")");
+      }
+      need_reconnect_ = true;
+      last_reconnect_time_ = std::chrono::steady_clock::now();
+      return;
+    }
+
+    ResponseMessage response;
+    response.ParseFromArray(reply.data(), reply.size());
+    if (replica) {
+      std::lock_guard<std::mutex> lock(replicas_mutex_);
+      auto it = replica->in_flight.find(response.command_id());
+      if (it != replica->in_flight.end()) {
+        const double latency_ms = std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - it->second).count();
+        replica->latency_ms = replica->latency_ms == 0.0 ? latency_ms : 0.8 * replica->latency_ms + 0.2 * latency_ms;
+        replica->health.failures = 0;
+        replica->in_flight.erase(it);
+      }
+    }
+    __DispatchResponse(response);
+  }
+}
+
+void Client::__DispatchResponse(const ResponseMessage& response) {
+  const uint64_t cmd_id = response.command_id();
+  std::function<void(const ResponseMessage&)> callback;
+  {
+    std::lock_guard<std::mutex> lock(responses_mutex_);
+    // Handles sync communication.
+    auto it = pending_responses_.find(cmd_id);
+    if (it != pending_responses_.end()) {
+      it->second.set_value(response);
+      pending_responses_.erase(it);
+      return;
+    }
+    // Handles async communication.
+    auto async_it = async_responses_.find(cmd_id);
+    if (async_it != async_responses_.end()) {
+      callback = std::move(async_it->second);
+      async_responses_.erase(async_it);
+    }
+  }
+  // Called without responses_mutex_, so that callbacks can send commands.
+  if (callback) callback(response);
+
+  // Handles the results of combined writes, which have their own callbacks.
+  for (const auto& result : response.results()) {
+    std::function<void(const ResponseMessage&)> result_callback;
+    {
+      std::lock_guard<std::mutex> lock(responses_mutex_);
+      auto it = async_responses_.find(result.command_id());
+      if (it == async_responses_.end()) continue;
+      result_callback = std::move(it->second);
+      async_responses_.erase(it);
+    }
+    if (result_callback) result_callback(result);
+  }
+}
+
+void Client::__ProcessSubscriber() {
+  while (true) {
+    // Messages consist of the topic (the name of variable) and the variable.
+    zmq::message_t topic;
+    zmq::message_t zmqmsg;
+    try {
+      if (!subscriber_->recv(&topic, ZMQ_DONTWAIT)) return;
+      if (!topic.more()) continue;
+      subscriber_->recv(&zmqmsg);
+    }
+    catch (const zmq::error_t& e) {
+      if (e.num() == EAGAIN) {
+        PROPLINK_LOG_WARNING("Receive timeout on subscriber socket");
+        // SUB socket timeout may not be a fatal error, so continue without reconnecting.
+      } else {
+        PROPLINK_LOG_ERROR("ZeroMQ error in subscriber recv: " << e.what() << " (errno: " << e.num() << ")");
+        need_reconnect_ = true;
+        last_reconnect_time_ = std::chrono::steady_clock::now();
+      }
+      return;
+    }
+
+    VariableMessage varmsg;
+    if (varmsg.ParseFromArray(zmqmsg.data(), zmqmsg.size())) {
+      __DispatchVariable(varmsg);
+    }
+  }
+}
+
+void Client::__DispatchVariable(const VariableMessage& variable) {
+  if (variable.has_large_value()) {
+    // Nothing is read for a variable without callback, e.g. in a resynchronization.
+    std::lock_guard<std::mutex> lock(callbacks_mutex_);
+    if (!__HasCallback(variable.name())) return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(bulk_queue_mutex_);
+    if (variable.has_large_value() || bulk_in_flight_ > 0) {
+      bulk_queue_.push_back(variable);
+      bulk_in_flight_++;
+      if (!threadless_ && !bulk_thread_.joinable()) bulk_thread_ = std::thread(&Client::__BulkLoop, this);
+      bulk_queue_cv_.notify_one();
+      return;
+    }
+  }
+  Value value;
+  __ExtractValue(variable, value); // Not a large value, so never fails.
+  std::lock_guard<std::mutex> lock(callbacks_mutex_);
+  __NotifyVariable(variable.name(), value);
+}
+
+void Client::__NotifyQueuedVariable(const VariableMessage& variable) {
+  Value value;
+  if (!__ExtractValue(variable, value)) {
+    PROPLINK_LOG_ERROR("Change of variable '" << variable.name() << "' not notified, its value could not be read");
+    return;
+  }
+  std::lock_guard<std::mutex> lock(callbacks_mutex_);
+  __NotifyVariable(variable.name(), value);
+}
+
+void Client::__BulkLoop() {
+  while (true) {
+    VariableMessage variable;
+    {
+      std::unique_lock<std::mutex> lock(bulk_queue_mutex_);
+      bulk_queue_cv_.wait(lock, [this] { return bulk_stopping_ || !bulk_queue_.empty(); });
+      if (bulk_stopping_) return;
+      variable = std::move(bulk_queue_.front());
+      bulk_queue_.pop_front();
+    }
+    __NotifyQueuedVariable(variable);
+    std::lock_guard<std::mutex> lock(bulk_queue_mutex_);
+    bulk_in_flight_--;
+  }
+}
+
+void Client::__ProcessBulkQueue() {
+  while (true) {
+    VariableMessage variable;
+    {
+      std::lock_guard<std::mutex> lock(bulk_queue_mutex_);
+      if (bulk_queue_.empty()) return;
+      variable = std::move(bulk_queue_.front());
+      bulk_queue_.pop_front();
+    }
+    __NotifyQueuedVariable(variable);
+    std::lock_guard<std::mutex> lock(bulk_queue_mutex_);
+    bulk_in_flight_--;
+  }
+}
+
+void Client::__StopBulkThread() {
+  {
+    std::lock_guard<std::mutex> lock(bulk_queue_mutex_);
+    bulk_stopping_ = true;
+  }
+  bulk_queue_cv_.notify_all();
+  if (bulk_thread_.joinable()) bulk_thread_.join();
+  std::lock_guard<std::mutex> lock(bulk_queue_mutex_);
+  bulk_queue_.clear();
+  bulk_in_flight_ = 0;
+  bulk_stopping_ = false;
+}
+
+bool Client::__HasCallback(const std::string& name) const {
+  if (slots_.count(name)) return true;
+  return std::any_of(prefix_slots_.begin(), prefix_slots_.end(), 
+                     [&name](const std::pair<const std::string, NamedVariableChangedCallback>& slot) {
+    return name.compare(0, slot.first.size(), slot.first) == 0;
+  });
+}
+
+void Client::__NotifyVariable(const std::string& name, const Value& value) {
+  auto it = slots_.find(name);
+  auto matches_prefix = [&name](const std::pair<const std::string, NamedVariableChangedCallback>& slot) {
+    return name.compare(0, slot.first.size(), slot.first) == 0;
+  };
+  const bool has_prefix_slot = std::any_of(prefix_slots_.begin(), prefix_slots_.end(), matches_prefix);
+  if (it == slots_.end() && !has_prefix_slot) return;
+
+  // Callback function is only be called when changed value is different from the previous one. 
+  auto last_value_it = slots_last_known_values_.find(name);
+  if (last_value_it != slots_last_known_values_.end() && last_value_it->second == value) {
+    return;
+  }
+  slots_last_known_values_[name] = value;
+  if (it != slots_.end()) it->second(value);
+  if (!has_prefix_slot) return;
+  for (const auto& slot : prefix_slots_) {
+    if (matches_prefix(slot)) slot.second(name, value);
+  }
+}
+
+std::string Client::__DescribeStatus(const ResponseMessage& response) {
+  if (!response.error_message().empty()) return response.error_message();
+  return ResponseMessage::StatusCode_Name(response.status());
+}
+
+bool Client::__ExtractValue(const VariableMessage& variable, Value& value) {
+  if (variable.has_large_value()) {
+    std::string large_value;
+    if (!__ReadLargeValue(variable.large_value(), large_value)) return false;
+    value = std::move(large_value);
+    return true;
+  }
   switch (variable.value_case()) {
   case VariableMessage::kStringValue: 
-    return variable.string_value();
+    value = variable.string_value();
+    break;
   case VariableMessage::kDoubleValue: 
-    return variable.double_value();
+    value = variable.double_value();
+    break;
   case VariableMessage::kIntValue: 
-    return variable.int_value();
+    value = variable.int_value();
+    break;
   case VariableMessage::kBoolValue: 
-    return variable.bool_value();
+    value = variable.bool_value();
+    break;
   default:
-    return Value{};
+    value = Value{};
+    break;
   }
+  return true;
 }
 
 void Client::__SetValueToVariableMessage(VariableMessage* variable, const Value& value) {
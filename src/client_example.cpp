@@ -123,7 +123,8 @@ int main() {
       
       bool result = client.SetVariable("exposure", new_value, SyncConnection, 
         [](const ResponseMessage& resp) {
-          std::cout << "Synchronous response received: " << (resp.success() ? "Success" : "Failure");
+          std::cout << "Synchronous response received: " << (resp.success() ? "Success" : "Failure")
+                    << " (" << ResponseMessage::StatusCode_Name(resp.status()) << ")";
           if (!resp.message().empty()) {
             std::cout << " - " << resp.message();
           }
@@ -147,7 +148,8 @@ int main() {
       
       bool result = client.SetVariable("gain", new_value, AsyncConnection,
         [](const ResponseMessage& resp) {
-          std::cout << "Asynchronous response received: " << (resp.success() ? "Success" : "Failure");
+          std::cout << "Asynchronous response received: " << (resp.success() ? "Success" : "Failure")
+                    << " (" << ResponseMessage::StatusCode_Name(resp.status()) << ")";
           if (!resp.message().empty()) {
             std::cout << " - " << resp.message();
           }
@@ -170,7 +172,8 @@ int main() {
       
       bool result = client.ExecuteTrigger("start", SyncConnection,
         [](const ResponseMessage& resp) {
-          std::cout << "Synchronous trigger response received: " << (resp.success() ? "Success" : "Failure");
+          std::cout << "Synchronous trigger response received: " << (resp.success() ? "Success" : "Failure")
+                    << " (" << ResponseMessage::StatusCode_Name(resp.status()) << ")";
           if (!resp.message().empty()) {
             std::cout << " - " << resp.message();
           }
@@ -193,7 +196,8 @@ int main() {
       
       bool result = client.ExecuteTrigger("stop", AsyncConnection,
         [](const ResponseMessage& resp) {
-          std::cout << "Asynchronous trigger response received: " << (resp.success() ? "Success" : "Failure");
+          std::cout << "Asynchronous trigger response received: " << (resp.success() ? "Success" : "Failure")
+                    << " (" << ResponseMessage::StatusCode_Name(resp.status()) << ")";
           if (!resp.message().empty()) {
             std::cout << " - " << resp.message();
           }
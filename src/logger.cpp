@@ -0,0 +1,168 @@
+#include "logger.h"
+#include <iostream>
+#include <cstdlib>
+#include <algorithm>
+
+namespace proplink {
+
+namespace {
+
+const char* __LevelName(LogLevel level) {
+  switch (level) {
+    case LogLevel::Debug: return "DEBUG";
+    case LogLevel::Info: return "INFO";
+    case LogLevel::Warning: return "WARNING";
+    case LogLevel::Error: return "ERROR";
+    default: return "";
+  }
+}
+
+}
+
+void StderrSink::Write(const LogRecord& record) {
+  std::cerr << "[proplink] " << __LevelName(record.level) << ": " << record.message << std::endl;
+}
+
+Logger& Logger::Instance() {
+  // Never destroyed, so that Servers and Clients destroyed during static destruction can still log.
+  // The background thread is stopped at exit, after which records are written synchronously.
+  static Logger* instance = [] {
+    Logger* logger = new Logger();
+    logger->SetAsync(true);
+    std::atexit([] { Logger::Instance().SetAsync(false); });
+    return logger;
+  }();
+  return *instance;
+}
+
+Logger::Logger() : sink_(std::make_shared<StderrSink>()) {}
+
+void Logger::SetLevel(LogLevel level) {
+  level_.store(level, std::memory_order_relaxed);
+}
+
+void Logger::SetSink(std::shared_ptr<LogSink> sink) {
+  std::lock_guard<std::mutex> lock(sink_mutex_);
+  sink_ = std::move(sink);
+}
+
+void Logger::SetRateLimit(uint32_t max_records, uint32_t window_ms) {
+  rate_limit_records_.store(max_records, std::memory_order_relaxed);
+  rate_limit_window_ms_.store(window_ms, std::memory_order_relaxed);
+}
+
+void Logger::SetAsync(bool async, size_t capacity) {
+  std::lock_guard<std::mutex> async_lock(async_mutex_);
+  std::thread writer_thread;
+  {
+    std::lock_guard<std::mutex> lock(queue_mutex_);
+    if (async == async_) return;
+    async_ = async;
+    if (async) {
+      ring_.clear();
+      ring_.resize(std::max<size_t>(capacity, 1));
+      head_ = 0;
+      size_ = 0;
+      writer_thread_ = std::thread(&Logger::__WriterLoop, this);
+    } else {
+      writer_thread = std::move(writer_thread_);
+    }
+  }
+  // The writer thread drains the remaining records before it exits.
+  queue_cv_.notify_all();
+  if (writer_thread.joinable()) {
+    writer_thread.join();
+  }
+}
+
+void Logger::Flush() {
+  std::unique_lock<std::mutex> lock(queue_mutex_);
+  flushed_cv_.wait(lock, [this] { return (size_ == 0 && writing_ == 0) || !async_; });
+}
+
+bool Logger::Admit(LogSite& site, uint32_t& suppressed) {
+  suppressed = 0;
+  const uint32_t max_records = rate_limit_records_.load(std::memory_order_relaxed);
+  if (max_records == 0) return true;
+
+  const int64_t now_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+  int64_t window_start_ms = site.window_start_ms.load(std::memory_order_relaxed);
+  if (now_ms - window_start_ms >= rate_limit_window_ms_.load(std::memory_order_relaxed) &&
+      site.window_start_ms.compare_exchange_strong(window_start_ms, now_ms)) {
+    // Only the thread which starts the new window reports the suppressed count.
+    site.count.store(1, std::memory_order_relaxed);
+    suppressed = site.suppressed.exchange(0);
+    return true;
+  }
+  if (site.count.fetch_add(1, std::memory_order_relaxed) < max_records) return true;
+  site.suppressed.fetch_add(1, std::memory_order_relaxed);
+  return false;
+}
+
+void Logger::Log(LogLevel level, std::string message) {
+  LogRecord record{level, std::chrono::system_clock::now(), std::move(message)};
+  {
+    std::lock_guard<std::mutex> lock(queue_mutex_);
+    if (async_) {
+      if (size_ == ring_.size()) {
+        dropped_++;
+        return;
+      }
+      ring_[(head_ + size_) % ring_.size()] = std::move(record);
+      size_++;
+      // Notifying under the lock is fine, the writer thread blocks on queue_mutex_ only briefly.
+      queue_cv_.notify_one();
+      return;
+    }
+  }
+  std::lock_guard<std::mutex> sink_lock(sink_mutex_);
+  __Write(record);
+}
+
+void Logger::__WriterLoop() {
+  std::vector<LogRecord> records;
+  std::unique_lock<std::mutex> lock(queue_mutex_);
+  while (true) {
+    queue_cv_.wait(lock, [this] { return size_ > 0 || dropped_ > 0 || !async_; });
+    if (size_ == 0 && dropped_ == 0) break;
+
+    const uint64_t dropped = dropped_;
+    dropped_ = 0;
+    while (size_ > 0) {
+      records.push_back(std::move(ring_[head_]));
+      head_ = (head_ + 1) % ring_.size();
+      size_--;
+    }
+    writing_ = records.size();
+    lock.unlock();
+
+    {
+      std::lock_guard<std::mutex> sink_lock(sink_mutex_);
+      if (dropped > 0) {
+        __Write({LogLevel::Warning, std::chrono::system_clock::now(),
+                 std::to_string(dropped) + " log messages dropped, the log buffer is full"});
+      }
+      for (const auto& record : records) {
+        __Write(record);
+      }
+    }
+    records.clear();
+
+    lock.lock();
+    writing_ = 0;
+    flushed_cv_.notify_all();
+  }
+  flushed_cv_.notify_all();
+}
+
+void Logger::__Write(const LogRecord& record) {
+  if (!sink_) return;
+  try {
+    sink_->Write(record);
+  } catch (...) {
+    // A failing sink must not take down the caller.
+  }
+}
+
+}
@@ -0,0 +1,108 @@
+#include "../include/proplink/server.h"
+#include "../include/proplink/logger.h"
+#include <iostream>
+#include <thread>
+#include <chrono>
+#include <string>
+#include <csignal>
+#include <cstdlib>
+
+using namespace proplink;
+
+// Caching fan-out proxy. It mirrors all variables of one upstream Server, which must have replication enabled,
+// answers reads and watches from the mirror, forwards writes and triggers upstream, and publishes the changes
+// to its own subscribers, so that remote dashboards don't load the upstream server.
+
+volatile sig_atomic_t g_running = 1;
+
+void SignalHandler(int /*signum*/) {
+  g_running = 0;
+}
+
+void PrintUsage(const char* program) {
+  std::cout << "Usage: " << program << " [options]\n"
+            << "  --upstream-router <endpoint>       Router endpoint of the upstream server (required)\n"
+            << "  --upstream-replication <endpoint>  Replication endpoint of the upstream server (required)\n"
+            << "  --router <endpoint>                Router endpoint of the proxy (default tcp://*:5555)\n"
+            << "  --pub <endpoint>                   Publisher endpoint of the proxy (default tcp://*:5556)\n"
+            << "  --replication <endpoint>           Replication endpoint of the proxy, to chain proxies\n"
+            << "  --threads <count>                  Size of the thread pool (default hardware concurrency)\n"
+            << "  --read-only                        Reject writes and triggers instead of forwarding them\n"
+            << "  --status-interval <seconds>        Interval of printing the replication status (default 10, 0 disables)\n"
+            << "  --verbose                          Log at info level and send messages in responses\n";
+}
+
+int main(int argc, char* argv[]) {
+  std::string upstream_router;
+  std::string upstream_replication;
+  std::string router = "tcp://*:5555";
+  std::string pub = "tcp://*:5556";
+  std::string replication;
+  size_t threads = std::thread::hardware_concurrency();
+  bool read_only = false;
+  int status_interval_s = 10;
+  bool verbose = false;
+
+  for (int i = 1; i < argc; i++) {
+    const std::string arg = argv[i];
+    const bool has_value = i + 1 < argc;
+    if (arg == "--upstream-router" && has_value) {
+      upstream_router = argv[++i];
+    } else if (arg == "--upstream-replication" && has_value) {
+      upstream_replication = argv[++i];
+    } else if (arg == "--router" && has_value) {
+      router = argv[++i];
+    } else if (arg == "--pub" && has_value) {
+      pub = argv[++i];
+    } else if (arg == "--replication" && has_value) {
+      replication = argv[++i];
+    } else if (arg == "--threads" && has_value) {
+      threads = static_cast<size_t>(std::strtoul(argv[++i], nullptr, 10));
+    } else if (arg == "--read-only") {
+      read_only = true;
+    } else if (arg == "--status-interval" && has_value) {
+      status_interval_s = std::atoi(argv[++i]);
+    } else if (arg == "--verbose") {
+      verbose = true;
+    } else {
+      PrintUsage(argv[0]);
+      return arg == "--help" ? 0 : 1;
+    }
+  }
+  if (upstream_router.empty() || upstream_replication.empty()) {
+    PrintUsage(argv[0]);
+    return 1;
+  }
+
+  signal(SIGINT, SignalHandler);
+  signal(SIGTERM, SignalHandler);
+  if (verbose) Logger::Instance().SetLevel(LogLevel::Info);
+
+  Server server(router, pub, threads > 0 ? threads : 1);
+  server.SetServerId("proplink_proxy " + router);
+  server.SetVerboseResponses(verbose);
+  server.SetReplicaOf(upstream_router, upstream_replication, !read_only);
+  if (!replication.empty()) server.EnableReplication(replication);
+  if (!server.Start()) {
+    std::cerr << "Failed to start proxy on " << router << " and " << pub << std::endl;
+    return 1;
+  }
+  std::cout << "Proxying " << upstream_router << " on " << router << " (ROUTER) and " << pub << " (PUB)" << std::endl;
+
+  auto last_status = std::chrono::steady_clock::now();
+  while (g_running) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    if (status_interval_s <= 0 ||
+        std::chrono::steady_clock::now() - last_status < std::chrono::seconds(status_interval_s)) {
+      continue;
+    }
+    last_status = std::chrono::steady_clock::now();
+    const ReplicationStatus status = server.GetReplicationStatus();
+    std::cout << "Upstream " << (status.synchronized ? "synchronized" : "not synchronized")
+              << ", sequence " << status.applied_sequence << "/" << status.primary_sequence
+              << ", lag " << status.lag_ms << " ms, snapshots " << status.snapshots << std::endl;
+  }
+
+  server.Stop();
+  return 0;
+}
@@ -1,6 +1,7 @@
 #include "server.h"
-//#include <iostream>
+#include "logger.h"
 #include <chrono>
+#include <algorithm>
 
 namespace proplink {
 
@@ -16,7 +17,8 @@ Server::Server(const std::string& internal_router_endpoint,
   external_pub_endpoint_(external_pub_endpoint),
   context_(1), 
   has_external_endpoints_(true), 
-  thread_pool_(threadpool_size) {
+  thread_pool_(threadpool_size),
+  server_id_(internal_router_endpoint) {
 }
 
 Server::Server(const std::string& router_endpoint, 
@@ -27,7 +29,8 @@ Server::Server(const std::string& router_endpoint,
       internal_pub_endpoint_(pub_endpoint),
       context_(1), 
       has_external_endpoints_(false), 
-      thread_pool_(threadpool_size) {
+      thread_pool_(threadpool_size),
+      server_id_(router_endpoint) {
 }
 
 Server::~Server() {
@@ -42,29 +45,65 @@ bool Server::Start() {
     internal_router_ = std::make_unique<zmq::socket_t>(context_, ZMQ_ROUTER);
     internal_router_->bind(internal_router_endpoint_);
 
-    internal_publisher_ = std::make_unique<zmq::socket_t>(context_, ZMQ_PUB);
+    // XPUB passes the subscriptions of clients up to the server, so that
+    // variables nobody is subscribed to are neither serialized nor sent.
+    internal_publisher_ = std::make_unique<zmq::socket_t>(context_, ZMQ_XPUB);
     internal_publisher_->bind(internal_pub_endpoint_);
 
     if (has_external_endpoints_) {
       external_router_ = std::make_unique<zmq::socket_t>(context_, ZMQ_ROUTER);
       external_router_->bind(external_router_endpoint_);
 
-      external_publisher_ = std::make_unique<zmq::socket_t>(context_, ZMQ_PUB);
+      external_publisher_ = std::make_unique<zmq::socket_t>(context_, ZMQ_XPUB);
       external_publisher_->bind(external_pub_endpoint_);
     }
 
     inproc_socket_ = std::make_unique<zmq::socket_t>(context_, ZMQ_PAIR);
     inproc_socket_->bind("inproc://control");
+
+    if (!bulk_endpoint_.empty()) {
+      bulk_router_ = std::make_unique<zmq::socket_t>(context_, ZMQ_ROUTER);
+      bulk_router_->bind(bulk_endpoint_);
+    }
+
+    // A new epoch tells the clients that the server restarted.
+    epoch_ = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count());
+
+    if (!replication_endpoint_.empty()) {
+      std::lock_guard<std::mutex> lock(variables_mutex_);
+      replication_publisher_ = std::make_unique<zmq::socket_t>(context_, ZMQ_PUB);
+      replication_publisher_->bind(replication_endpoint_);
+      replication_sequence_ = 0; // Restarts with the epoch.
+    }
+
+    if (!primary_router_endpoint_.empty()) {
+      primary_dealer_ = std::make_unique<zmq::socket_t>(context_, ZMQ_DEALER);
+      primary_dealer_->connect(primary_router_endpoint_);
+      replication_subscriber_ = std::make_unique<zmq::socket_t>(context_, ZMQ_SUB);
+      replication_subscriber_->setsockopt(ZMQ_SUBSCRIBE, "", 0);
+      replication_subscriber_->connect(primary_replication_endpoint_);
+      {
+        std::lock_guard<std::mutex> lock(replication_status_mutex_);
+        replication_status_ = ReplicationStatus();
+      }
+      primary_epoch_ = 0;
+      applied_sequence_ = 0;
+      forwarded_commands_.clear();
+      // Subscribed before the snapshot is requested, so that no change falls between the two.
+      __RequestSnapshot();
+    }
     
     running_ = true;
     worker_thread_ = std::thread(&Server::__WorkerLoop, this);
+    __StartSampler();
     return true;
   } catch (const zmq::error_t& e) {
-    std::cerr << "ZeroMQ error in Start(): " << e.what() << " (errno: " << e.num() << ")" << std::endl;
+    PROPLINK_LOG_ERROR("ZeroMQ error in Start(): " << e.what() << " (errno: " << e.num() << ")");
     __CleanupSockets();
     return false;
   } catch (const std::exception& e) {
-    std::cerr << "Exception in Start(): " << e.what() << std::endl;
+    PROPLINK_LOG_ERROR("Exception in Start(): " << e.what());
     __CleanupSockets();
     return false;
   }
@@ -81,17 +120,275 @@ void Server::Stop() {
     s.send(msg);
 
     if (worker_thread_.joinable()) worker_thread_.join();
+    {
+      std::lock_guard<std::mutex> lock(sampler_mutex_);
+      sampler_cv_.notify_all();
+    }
+    if (sampler_thread_.joinable()) sampler_thread_.join();
 
     __CleanupSockets();
+
+    // Subscriptions are gone along with the publishers.
+    std::lock_guard<std::mutex> lock(variables_mutex_);
+    internal_topics_.clear();
+    external_topics_.clear();
+    for (auto& p : variables_) {
+      p.second.internal_subscribers = 0;
+      p.second.external_subscribers = 0;
+    }
+
+    // Large values can no longer be read.
+    {
+      std::lock_guard<std::mutex> large_values_lock(large_values_mutex_);
+      large_values_.clear();
+    }
+
+    // Parked watches can no longer be answered.
+    std::lock_guard<std::mutex> watches_lock(watches_mutex_);
+    watches_by_name_.clear();
+    watch_deadlines_.clear();
+    watches_per_requester_.clear();
   }
 }
 
 void Server::RegisterVariable(const Variable& variable, 
                               VariableChangedCallback callback) {
+  {
+    std::lock_guard<std::mutex> lock(pending_sets_mutex_);
+    if (variable.coalesce) {
+      coalesced_variables_.insert(variable.name);
+    } else {
+      coalesced_variables_.erase(variable.name);
+    }
+  }
+
+  Value value = variable.value;
+  std::shared_ptr<const std::string> large_value = __MakeLargeValue(value);
   std::lock_guard<std::mutex> lock(variables_mutex_);
-  variables_[variable.name].value = variable.value;
+  __StoreValue(variables_[variable.name], std::move(value), std::move(large_value));
   variables_[variable.name].read_only = variable.read_only;
   variables_[variable.name].callback = callback;
+  __UnbindVariable(variable.name, variables_[variable.name]);
+  __AssignVariableId(variable.name, variables_[variable.name]);
+  ++schema_generation_;
+  variables_[variable.name].version = ++version_;
+  variables_[variable.name].internal_subscribers = __CountMatchingTopics(internal_topics_, variable.name);
+  variables_[variable.name].external_subscribers = __CountMatchingTopics(external_topics_, variable.name);
+  __ReplicateVariable(variable.name, variables_[variable.name]);
+}
+
+void Server::RegisterVariable(const std::string& name, VariableProvider provider, const int ttl_ms) {
+  {
+    std::lock_guard<std::mutex> lock(pending_sets_mutex_);
+    coalesced_variables_.erase(name);
+  }
+  auto provided = std::make_shared<ProvidedValue>();
+  provided->provider = std::move(provider);
+  provided->ttl = std::chrono::milliseconds(ttl_ms > 0 ? ttl_ms : 0);
+
+  // Evaluated once before the variable enters the schema, so that DESCRIBE reports the type of its values.
+  Value value;
+  try {
+    value = provided->provider();
+    provided->valid = true;
+    provided->expiry = std::chrono::steady_clock::now() + provided->ttl;
+  } catch (const std::exception& e) {
+    PROPLINK_LOG_ERROR("Exception in provider of variable '" << name << "': " << e.what());
+  } catch (...) {
+    PROPLINK_LOG_ERROR("Unknown exception in provider of variable '" << name << "'");
+  }
+  std::shared_ptr<const std::string> large_value = __MakeLargeValue(value);
+
+  std::lock_guard<std::mutex> lock(variables_mutex_);
+  PropertyWithCallback& property = variables_[name];
+  __UnbindVariable(name, property);
+  __AssignVariableId(name, property);
+  ++schema_generation_;
+  __StoreValue(property, std::move(value), std::move(large_value));
+  property.read_only = true; // Only the provider computes the value.
+  property.callback = nullptr;
+  property.provider = std::move(provided);
+  provided_variables_.push_back(name);
+  property.version = ++version_;
+  property.internal_subscribers = __CountMatchingTopics(internal_topics_, name);
+  property.external_subscribers = __CountMatchingTopics(external_topics_, name);
+  __ReplicateVariable(name, property);
+}
+
+void Server::__UnbindVariable(const std::string& name, PropertyWithCallback& property) {
+  if (property.reader) {
+    property.reader = nullptr;
+    bound_variables_.erase(std::find(bound_variables_.begin(), bound_variables_.end(), name));
+  }
+  if (property.provider) {
+    property.provider = nullptr;
+    provided_variables_.erase(std::find(provided_variables_.begin(), provided_variables_.end(), name));
+  }
+}
+
+void Server::__RefreshProvidedVariable(const std::string& name) {
+  std::shared_ptr<ProvidedValue> provided;
+  {
+    std::lock_guard<std::mutex> lock(variables_mutex_);
+    if (provided_variables_.empty()) return;
+    auto it = variables_.find(name);
+    if (it == variables_.end() || !it->second.provider) return;
+    provided = it->second.provider;
+  }
+  __EvaluateProvider(name, *provided);
+}
+
+void Server::__RefreshProvidedVariables() {
+  std::vector<std::pair<std::string, std::shared_ptr<ProvidedValue>>> providers;
+  {
+    std::lock_guard<std::mutex> lock(variables_mutex_);
+    for (const auto& name : provided_variables_) {
+      providers.emplace_back(name, variables_[name].provider);
+    }
+  }
+  for (const auto& [name, provided] : providers) {
+    __EvaluateProvider(name, *provided);
+  }
+}
+
+void Server::__EvaluateProvider(const std::string& name, ProvidedValue& provided) {
+  {
+    std::unique_lock<std::mutex> lock(provided.mutex);
+    if (provided.evaluating) {
+      // Single flight: the value stored by the evaluation in progress is used.
+      provided.evaluated_cv.wait(lock, [&provided] { return !provided.evaluating; });
+      return;
+    }
+    if (provided.valid && std::chrono::steady_clock::now() < provided.expiry) return;
+    provided.evaluating = true;
+  }
+
+  Value value;
+  bool success = true;
+  try {
+    value = provided.provider();
+  } catch (const std::exception& e) {
+    PROPLINK_LOG_ERROR("Exception in provider of variable '" << name << "': " << e.what());
+    success = false; // The last value is kept, and the next read calls the provider again.
+  } catch (...) {
+    // Anything else thrown must not leave the evaluation in progress, which would block every later read.
+    PROPLINK_LOG_ERROR("Unknown exception in provider of variable '" << name << "'");
+    success = false;
+  }
+
+  if (success) {
+    std::shared_ptr<const std::string> large_value = __MakeLargeValue(value);
+    std::vector<PendingResponse> watch_responses;
+    {
+      std::lock_guard<std::mutex> lock(variables_mutex_);
+      auto it = variables_.find(name);
+      // Skips the value if the variable was registered again during the evaluation.
+      if (it != variables_.end() && it->second.provider.get() == &provided && 
+          !__HasValue(it->second, value, large_value)) {
+        if (it->second.value.index() != value.index()) ++schema_generation_; // The type is in the schema.
+        __StoreValue(it->second, std::move(value), std::move(large_value));
+        it->second.version = ++version_;
+        if (running_) __PublishVariable(name, it->second);
+        __CollectWatches(name, watch_responses);
+        __ReplicateVariable(name, it->second);
+      }
+    }
+    for (const auto& pending : watch_responses) {
+      __SendResponse(pending.requester, pending.response);
+    }
+  }
+
+  std::lock_guard<std::mutex> lock(provided.mutex);
+  provided.evaluating = false;
+  if (success) {
+    provided.valid = true;
+    provided.expiry = std::chrono::steady_clock::now() + provided.ttl;
+  }
+  provided.evaluated_cv.notify_all();
+}
+
+void Server::BindVariable(const std::string& name, const std::atomic<double>* source) {
+  __BindVariable(name, [source]() -> Value { return source->load(std::memory_order_relaxed); });
+}
+
+void Server::BindVariable(const std::string& name, const std::atomic<int>* source) {
+  __BindVariable(name, [source]() -> Value { return source->load(std::memory_order_relaxed); });
+}
+
+void Server::__BindVariable(const std::string& name, std::function<Value()> reader) {
+  {
+    std::lock_guard<std::mutex> lock(pending_sets_mutex_);
+    coalesced_variables_.erase(name);
+  }
+  {
+    std::lock_guard<std::mutex> lock(variables_mutex_);
+    PropertyWithCallback& property = variables_[name];
+    __UnbindVariable(name, property);
+    __AssignVariableId(name, property);
+    ++schema_generation_;
+    bound_variables_.push_back(name);
+    __StoreValue(property, reader(), nullptr);
+    property.read_only = true; // Only the application writes the memory.
+    property.callback = nullptr;
+    property.reader = std::move(reader);
+    property.version = ++version_;
+    property.internal_subscribers = __CountMatchingTopics(internal_topics_, name);
+    property.external_subscribers = __CountMatchingTopics(external_topics_, name);
+    __ReplicateVariable(name, property);
+  }
+  if (running_) __StartSampler();
+}
+
+void Server::__StartSampler() {
+  {
+    std::lock_guard<std::mutex> lock(variables_mutex_);
+    if (bound_variables_.empty()) return;
+  }
+  std::lock_guard<std::mutex> lock(sampler_mutex_);
+  if (!sampler_thread_.joinable()) {
+    sampler_thread_ = std::thread(&Server::__SamplerLoop, this);
+  }
+}
+
+void Server::__SamplerLoop() {
+  std::unique_lock<std::mutex> lock(sampler_mutex_);
+  while (running_) {
+    lock.unlock();
+    __SampleBoundVariables();
+    lock.lock();
+    sampler_cv_.wait_for(lock, std::chrono::milliseconds(sampling_interval_ms_), [this] { return !running_; });
+  }
+}
+
+void Server::__SampleBoundVariables() {
+  std::vector<PendingResponse> watch_responses;
+  {
+    std::lock_guard<std::mutex> lock(variables_mutex_);
+    for (const auto& name : bound_variables_) {
+      PropertyWithCallback& property = variables_[name];
+      Value value = property.reader();
+      if (value == property.value) continue;
+      property.value = std::move(value);
+      property.version = ++version_;
+      __PublishVariable(name, property);
+      __CollectWatches(name, watch_responses);
+      __ReplicateVariable(name, property);
+    }
+  }
+  for (const auto& pending : watch_responses) {
+    __SendResponse(pending.requester, pending.response);
+  }
+}
+
+void Server::SetVariableMetadata(const std::string& name, const VariableMetadata& metadata) {
+  std::lock_guard<std::mutex> lock(variables_mutex_);
+  auto it = variables_.find(name);
+  if (it == variables_.end()) {
+    PROPLINK_LOG_WARNING("Failed to set metadata of variable named '" << name << "', it had not registered");
+    return;
+  }
+  it->second.metadata = metadata;
+  ++schema_generation_;
 }
 
 void Server::RegisterTrigger(const Trigger& trigger, 
@@ -99,78 +396,622 @@ void Server::RegisterTrigger(const Trigger& trigger,
   {
     std::lock_guard<std::mutex> lock(triggers_mutex_);
     triggers_[trigger].callback = callback;
+    triggers_[trigger].callback_with_arguments = nullptr;
   }
 }
 
+void Server::RegisterTrigger(const Trigger& trigger, 
+                             TriggerWithArgumentsCallback callback) {
+  std::lock_guard<std::mutex> lock(triggers_mutex_);
+  triggers_[trigger].callback = nullptr;
+  triggers_[trigger].callback_with_arguments = callback;
+}
+
 std::unordered_map<std::string, Value> Server::GetVariables() {
-  std::lock_guard<std::mutex> lock(variables_mutex_);
-  
+  __RefreshProvidedVariables();
   std::unordered_map<std::string, Value> result;
-  
-  for (const auto& p : variables_) {
-    result[p.first] = p.second.value;
+  std::vector<std::pair<std::string, std::shared_ptr<const std::string>>> large_values;
+  {
+    std::lock_guard<std::mutex> lock(variables_mutex_);
+    for (const auto& p : variables_) {
+      if (p.second.large_value) {
+        large_values.emplace_back(p.first, p.second.large_value);
+      } else {
+        result[p.first] = p.second.reader ? p.second.reader() : p.second.value;
+      }
+    }
+  }
+  // Large values are copied after unlocking.
+  for (const auto& [name, large_value] : large_values) {
+    result[name] = *large_value;
+  }
+  return result;
+}
+
+std::unordered_map<std::string, Value> Server::GetVariables(const std::vector<std::string>& names) {
+  for (const auto& name : names) {
+    __RefreshProvidedVariable(name);
+  }
+  std::unordered_map<std::string, Value> result;
+  std::vector<std::pair<std::string, std::shared_ptr<const std::string>>> large_values;
+  {
+    std::lock_guard<std::mutex> lock(variables_mutex_);
+    for (const auto& name : names) {
+      auto it = variables_.find(name);
+      if (it == variables_.end()) continue;
+      if (it->second.large_value) {
+        large_values.emplace_back(name, it->second.large_value);
+      } else {
+        result[name] = it->second.reader ? it->second.reader() : it->second.value;
+      }
+    }
+  }
+  // Large values are copied after unlocking.
+  for (const auto& [name, large_value] : large_values) {
+    result[name] = *large_value;
   }
-  
   return result;
 }
 
 Value Server::GetVariable(const std::string& name) {
-  std::lock_guard<std::mutex> lock(variables_mutex_);
-  
-  auto it = variables_.find(name);
-  if (it != variables_.end()) {
-    return it->second.value;
+  __RefreshProvidedVariable(name);
+  std::shared_ptr<const std::string> large_value;
+  {
+    std::lock_guard<std::mutex> lock(variables_mutex_);
+    auto it = variables_.find(name);
+    if (it == variables_.end()) {
+      Value empty;
+      return empty;
+    }
+    if (!it->second.large_value) return it->second.reader ? it->second.reader() : it->second.value;
+    large_value = it->second.large_value;
   }
-  
-  Value empty;
-  return empty;
+  // Copied after unlocking.
+  return *large_value;
 }
 
 void Server::SetVariable(const std::string& name, const Value& value) {
-  std::lock_guard<std::mutex> lock(variables_mutex_);
-  auto it = variables_.find(name);
-  if (it != variables_.end()) {
-    if (it->second.value == value) return; // Prevents binding loop
-    it->second.value = value;
+  // A large value is copied before locking, and only swapped in under the lock.
+  Value new_value = value;
+  std::shared_ptr<const std::string> large_value = __MakeLargeValue(new_value);
+  std::vector<PendingResponse> watch_responses;
+  {
+    std::lock_guard<std::mutex> lock(variables_mutex_);
+    auto it = variables_.find(name);
+    if (it == variables_.end()) {
+      PROPLINK_LOG_WARNING("Failed to set variable named '" << name << "', it had not registered");
+      return;
+    }
+    if (it->second.reader) {
+      PROPLINK_LOG_WARNING("Failed to set variable named '" << name << "', it is bound to application memory");
+      return;
+    }
+    if (it->second.provider) {
+      PROPLINK_LOG_WARNING("Failed to set variable named '" << name << "', it is computed by a provider");
+      return;
+    }
+    if (__HasValue(it->second, new_value, large_value)) return; // Prevents binding loop
+    __StoreValue(it->second, std::move(new_value), std::move(large_value));
+    it->second.version = ++version_;
     
     // Notify the Client that the variable is changed by the Server.
-    if (running_) {
-      VariableMessage var;
-      var.set_name(name);
-      if (std::holds_alternative<double>(value)) {
-        var.set_double_value(std::get<double>(value));
-      } else if (std::holds_alternative<int>(value)) {
-        var.set_int_value(std::get<int>(value));
-      } else if (std::holds_alternative<bool>(value)) {
-        var.set_bool_value(std::get<bool>(value));
-      } else {
-        var.set_string_value(std::get<std::string>(value));
-      }
-      var.set_read_only(it->second.read_only);
+    if (running_) __PublishVariable(name, it->second);
+    __CollectWatches(name, watch_responses);
+    __ReplicateVariable(name, it->second);
+  }
+  for (const auto& pending : watch_responses) {
+    __SendResponse(pending.requester, pending.response);
+  }
+}
 
-      // Serialize
-      const size_t msg_size = var.ByteSizeLong();
-      std::vector<char> serialized_data(msg_size);
-      if (!var.SerializeToArray(serialized_data.data(), msg_size)) {
-        std::cerr << "Failed to serialize publisher message" << std::endl;
-        return;
-      }
+void Server::__PublishVariable(const std::string& name, const PropertyWithCallback& property) {
+  // Skips the serialization entirely if no client is subscribed to the variable.
+  const bool publish_internal = property.internal_subscribers > 0;
+  const bool publish_external = has_external_endpoints_ && external_publisher_ && 
+                                property.external_subscribers > 0;
+  if (!publish_internal && !publish_external) return;
+
+  VariableMessage var;
+  __FillVariableMessage(&var, name, property);
+
+  // Serialize
+  const size_t msg_size = var.ByteSizeLong();
+  std::vector<char> serialized_data(msg_size);
+  if (!var.SerializeToArray(serialized_data.data(), msg_size)) {
+    PROPLINK_LOG_ERROR("Failed to serialize publisher message");
+    return;
+  }
+
+  // The name of the variable is sent as the topic frame so that
+  // subscribers (and XPUB) can filter by it.
+  if (publish_internal) {
+    zmq::message_t internal_topic(name.data(), name.size());
+    zmq::message_t internal_msg(msg_size);
+    memcpy(internal_msg.data(), serialized_data.data(), msg_size);
+    internal_publisher_->send(internal_topic, ZMQ_SNDMORE);
+    internal_publisher_->send(internal_msg);
+  }
+  
+  if (publish_external) {
+    zmq::message_t external_topic(name.data(), name.size());
+    zmq::message_t external_msg(msg_size);
+    memcpy(external_msg.data(), serialized_data.data(), msg_size);
+    external_publisher_->send(external_topic, ZMQ_SNDMORE);
+    external_publisher_->send(external_msg);
+  }
+}
+
+void Server::SetReplicaOf(const std::string& primary_router_endpoint, 
+                          const std::string& primary_replication_endpoint, 
+                          bool forward_writes) {
+  primary_router_endpoint_ = primary_router_endpoint;
+  primary_replication_endpoint_ = primary_replication_endpoint;
+  forward_writes_ = forward_writes;
+}
+
+ReplicationStatus Server::GetReplicationStatus() {
+  std::lock_guard<std::mutex> lock(replication_status_mutex_);
+  return replication_status_;
+}
+
+void Server::__ReplicateVariable(const std::string& name, const PropertyWithCallback& property) {
+  if (!running_ || !replication_publisher_) return;
+  ReplicationMessage message;
+  message.set_sequence(++replication_sequence_);
+  message.set_epoch(epoch_);
+  message.set_timestamp_ms(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::system_clock::now().time_since_epoch()).count()));
+  __FillVariableMessage(message.mutable_variable(), name, property, true);
+  __SendReplicationMessage(message);
+}
+
+void Server::__SendReplicationMessage(const ReplicationMessage& message) {
+  zmq::message_t msg(message.ByteSizeLong());
+  message.SerializeToArray(msg.data(), msg.size());
+  // A replica too slow to keep up loses messages at the high water mark, and notices the gap.
+  replication_publisher_->send(msg, ZMQ_DONTWAIT);
+}
 
-      zmq::message_t internal_msg(msg_size);
-      memcpy(internal_msg.data(), serialized_data.data(), msg_size);
-      internal_publisher_->send(internal_msg);
-      
-      if (has_external_endpoints_ && external_publisher_) {
-        zmq::message_t external_msg(msg_size);
-        memcpy(external_msg.data(), serialized_data.data(), msg_size);
-        external_publisher_->send(external_msg);
+void Server::__HandleReplicationSnapshot(const CommandMessage& command, ResponseMessage& response) {
+  {
+    std::lock_guard<std::mutex> lock(variables_mutex_);
+    for (const auto& p : variables_) {
+      __FillVariableMessage(response.add_variables(), p.first, p.second, true);
+    }
+    response.set_sequence(replication_sequence_);
+    response.set_version(version_);
+  }
+  response.mutable_server_info()->set_server_id(server_id_);
+  response.mutable_server_info()->set_epoch(epoch_);
+  __SetStatus(response, ResponseMessage::OK, [] { return "Replication snapshot"; });
+}
+
+void Server::__ServeReplication() {
+  const auto now = std::chrono::steady_clock::now();
+  const auto heartbeat_interval = std::chrono::milliseconds(kReplicationHeartbeatMs);
+  if (replication_publisher_ && now - last_replication_heartbeat_ >= heartbeat_interval) {
+    // Lets the replicas notice a lost tail of the stream and measure their lag while nothing changes.
+    last_replication_heartbeat_ = now;
+    ReplicationMessage message;
+    message.set_epoch(epoch_);
+    message.set_timestamp_ms(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count()));
+    std::lock_guard<std::mutex> lock(variables_mutex_);
+    message.set_sequence(replication_sequence_);
+    __SendReplicationMessage(message);
+  }
+
+  if (!primary_dealer_) return;
+  if (snapshot_command_id_ != 0) {
+    if (now - snapshot_requested_time_ >= 3 * heartbeat_interval) {
+      PROPLINK_LOG_WARNING("No snapshot from primary " << primary_router_endpoint_ << ", retrying");
+      __RequestSnapshot();
+    }
+  } else if (now - last_stream_time_ >= 3 * heartbeat_interval) {
+    PROPLINK_LOG_WARNING("Lost the change stream of primary " << primary_router_endpoint_);
+    // The clients of the forwarded commands time out by themselves.
+    forwarded_commands_.clear();
+    __RequestSnapshot();
+  }
+}
+
+long Server::__GetReplicationPollTimeout() {
+  if (!replication_publisher_ && !primary_dealer_) return -1;
+  const auto now = std::chrono::steady_clock::now();
+  const auto heartbeat_interval = std::chrono::milliseconds(kReplicationHeartbeatMs);
+  std::chrono::steady_clock::time_point next = now + heartbeat_interval;
+  if (replication_publisher_) next = std::min(next, last_replication_heartbeat_ + heartbeat_interval);
+  if (primary_dealer_) {
+    next = std::min(next, (snapshot_command_id_ != 0 ? snapshot_requested_time_ : last_stream_time_) + 
+                          3 * heartbeat_interval);
+  }
+  const auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(next - now).count();
+  return remaining > 0 ? static_cast<long>(remaining) : 0;
+}
+
+void Server::__RequestSnapshot() {
+  {
+    std::lock_guard<std::mutex> lock(replication_status_mutex_);
+    replication_status_.synchronized = false;
+  }
+  stream_buffer_.clear();
+  snapshot_command_id_ = next_primary_command_id_++;
+  snapshot_requested_time_ = std::chrono::steady_clock::now();
+
+  CommandMessage command;
+  command.set_command_id(snapshot_command_id_);
+  command.set_command_type(CommandMessage::REPLICATION_SNAPSHOT);
+  zmq::message_t request(command.ByteSizeLong());
+  command.SerializeToArray(request.data(), request.size());
+  try {
+    // Retried by __ServeReplication() if it can't be sent.
+    if (primary_dealer_->send(zmq::message_t(), ZMQ_SNDMORE | ZMQ_DONTWAIT)) {
+      primary_dealer_->send(request, ZMQ_DONTWAIT);
+    }
+  } catch (const zmq::error_t& e) {
+    PROPLINK_LOG_WARNING("Failed to request snapshot: " << e.what());
+  }
+}
+
+void Server::__HandlePrimaryResponses() {
+  while (true) {
+    zmq::message_t empty;
+    zmq::message_t reply;
+    if (!primary_dealer_->recv(&empty, ZMQ_DONTWAIT)) return;
+    primary_dealer_->recv(&reply);
+
+    ResponseMessage response;
+    if (!response.ParseFromArray(reply.data(), reply.size())) continue;
+    if (response.command_id() == snapshot_command_id_) {
+      __ApplySnapshot(response);
+      continue;
+    }
+    auto it = forwarded_commands_.find(response.command_id());
+    if (it == forwarded_commands_.end()) continue; // Stale snapshot, or a command given up on.
+    response.set_command_id(it->second.second);
+    __SendResponse(it->second.first, response);
+    forwarded_commands_.erase(it);
+  }
+}
+
+void Server::__HandleReplicationStream() {
+  while (true) {
+    zmq::message_t msg;
+    if (!replication_subscriber_->recv(&msg, ZMQ_DONTWAIT)) return;
+    ReplicationMessage message;
+    if (!message.ParseFromArray(msg.data(), msg.size())) continue;
+    last_stream_time_ = std::chrono::steady_clock::now();
+    __ApplyReplicationMessage(message);
+  }
+}
+
+void Server::__ApplySnapshot(const ResponseMessage& response) {
+  snapshot_command_id_ = 0;
+  // Versions restart with a new epoch of the primary, so they can't tell which variables are current.
+  const bool new_epoch = response.server_info().epoch() != primary_epoch_;
+  primary_epoch_ = response.server_info().epoch();
+  applied_sequence_ = response.sequence();
+  last_stream_time_ = std::chrono::steady_clock::now();
+
+  // Values are extracted before locking, so that large values are not copied under the lock.
+  std::vector<std::pair<Value, std::shared_ptr<const std::string>>> values;
+  values.reserve(response.variables_size());
+  for (const auto& variable : response.variables()) {
+    Value value = __ExtractValue(variable);
+    std::shared_ptr<const std::string> large_value = __MakeLargeValue(value);
+    values.emplace_back(std::move(value), std::move(large_value));
+  }
+
+  std::vector<PendingResponse> watch_responses;
+  std::vector<std::string> removed;
+  {
+    std::lock_guard<std::mutex> lock(variables_mutex_);
+    std::unordered_set<std::string> names;
+    for (int i = 0; i < response.variables_size(); i++) {
+      names.insert(response.variables(i).name());
+      __ApplyReplicatedVariable(response.variables(i), std::move(values[i].first), std::move(values[i].second), 
+                                watch_responses, new_epoch);
+    }
+    // Variables the primary no longer has.
+    for (auto it = variables_.begin(); it != variables_.end();) {
+      if (names.count(it->first)) {
+        ++it;
+        continue;
       }
+      __UnbindVariable(it->first, it->second);
+      variable_ids_.erase(it->second.id);
+      ++schema_generation_;
+      removed.push_back(it->first);
+      it = variables_.erase(it);
+      struct_slots_.clear();
+    }
+  }
+  if (!removed.empty()) {
+    std::lock_guard<std::mutex> lock(pending_sets_mutex_);
+    for (const auto& name : removed) {
+      coalesced_variables_.erase(name);
     }
   }
-  else {
-    std::cerr << "Failed to set variable named '" << name << "', it had not registered" << std::endl;
+  for (const auto& pending : watch_responses) {
+    __SendResponse(pending.requester, pending.response);
+  }
+  {
+    std::lock_guard<std::mutex> lock(replication_status_mutex_);
+    replication_status_.synchronized = true;
+    replication_status_.applied_sequence = applied_sequence_;
+    replication_status_.primary_sequence = std::max(replication_status_.primary_sequence, applied_sequence_);
+    replication_status_.lag_ms = 0;
+    replication_status_.snapshots++;
+  }
+  PROPLINK_LOG_INFO("Applied snapshot of primary " << primary_router_endpoint_ << " at sequence " << applied_sequence_);
+
+  // Changes of the previous epoch are older than the snapshot.
+  std::vector<ReplicationMessage> buffered;
+  buffered.swap(stream_buffer_);
+  for (const auto& message : buffered) {
+    if (message.epoch() != primary_epoch_) continue;
+    __ApplyReplicationMessage(message);
+    if (snapshot_command_id_ != 0) break; // A gap requested another snapshot.
+  }
+}
+
+void Server::__ApplyReplicationMessage(const ReplicationMessage& message) {
+  if (snapshot_command_id_ != 0) {
+    stream_buffer_.push_back(message);
     return;
   }
+  const bool is_heartbeat = !message.has_variable();
+  if (message.epoch() != primary_epoch_ || 
+      message.sequence() > applied_sequence_ + (is_heartbeat ? 0 : 1)) {
+    // The primary restarted, or changes were lost.
+    PROPLINK_LOG_INFO("Resynchronizing with primary " << primary_router_endpoint_ << " at sequence " 
+                      << message.sequence() << ", applied " << applied_sequence_);
+    __RequestSnapshot();
+    stream_buffer_.push_back(message);
+    return;
+  }
+
+  const int64_t now_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::system_clock::now().time_since_epoch()).count();
+  if (!is_heartbeat && message.sequence() == applied_sequence_ + 1) {
+    Value value = __ExtractValue(message.variable());
+    std::shared_ptr<const std::string> large_value = __MakeLargeValue(value);
+    std::vector<PendingResponse> watch_responses;
+    {
+      std::lock_guard<std::mutex> lock(variables_mutex_);
+      __ApplyReplicatedVariable(message.variable(), std::move(value), std::move(large_value), watch_responses);
+    }
+    for (const auto& pending : watch_responses) {
+      __SendResponse(pending.requester, pending.response);
+    }
+    applied_sequence_ = message.sequence();
+  }
+
+  std::lock_guard<std::mutex> lock(replication_status_mutex_);
+  replication_status_.applied_sequence = applied_sequence_;
+  replication_status_.primary_sequence = std::max(replication_status_.primary_sequence, message.sequence());
+  if (!is_heartbeat) {
+    replication_status_.lag_ms = std::max<int64_t>(now_ms - static_cast<int64_t>(message.timestamp_ms()), 0);
+  } else if (message.sequence() == applied_sequence_) {
+    replication_status_.lag_ms = 0; // Caught up.
+  }
+}
+
+void Server::__ApplyReplicatedVariable(const VariableMessage& variable, Value value, 
+                                       std::shared_ptr<const std::string> large_value, 
+                                       std::vector<PendingResponse>& responses, 
+                                       const bool force) {
+  const std::string& name = variable.name();
+  auto it = variables_.find(name);
+  if (it == variables_.end()) {
+    it = variables_.emplace(name, PropertyWithCallback()).first;
+    __AssignVariableId(name, it->second);
+    ++schema_generation_;
+    it->second.internal_subscribers = __CountMatchingTopics(internal_topics_, name);
+    it->second.external_subscribers = __CountMatchingTopics(external_topics_, name);
+  } else if (!force && it->second.version == variable.version()) {
+    return; // Already applied, e.g. a snapshot after a lost heartbeat.
+  } else if (it->second.read_only != variable.read_only() || it->second.value.index() != value.index()) {
+    ++schema_generation_;
+  }
+  // Versions are the primary's, so that WATCH_VARIABLES works the same on both.
+  __StoreValue(it->second, std::move(value), std::move(large_value));
+  it->second.read_only = variable.read_only();
+  it->second.version = variable.version();
+  version_ = std::max(version_, variable.version());
+
+  if (running_) __PublishVariable(name, it->second);
+  __CollectWatches(name, responses);
+  __ReplicateVariable(name, it->second);
+}
+
+bool Server::__IsForwardedCommand(const CommandMessage& command) {
+  switch (command.command_type()) {
+    case CommandMessage::SET_VARIABLE:
+    case CommandMessage::EXECUTE_TRIGGER:
+    case CommandMessage::GET_ALL_TRIGGERS:
+    case CommandMessage::ATOMIC_OPERATION:
+    case CommandMessage::TRANSACTION:
+    case CommandMessage::BATCH:
+      return true;
+    default:
+      return false;
+  }
+}
+
+void Server::__ForwardToPrimary(const CommandMessage& command, const Requester& requester) {
+  if (!forward_writes_) {
+    ResponseMessage response;
+    response.set_command_id(command.command_id());
+    __SetStatus(response, ResponseMessage::NOT_ALLOWED, [] { return "Server is a read-only replica"; });
+    __SendResponse(requester, response);
+    return;
+  }
+
+  // Sent with an ID of this server, since the IDs of different clients may collide.
+  const uint64_t primary_command_id = next_primary_command_id_++;
+  CommandMessage forwarded = command;
+  forwarded.set_command_id(primary_command_id);
+  zmq::message_t request(forwarded.ByteSizeLong());
+  forwarded.SerializeToArray(request.data(), request.size());
+  try {
+    if (primary_dealer_->send(zmq::message_t(), ZMQ_SNDMORE | ZMQ_DONTWAIT) && 
+        primary_dealer_->send(request, ZMQ_DONTWAIT)) {
+      forwarded_commands_.emplace(primary_command_id, std::make_pair(requester, command.command_id()));
+      return;
+    }
+  } catch (const zmq::error_t& e) {
+    PROPLINK_LOG_WARNING("Failed to forward command to primary: " << e.what());
+  }
+  ResponseMessage response;
+  response.set_command_id(command.command_id());
+  __SetStatus(response, ResponseMessage::UNAVAILABLE, [] { return "Failed to forward to primary"; });
+  __SendResponse(requester, response);
+}
+
+void Server::__FillVariableMessage(VariableMessage* variable, 
+                                   const std::string& name, 
+                                   const PropertyWithCallback& property,
+                                   const bool full_value) {
+  variable->set_name(name);
+  variable->set_read_only(property.read_only);
+  variable->set_version(property.version);
+  if (!full_value) {
+    __SetPropertyValueToVariableMessage(variable, property);
+  } else if (property.large_value) {
+    variable->set_string_value(*property.large_value);
+  } else {
+    __SetValueToVariableMessage(variable, property.value);
+  }
+}
+
+void Server::__SetPropertyValueToVariableMessage(VariableMessage* variable, const PropertyWithCallback& property) {
+  const std::shared_ptr<const std::string> large_value = __GetLargeValue(property);
+  if (!large_value) {
+    __SetValueToVariableMessage(variable, property.value);
+    return;
+  }
+  LargeValueMessage* reference = variable->mutable_large_value();
+  reference->set_id(property.version);
+  reference->set_size(large_value->size());
+  reference->set_epoch(epoch_);
+}
+
+bool Server::__ReadSlot(const PropertyWithCallback& property, Value& value, 
+                        std::shared_ptr<const std::string>& large_value) {
+  if (property.provider) return false;
+  if (property.large_value) {
+    large_value = property.large_value;
+  } else {
+    value = property.reader ? property.reader() : property.value;
+  }
+  return true;
+}
+
+std::shared_ptr<const std::string> Server::__GetLargeValue(const PropertyWithCallback& property) {
+  if (!property.large_value) return nullptr;
+
+  const auto now = std::chrono::steady_clock::now();
+  std::lock_guard<std::mutex> lock(large_values_mutex_);
+  auto it = large_values_.find(property.version);
+  if (it == large_values_.end()) {
+    for (auto expired = large_values_.begin(); expired != large_values_.end();) {
+      expired = expired->second.expiry < now ? large_values_.erase(expired) : std::next(expired);
+    }
+    it = large_values_.emplace(property.version, LargeValueEntry()).first;
+  }
+  // Readable for a while after the last reference was handed out, even if the value changes meanwhile.
+  // Transfers share the storage, and keep it alive while they reference it.
+  it->second.data = property.large_value;
+  it->second.expiry = now + std::chrono::milliseconds(kLargeValueRetentionMs);
+  return property.large_value;
+}
+
+std::shared_ptr<const std::string> Server::__MakeLargeValue(Value& value) const {
+  std::string* string_value = std::get_if<std::string>(&value);
+  if (!string_value || !__IsLargeValue(*string_value)) return nullptr;
+  auto large_value = std::make_shared<const std::string>(std::move(*string_value));
+  value = std::string();
+  return large_value;
+}
+
+void Server::__StoreValue(PropertyWithCallback& property, Value value, 
+                          std::shared_ptr<const std::string> large_value) {
+  property.value = std::move(value);
+  property.large_value = std::move(large_value);
+}
+
+bool Server::__HasValue(const PropertyWithCallback& property, const Value& value, 
+                        const std::shared_ptr<const std::string>& large_value) {
+  if (property.large_value || large_value) {
+    // A large value never equals a small one. Compares the sizes first.
+    return property.large_value && large_value && *property.large_value == *large_value;
+  }
+  return property.value == value;
+}
+
+void Server::__HandleBulkRequest() {
+  zmq::message_t identity;
+  zmq::message_t empty;
+  zmq::message_t request;
+  bulk_router_->recv(&identity);
+  bulk_router_->recv(&empty);
+  bulk_router_->recv(&request);
+
+  CommandMessage command;
+  command.ParseFromArray(request.data(), request.size());
+  ResponseMessage response;
+  response.set_command_id(command.command_id());
+
+  std::shared_ptr<const std::string> data;
+  if (command.command_type() != CommandMessage::READ_LARGE_VALUE) {
+    __SetStatus(response, ResponseMessage::UNKNOWN_COMMAND, [] { return "Only READ_LARGE_VALUE is served on the bulk channel"; });
+  } else {
+    std::lock_guard<std::mutex> lock(large_values_mutex_);
+    auto it = large_values_.find(command.large_value().id());
+    if (it != large_values_.end() && command.large_value().epoch() == epoch_) data = it->second.data;
+    if (!data) {
+      __SetStatus(response, ResponseMessage::NOT_FOUND, [&] { 
+        return "Large value expired: " + std::to_string(command.large_value().id()); 
+      });
+    }
+  }
+
+  size_t offset = 0;
+  size_t length = 0;
+  if (data) {
+    response.set_success(true);
+    offset = std::min<size_t>(command.offset(), data->size());
+    length = std::min<size_t>({ static_cast<size_t>(command.length()), static_cast<size_t>(kMaxLargeValueChunkSize), 
+                                data->size() - offset });
+  }
+
+  zmq::message_t reply(response.ByteSizeLong());
+  response.SerializeToArray(reply.data(), reply.size());
+  zmq::message_t chunk;
+  if (length > 0) {
+    // The frame points into the storage, which the reference in the hint keeps alive until ZeroMQ sent it.
+    auto* hint = new std::shared_ptr<const std::string>(data);
+    chunk = zmq::message_t(const_cast<char*>(data->data()) + offset, length, 
+                           [](void*, void* hint) { delete static_cast<std::shared_ptr<const std::string>*>(hint); }, 
+                           hint);
+  }
+  bulk_router_->send(identity, ZMQ_SNDMORE);
+  bulk_router_->send(empty, ZMQ_SNDMORE);
+  bulk_router_->send(reply, ZMQ_SNDMORE);
+  bulk_router_->send(chunk);
+}
+
+void Server::__SetValueToVariableMessage(VariableMessage* variable, const Value& value) {
+  if (std::holds_alternative<double>(value)) {
+    variable->set_double_value(std::get<double>(value));
+  } else if (std::holds_alternative<int>(value)) {
+    variable->set_int_value(std::get<int>(value));
+  } else if (std::holds_alternative<bool>(value)) {
+    variable->set_bool_value(std::get<bool>(value));
+  } else {
+    variable->set_string_value(std::get<std::string>(value));
+  }
 }
 
 void Server::__CleanupSockets() {
@@ -179,6 +1020,10 @@ void Server::__CleanupSockets() {
   if (external_router_) external_router_->close();
   if (external_publisher_) external_publisher_->close();
   if (inproc_socket_) inproc_socket_->close();
+  if (replication_publisher_) replication_publisher_->close();
+  if (primary_dealer_) primary_dealer_->close();
+  if (replication_subscriber_) replication_subscriber_->close();
+  if (bulk_router_) bulk_router_->close();
 }
 
 void Server::__WorkerLoop() {
@@ -196,12 +1041,53 @@ void Server::__WorkerLoop() {
       EXTERNAL_ROUTER_INDEX = items.size() - 1;
     }
 
+    // publisher sockets, which receive subscriptions of clients
+    items.push_back({ static_cast<void*>(*internal_publisher_), 0, ZMQ_POLLIN, 0 });
+    const size_t INTERNAL_PUBLISHER_INDEX = items.size() - 1;
+
+    size_t EXTERNAL_PUBLISHER_INDEX = 0;
+    if (has_external_endpoints_) {
+      items.push_back({ static_cast<void*>(*external_publisher_), 0, ZMQ_POLLIN, 0 });
+      EXTERNAL_PUBLISHER_INDEX = items.size() - 1;
+    }
+
+    // sockets to the primary, if this server is a replica
+    size_t PRIMARY_DEALER_INDEX = 0;
+    size_t REPLICATION_SUBSCRIBER_INDEX = 0;
+    if (primary_dealer_) {
+      items.push_back({ static_cast<void*>(*primary_dealer_), 0, ZMQ_POLLIN, 0 });
+      PRIMARY_DEALER_INDEX = items.size() - 1;
+      items.push_back({ static_cast<void*>(*replication_subscriber_), 0, ZMQ_POLLIN, 0 });
+      REPLICATION_SUBSCRIBER_INDEX = items.size() - 1;
+    }
+
+    // bulk channel
+    size_t BULK_ROUTER_INDEX = 0;
+    if (bulk_router_) {
+      items.push_back({ static_cast<void*>(*bulk_router_), 0, ZMQ_POLLIN, 0 });
+      BULK_ROUTER_INDEX = items.size() - 1;
+    }
+
     // control socket
     items.push_back({ static_cast<void*>(*inproc_socket_), 0, ZMQ_POLLIN, 0 });
     const size_t CONTROL_SOCKET_INDEX = items.size() - 1;
 
     while (running_) {
-      zmq::poll(items.data(), items.size(), -1);
+      long timeout = __GetWatchPollTimeout();
+      const long replication_timeout = __GetReplicationPollTimeout();
+      if (replication_timeout >= 0) timeout = timeout < 0 ? replication_timeout : std::min(timeout, replication_timeout);
+      zmq::poll(items.data(), items.size(), timeout);
+      __ExpireWatches();
+      __ServeReplication();
+
+      // Checks the primary of a replica
+      if (primary_dealer_ && (items[PRIMARY_DEALER_INDEX].revents & ZMQ_POLLIN)) {
+        __HandlePrimaryResponses();
+      }
+
+      if (primary_dealer_ && (items[REPLICATION_SUBSCRIBER_INDEX].revents & ZMQ_POLLIN)) {
+        __HandleReplicationStream();
+      }
 
       // Checks req/res sockets
       if (items[INTERNAL_ROUTER_INDEX].revents & ZMQ_POLLIN) {
@@ -212,6 +1098,21 @@ void Server::__WorkerLoop() {
         __HandleRouterMessage(external_router_.get());
       }
 
+      if (bulk_router_ && (items[BULK_ROUTER_INDEX].revents & ZMQ_POLLIN)) {
+        __HandleBulkRequest();
+      }
+
+      // Checks subscriptions
+      if (items[INTERNAL_PUBLISHER_INDEX].revents & ZMQ_POLLIN) {
+        __HandleSubscription(internal_publisher_.get(), internal_topics_, 
+                             &PropertyWithCallback::internal_subscribers);
+      }
+
+      if (has_external_endpoints_ && (items[EXTERNAL_PUBLISHER_INDEX].revents & ZMQ_POLLIN)) {
+        __HandleSubscription(external_publisher_.get(), external_topics_, 
+                             &PropertyWithCallback::external_subscribers);
+      }
+
       // Checks control sockets
       if (items[CONTROL_SOCKET_INDEX].revents & ZMQ_POLLIN) {
         zmq::message_t msg;
@@ -219,48 +1120,409 @@ void Server::__WorkerLoop() {
         break;
       }
     }
-  } catch (const zmq::error_t& e) {
-    std::cerr << "ZeroMQ error in Start(): " << e.what() << " (errno: " << e.num() << ")" << std::endl;
-  } catch (const std::exception& e) {
-    std::cerr << "Exception in Start(): " << e.what() << std::endl;
+  } catch (const zmq::error_t& e) {
+    PROPLINK_LOG_ERROR("ZeroMQ error in Start(): " << e.what() << " (errno: " << e.num() << ")");
+  } catch (const std::exception& e) {
+    PROPLINK_LOG_ERROR("Exception in Start(): " << e.what());
+  }
+}
+
+void Server::__HandleSubscription(zmq::socket_t* publisher, 
+                                  std::unordered_set<std::string>& topics, 
+                                  size_t PropertyWithCallback::*subscribers) {
+  // The publisher is also used by SetVariable() under variables_mutex_.
+  std::lock_guard<std::mutex> lock(variables_mutex_);
+
+  zmq::message_t msg;
+  publisher->recv(&msg);
+  if (msg.size() == 0) return;
+
+  // The first byte is 1 for subscription and 0 for unsubscription, followed by the topic.
+  // XPUB delivers only the first subscription and the last unsubscription of each topic.
+  const char* data = static_cast<const char*>(msg.data());
+  const bool subscribe = data[0] == 1;
+  std::string topic(data + 1, msg.size() - 1);
+
+  if (subscribe) {
+    if (!topics.insert(topic).second) return;
+  } else {
+    if (topics.erase(topic) == 0) return;
+  }
+
+  for (auto& p : variables_) {
+    if (p.first.compare(0, topic.size(), topic) != 0) continue;
+    size_t& count = p.second.*subscribers;
+    if (subscribe) {
+      ++count;
+    } else if (count > 0) {
+      --count;
+    }
+  }
+}
+
+size_t Server::__CountMatchingTopics(const std::unordered_set<std::string>& topics, 
+                                     const std::string& name) {
+  size_t count = 0;
+  for (const auto& topic : topics) {
+    if (name.compare(0, topic.size(), topic) == 0) ++count;
+  }
+  return count;
+}
+
+void Server::__HandleRouterMessage(zmq::socket_t* router_socket) {
+  zmq::message_t identity;
+  zmq::message_t empty;
+  zmq::message_t request;
+  
+  router_socket->recv(&identity);
+  router_socket->recv(&empty);
+  router_socket->recv(&request);
+
+  CommandMessage command;
+  command.ParseFromArray(request.data(), request.size());
+  {
+    std::unique_lock<std::mutex> lock(variables_mutex_, std::defer_lock);
+    __ResolveVariableIds(command, lock);
+  }
+  
+  // zmq::message_t cannot be copied, so copy its data.
+  Requester requester;
+  requester.router_socket = router_socket;
+  requester.identity.assign(static_cast<char*>(identity.data()), 
+                            static_cast<char*>(identity.data()) + identity.size());
+  requester.empty.assign(static_cast<char*>(empty.data()), 
+                         static_cast<char*>(empty.data()) + empty.size());
+
+  // HELLO is answered right away, so that the handshake doesn't wait behind queued commands.
+  if (command.command_type() == CommandMessage::HELLO) {
+    __HandleHello(command, requester);
+    return;
+  }
+
+  // A replica serves reads from its copy, and leaves writes and triggers to the primary.
+  if (primary_dealer_ && __IsForwardedCommand(command)) {
+    __ForwardToPrimary(command, requester);
+    return;
+  }
+
+  // Watches are parked rather than occupying a worker of the thread pool.
+  if (command.command_type() == CommandMessage::WATCH_VARIABLES) {
+    __HandleWatchVariables(command, requester);
+    return;
+  }
+
+  // SETs of a coalesced variable collapse into the newest one while they wait in the queue.
+  if (command.command_type() == CommandMessage::SET_VARIABLE && command.has_variable()) {
+    bool coalesce;
+    {
+      std::lock_guard<std::mutex> lock(pending_sets_mutex_);
+      coalesce = coalesced_variables_.count(command.variable().name()) > 0;
+    }
+    if (coalesce) {
+      __EnqueueCoalescedSet(command, requester);
+      return;
+    }
+  }
+
+  // Identical reads share one evaluation while they wait in the queue of the thread pool.
+  if (__IsCoalescibleRead(command)) {
+    __EnqueueCoalescedRead(command, requester);
+    return;
+  }
+
+  thread_pool_.Enqueue([this, command, requester]() {
+    ResponseMessage response = this->__HandleCommand(command);
+    this->__SendResponse(requester, response);
+  });
+}
+
+void Server::__HandleHello(const CommandMessage& command, const Requester& requester) {
+  ResponseMessage response;
+  response.set_command_id(command.command_id());
+  response.set_success(true);
+  ServerInfoMessage* info = response.mutable_server_info();
+  info->set_server_id(server_id_);
+  info->set_epoch(epoch_);
+  info->set_protocol_version(PROPLINK_PROTOCOL_VERSION);
+  for (const char* capability : { "WATCH_VARIABLES", "ATOMIC_OPERATION", "TRANSACTION", "BATCH", 
+                                  "TRIGGER_ARGUMENTS", "STATUS_CODES" }) {
+    info->add_capabilities(capability);
+  }
+  info->add_capabilities("DESCRIBE");
+  if (bulk_router_) info->add_capabilities("BULK");
+  if (replication_publisher_) info->add_capabilities("REPLICATION");
+  if (primary_dealer_) info->add_capabilities("REPLICA");
+  {
+    std::lock_guard<std::mutex> lock(variables_mutex_);
+    info->set_schema_hash(__GetSchemaHash());
+  }
+  __SendResponse(requester, response);
+}
+
+void Server::__EnqueueCoalescedSet(const CommandMessage& command, const Requester& requester) {
+  const std::string name = command.variable().name();
+  PendingSet superseded;
+  bool has_superseded = false;
+  {
+    std::lock_guard<std::mutex> lock(pending_sets_mutex_);
+    auto it = pending_sets_.find(name);
+    if (it != pending_sets_.end()) {
+      // A task for this variable is already queued, and it will take this command instead.
+      superseded = std::move(it->second);
+      has_superseded = true;
+      it->second = PendingSet{ command, requester };
+    } else {
+      pending_sets_.emplace(name, PendingSet{ command, requester });
+      thread_pool_.Enqueue([this, name]() {
+        PendingSet pending;
+        {
+          std::lock_guard<std::mutex> lock(this->pending_sets_mutex_);
+          auto it = this->pending_sets_.find(name);
+          if (it == this->pending_sets_.end()) return;
+          pending = std::move(it->second);
+          this->pending_sets_.erase(it);
+        }
+        ResponseMessage response = this->__HandleCommand(pending.command);
+        this->__SendResponse(pending.requester, response);
+      });
+    }
+  }
+
+  if (has_superseded) {
+    ResponseMessage response;
+    response.set_command_id(superseded.command.command_id());
+    __SetStatus(response, ResponseMessage::SUPERSEDED, [&] { return "Variable update superseded: " + name; });
+    __SendResponse(superseded.requester, response);
+  }
+}
+
+bool Server::__IsCoalescibleRead(const CommandMessage& command) {
+  switch (command.command_type()) {
+    case CommandMessage::GET_VARIABLE:
+    case CommandMessage::GET_ALL_VARIABLES:
+    case CommandMessage::GET_ALL_TRIGGERS:
+    case CommandMessage::GET_VARIABLES:
+      return true;
+    default:
+      return false;
+  }
+}
+
+void Server::__EnqueueCoalescedRead(const CommandMessage& command, const Requester& requester) {
+  // Commands are identical if they are equal except for command_id.
+  CommandMessage key_command = command;
+  key_command.clear_command_id();
+  std::string key = key_command.SerializeAsString();
+
+  std::shared_ptr<ReadFlight> flight;
+  {
+    std::lock_guard<std::mutex> lock(read_flights_mutex_);
+    auto it = read_flights_.find(key);
+    if (it != read_flights_.end()) {
+      it->second->requesters.emplace_back(requester, command.command_id());
+      return;
+    }
+    flight = std::make_shared<ReadFlight>();
+    flight->command = std::move(key_command);
+    flight->requesters.emplace_back(requester, command.command_id());
+    read_flights_.emplace(key, flight);
+  }
+
+  thread_pool_.Enqueue([this, key, flight]() {
+    // Closes the window, so the requests arriving from now on get a fresh evaluation.
+    {
+      std::lock_guard<std::mutex> lock(this->read_flights_mutex_);
+      this->read_flights_.erase(key);
+    }
+
+    // The response is serialized once without command_id. Since concatenated protobuf messages 
+    // are parsed as one merged message, each requester gets its own command_id prepended.
+    ResponseMessage response = this->__HandleCommand(flight->command);
+    const std::string body = response.SerializeAsString();
+    for (const auto& p : flight->requesters) {
+      this->__SendResponse(p.first, p.second, body);
+    }
+  });
+}
+
+void Server::__SendResponse(const Requester& requester, const ResponseMessage& response) {
+  zmq::message_t reply(response.ByteSizeLong());
+  response.SerializeToArray(reply.data(), reply.size());
+  
+  zmq::message_t identity_msg(requester.identity.size());
+  memcpy(identity_msg.data(), requester.identity.data(), requester.identity.size());
+  
+  zmq::message_t empty_msg(requester.empty.size());
+  memcpy(empty_msg.data(), requester.empty.data(), requester.empty.size());
+  
+  std::lock_guard<std::mutex> lock(router_mutex_);
+  requester.router_socket->send(identity_msg, ZMQ_SNDMORE);
+  requester.router_socket->send(empty_msg, ZMQ_SNDMORE);
+  requester.router_socket->send(reply);
+}
+
+void Server::__SendResponse(const Requester& requester, 
+                            const uint64_t command_id, 
+                            const std::string& serialized_response) {
+  ResponseMessage header;
+  header.set_command_id(command_id);
+  const size_t header_size = header.ByteSizeLong();
+
+  zmq::message_t reply(header_size + serialized_response.size());
+  header.SerializeToArray(reply.data(), static_cast<int>(header_size));
+  memcpy(static_cast<char*>(reply.data()) + header_size, 
+         serialized_response.data(), serialized_response.size());
+  
+  zmq::message_t identity_msg(requester.identity.size());
+  memcpy(identity_msg.data(), requester.identity.data(), requester.identity.size());
+  
+  zmq::message_t empty_msg(requester.empty.size());
+  memcpy(empty_msg.data(), requester.empty.data(), requester.empty.size());
+  
+  std::lock_guard<std::mutex> lock(router_mutex_);
+  requester.router_socket->send(identity_msg, ZMQ_SNDMORE);
+  requester.router_socket->send(empty_msg, ZMQ_SNDMORE);
+  requester.router_socket->send(reply);
+}
+
+void Server::__HandleWatchVariables(const CommandMessage& command, const Requester& requester) {
+  ResponseMessage response;
+  response.set_command_id(command.command_id());
+
+  if (command.variable_names_size() == 0) {
+    __SetStatus(response, ResponseMessage::NOT_SPECIFIED, [] { return "Variables to watch not specified"; });
+    __SendResponse(requester, response);
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(variables_mutex_);
+    for (const auto& name : command.variable_names()) {
+      auto it = variables_.find(name);
+      if (it == variables_.end()) {
+        response.clear_variables();
+        __SetStatus(response, ResponseMessage::NOT_FOUND, [&] { return "Variable not found: " + name; });
+        break;
+      }
+      if (it->second.version > command.since_version()) {
+        __FillVariableMessage(response.add_variables(), name, it->second);
+      }
+    }
+
+    if (response.status() == ResponseMessage::OK && response.variables_size() == 0) {
+      // Nothing changed yet, so park the watch until a watched variable changes or it times out.
+      // watches_mutex_ is taken while variables_mutex_ is held so that no change is missed.
+      auto watch = std::make_shared<Watch>();
+      watch->requester = requester;
+      watch->command_id = command.command_id();
+      watch->since_version = command.since_version();
+      watch->names.assign(command.variable_names().begin(), command.variable_names().end());
+
+      std::lock_guard<std::mutex> watches_lock(watches_mutex_);
+      size_t& parked = watches_per_requester_[{ requester.router_socket, requester.identity }];
+      if (parked >= kMaxWatchesPerRequester) {
+        __SetStatus(response, ResponseMessage::NOT_ALLOWED, [] { return "Too many parked watches"; });
+        __SendResponse(requester, response);
+        return;
+      }
+      parked++;
+      for (const auto& name : watch->names) {
+        watches_by_name_[name].push_back(watch);
+      }
+      if (command.timeout_ms() > 0) {
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(command.timeout_ms());
+        watch->deadline = watch_deadlines_.emplace(deadline, watch);
+        watch->has_deadline = true;
+      }
+      return;
+    }
+
+    if (response.status() == ResponseMessage::OK) {
+      response.set_success(true);
+      response.set_version(version_);
+    }
+  }
+  __SendResponse(requester, response);
+}
+
+void Server::__CollectWatches(const std::string& name, std::vector<PendingResponse>& responses) {
+  std::lock_guard<std::mutex> watches_lock(watches_mutex_);
+  auto watched = watches_by_name_.find(name);
+  if (watched == watches_by_name_.end()) return;
+
+  // Moves out the list first, since __RemoveWatch() modifies watches_by_name_.
+  std::vector<std::shared_ptr<Watch>> watches = std::move(watched->second);
+  watches_by_name_.erase(watched);
+
+  for (const auto& watch : watches) {
+    PendingResponse pending;
+    pending.requester = watch->requester;
+    pending.response.set_command_id(watch->command_id);
+    pending.response.set_success(true);
+    pending.response.set_version(version_);
+    for (const auto& watched_name : watch->names) {
+      auto it = variables_.find(watched_name);
+      if (it != variables_.end() && it->second.version > watch->since_version) {
+        __FillVariableMessage(pending.response.add_variables(), watched_name, it->second);
+      }
+    }
+    responses.push_back(std::move(pending));
+    __RemoveWatch(watch);
   }
 }
 
-void Server::__HandleRouterMessage(zmq::socket_t* router_socket) {
-  zmq::message_t identity;
-  zmq::message_t empty;
-  zmq::message_t request;
-  
-  router_socket->recv(&identity);
-  router_socket->recv(&empty);
-  router_socket->recv(&request);
+void Server::__RemoveWatch(const std::shared_ptr<Watch>& watch) {
+  for (const auto& name : watch->names) {
+    auto watched = watches_by_name_.find(name);
+    if (watched == watches_by_name_.end()) continue;
+    auto& list = watched->second;
+    list.erase(std::remove(list.begin(), list.end(), watch), list.end());
+    if (list.empty()) watches_by_name_.erase(watched);
+  }
+  if (watch->has_deadline) {
+    watch_deadlines_.erase(watch->deadline);
+    watch->has_deadline = false;
+  }
+  auto parked = watches_per_requester_.find({ watch->requester.router_socket, watch->requester.identity });
+  if (parked != watches_per_requester_.end() && --parked->second == 0) watches_per_requester_.erase(parked);
+}
 
-  CommandMessage command;
-  command.ParseFromArray(request.data(), request.size());
-  
-  // zmq::message_t cannot be copied, so copy its data.
-  std::vector<char> identity_data(static_cast<char*>(identity.data()), 
-                                static_cast<char*>(identity.data()) + identity.size());
-  std::vector<char> empty_data(static_cast<char*>(empty.data()), 
-                              static_cast<char*>(empty.data()) + empty.size());
+void Server::__ExpireWatches() {
+  {
+    std::lock_guard<std::mutex> watches_lock(watches_mutex_);
+    if (watch_deadlines_.empty() || 
+        watch_deadlines_.begin()->first > std::chrono::steady_clock::now()) {
+      return;
+    }
+  }
 
-  thread_pool_.Enqueue([this, command, identity_data, empty_data, router_socket]() {
-    ResponseMessage response = this->__HandleCommand(command);
-    
-    zmq::message_t reply(response.ByteSizeLong());
-    response.SerializeToArray(reply.data(), reply.size());
-    
-    zmq::message_t identity_msg(identity_data.size());
-    memcpy(identity_msg.data(), identity_data.data(), identity_data.size());
-    
-    zmq::message_t empty_msg(empty_data.size());
-    memcpy(empty_msg.data(), empty_data.data(), empty_data.size());
-    
-    std::lock_guard<std::mutex> lock(this->router_mutex_);
-    router_socket->send(identity_msg, ZMQ_SNDMORE);
-    router_socket->send(empty_msg, ZMQ_SNDMORE);
-    router_socket->send(reply);
-  });
+  std::vector<PendingResponse> responses;
+  {
+    std::lock_guard<std::mutex> lock(variables_mutex_);
+    std::lock_guard<std::mutex> watches_lock(watches_mutex_);
+    const auto now = std::chrono::steady_clock::now();
+    while (!watch_deadlines_.empty() && watch_deadlines_.begin()->first <= now) {
+      std::shared_ptr<Watch> watch = watch_deadlines_.begin()->second;
+      PendingResponse pending;
+      pending.requester = watch->requester;
+      pending.response.set_command_id(watch->command_id);
+      __SetStatus(pending.response, ResponseMessage::EXPIRED, [] { return "Watch timed out"; });
+      pending.response.set_version(version_);
+      responses.push_back(std::move(pending));
+      __RemoveWatch(watch);
+    }
+  }
+  for (const auto& pending : responses) {
+    __SendResponse(pending.requester, pending.response);
+  }
+}
+
+long Server::__GetWatchPollTimeout() {
+  std::lock_guard<std::mutex> watches_lock(watches_mutex_);
+  if (watch_deadlines_.empty()) return -1;
+  auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+      watch_deadlines_.begin()->first - std::chrono::steady_clock::now()).count();
+  return remaining > 0 ? static_cast<long>(remaining) : 0;
 }
 
 ResponseMessage Server::__HandleCommand(const CommandMessage& command) {
@@ -277,16 +1539,33 @@ ResponseMessage Server::__HandleCommand(const CommandMessage& command) {
     case CommandMessage::GET_ALL_VARIABLES:
       __HandleGetAllVariables(command, response);
       break;
+    case CommandMessage::DESCRIBE:
+      __HandleDescribe(command, response);
+      break;
+    case CommandMessage::GET_VARIABLES:
+      __HandleGetVariables(command, response);
+      break;
     case CommandMessage::GET_ALL_TRIGGERS:
       __HandleGetAllTriggers(command, response);
       break;
     case CommandMessage::EXECUTE_TRIGGER:
       __HandleExecuteTrigger(command, response);
       break;
+    case CommandMessage::ATOMIC_OPERATION:
+      __HandleAtomicOperation(command, response);
+      break;
+    case CommandMessage::TRANSACTION:
+      __HandleTransaction(command, response);
+      break;
+    case CommandMessage::BATCH:
+      __HandleBatch(command, response);
+      break;
+    case CommandMessage::REPLICATION_SNAPSHOT:
+      __HandleReplicationSnapshot(command, response);
+      break;
     
     default:
-      response.set_success(false);
-      response.set_error_message("Unknown command type");
+      __SetStatus(response, ResponseMessage::UNKNOWN_COMMAND, [] { return "Unknown command type"; });
       break;
   }
   
@@ -295,160 +1574,737 @@ ResponseMessage Server::__HandleCommand(const CommandMessage& command) {
 
 void Server::__HandleGetVariable(const CommandMessage& command, ResponseMessage& response) {
   std::string prop_name = command.variable_name();
+  __RefreshProvidedVariable(prop_name);
   std::lock_guard<std::mutex> lock(variables_mutex_);
   auto it = variables_.find(prop_name);
   
   if (it != variables_.end()) {
     response.set_success(true);
-
-    VariableMessage* prop = response.mutable_variable();
-    prop->set_name(prop_name);
-    prop->set_read_only(it->second.read_only);
-    const Value& value = it->second.value;
-    if (std::holds_alternative<double>(value)) {
-      prop->set_double_value(std::get<double>(value));
-    } else if (std::holds_alternative<int>(value)) {
-      prop->set_int_value(std::get<int>(value));
-    } else if (std::holds_alternative<bool>(value)) {
-      prop->set_bool_value(std::get<bool>(value));
-    } else {
-      prop->set_string_value(std::get<std::string>(value));
-    }
+    __FillVariableMessage(response.mutable_variable(), prop_name, it->second);
+    // The memory is newer than the last sample.
+    if (it->second.reader) __SetValueToVariableMessage(response.mutable_variable(), it->second.reader());
   } else {
-    response.set_success(false);
-    response.set_error_message("Variable not found: " + prop_name);
+    __SetStatus(response, ResponseMessage::NOT_FOUND, [&] { return "Variable not found: " + prop_name; });
   }
 }
 
 void Server::__HandleSetVariable(const CommandMessage& command, ResponseMessage& response) {
   if (!command.has_variable()) {
-    response.set_success(false);
-    response.set_error_message("Variable not specified");
+    __SetStatus(response, ResponseMessage::NOT_SPECIFIED, [] { return "Variable not specified"; });
     return;
   }
   
   const VariableMessage& prop = command.variable();
   std::string prop_name = prop.name();
+  // A large value is copied from the command before locking, and only swapped in under the lock.
+  std::shared_ptr<const std::string> large_value;
+  if (prop.value_case() == VariableMessage::kStringValue && __IsLargeValue(prop.string_value())) {
+    large_value = std::make_shared<const std::string>(prop.string_value());
+  }
   Value value_cpy;
+  std::shared_ptr<const std::string> large_value_cpy;
   bool changed = false;
   VariableChangedCallback callback;
+  std::vector<PendingResponse> watch_responses;
   {
     std::lock_guard<std::mutex> lock(variables_mutex_);
     auto it = variables_.find(prop_name);
     
     if (it == variables_.end()) {
-      response.set_success(false);
-      response.set_error_message("Variable not found: " + prop_name);
+      __SetStatus(response, ResponseMessage::NOT_FOUND, [&] { return "Variable not found: " + prop_name; });
       return;
     }
     
     if (it->second.read_only) {
-      response.set_success(false);
-      response.set_error_message("Variable " + prop_name + " is READ ONLY");
+      __SetStatus(response, ResponseMessage::READ_ONLY, [&] { return "Variable " + prop_name + " is READ ONLY"; });
+      return;
+    }
+
+    PropertyWithCallback& property = it->second;
+    callback = property.callback;
+
+    if (large_value) {
+      if (!std::holds_alternative<std::string>(property.value)) {
+        __SetStatus(response, ResponseMessage::TYPE_MISMATCH, [&] { 
+          return "Type mismatch: Variable '" + prop_name + "' is not string, but received string value"; 
+        });
+        return;
+      }
+      changed = !__HasValue(property, std::string(), large_value);
+      if (changed) __StoreValue(property, std::string(), large_value);
+    } else {
+      std::string error_message;
+      const ResponseMessage::StatusCode status = 
+          __AssignValue(prop_name, prop, property.value, changed, verbose_responses_ ? &error_message : nullptr);
+      if (status != ResponseMessage::OK) {
+        __SetStatus(response, status, [&] { return error_message; });
+        return;
+      }
+      if (property.large_value) {
+        // A small value replaced the large one, whatever it compared to the empty string.
+        property.large_value = nullptr;
+        changed = true;
+      }
+    }
+
+    value_cpy = property.value;
+    large_value_cpy = property.large_value;
+    if (changed) {
+      it->second.version = ++version_;
+      __CollectWatches(prop_name, watch_responses);
+      __ReplicateVariable(prop_name, it->second);
+    }
+  }
+
+  for (const auto& pending : watch_responses) {
+    __SendResponse(pending.requester, pending.response);
+  }
+
+  if (changed && callback && 
+      !__InvokeVariableCallback(callback, __LoadValue(value_cpy, large_value_cpy), response)) {
+    return;
+  }
+
+  __SetStatus(response, ResponseMessage::OK, [&] { return "Variable updated: " + prop_name; });
+}
+
+void Server::__HandleAtomicOperation(const CommandMessage& command, ResponseMessage& response) {
+  if (!command.has_atomic_operation() || !command.atomic_operation().has_operand()) {
+    __SetStatus(response, ResponseMessage::NOT_SPECIFIED, [] { return "Atomic operation not specified"; });
+    return;
+  }
+
+  const AtomicOperationMessage& operation = command.atomic_operation();
+  const std::string& prop_name = operation.operand().name();
+  Value value_cpy;
+  std::shared_ptr<const std::string> large_value_cpy;
+  bool changed = false;
+  VariableChangedCallback callback;
+  std::vector<PendingResponse> watch_responses;
+  // A large value is copied and operated on outside the lock, then committed only if the variable
+  // is still at the version of the copy. Otherwise the operation is applied again to the new value.
+  std::shared_ptr<const std::string> snapshot;
+  uint64_t snapshot_version = 0;
+  Value snapshot_value;
+  bool snapshot_changed = false;
+  ResponseMessage::StatusCode snapshot_status = ResponseMessage::OK;
+  std::string error_message;
+  for (;;) {
+    if (snapshot) {
+      snapshot_value = *snapshot;
+      snapshot_changed = false;
+      snapshot_status = __ApplyAtomicOperation(prop_name, operation, snapshot_value, snapshot_version, 
+                                               snapshot_changed, verbose_responses_ ? &error_message : nullptr);
+    }
+
+    std::lock_guard<std::mutex> lock(variables_mutex_);
+    auto it = variables_.find(prop_name);
+
+    if (it == variables_.end()) {
+      __SetStatus(response, ResponseMessage::NOT_FOUND, [&] { return "Variable not found: " + prop_name; });
+      return;
+    }
+
+    if (it->second.read_only) {
+      __SetStatus(response, ResponseMessage::READ_ONLY, [&] { return "Variable " + prop_name + " is READ ONLY"; });
       return;
     }
 
-    Value& value = it->second.value;
+    if (it->second.large_value && 
+        (it->second.large_value != snapshot || it->second.version != snapshot_version)) {
+      snapshot = it->second.large_value;
+      snapshot_version = it->second.version;
+      continue;
+    }
+
     callback = it->second.callback;
-    if (callback) value_cpy = it->second.value;
 
-    if (std::holds_alternative<double>(value)) {
-      if (prop.value_case() == VariableMessage::kDoubleValue) {
-        double new_value = prop.double_value();
-        if (std::get<double>(value) != new_value) {
-          value = new_value;
-          changed = true;
-        }
+    ResponseMessage::StatusCode status;
+    if (it->second.large_value) {
+      status = snapshot_status;
+      changed = snapshot_changed;
+      if (changed) {
+        std::shared_ptr<const std::string> large_value = __MakeLargeValue(snapshot_value);
+        __StoreValue(it->second, std::move(snapshot_value), std::move(large_value));
+      }
+    } else {
+      error_message.clear();
+      status = __ApplyAtomicOperation(prop_name, operation, it->second.value, it->second.version, 
+                                      changed, verbose_responses_ ? &error_message : nullptr);
+      it->second.large_value = __MakeLargeValue(it->second.value);
+    }
+    if (changed) {
+      it->second.version = ++version_;
+      __CollectWatches(prop_name, watch_responses);
+      __ReplicateVariable(prop_name, it->second);
+    }
+    value_cpy = it->second.value;
+    large_value_cpy = it->second.large_value;
+
+    // The resulting (or, on failure, current) value is returned so that the client needs no extra GET.
+    __FillVariableMessage(response.mutable_variable(), prop_name, it->second);
+    if (status != ResponseMessage::OK) {
+      __SetStatus(response, status, [&] { return error_message; });
+      return;
+    }
+    break;
+  }
+
+  for (const auto& pending : watch_responses) {
+    __SendResponse(pending.requester, pending.response);
+  }
+
+  if (changed && callback && 
+      !__InvokeVariableCallback(callback, __LoadValue(value_cpy, large_value_cpy), response)) {
+    return;
+  }
+
+  __SetStatus(response, ResponseMessage::OK, [&] { return "Variable updated: " + prop_name; });
+}
+
+void Server::__HandleTransaction(const CommandMessage& command, ResponseMessage& response) {
+  if (command.operations_size() == 0) {
+    __SetStatus(response, ResponseMessage::NOT_SPECIFIED, [] { return "Operations not specified"; });
+    return;
+  }
+
+  const int operation_count = command.operations_size();
+  for (const auto& operation : command.operations()) {
+    response.add_results()->set_command_id(operation.command_id());
+  }
+
+  // Marks the whole transaction as aborted by the operation at 'index'.
+  auto abort = [this, &response](const int index, const ResponseMessage::StatusCode status, 
+                                 const std::string& error_message) {
+    for (int i = 0; i < response.results_size(); i++) {
+      ResponseMessage* result = response.mutable_results(i);
+      if (i == index) {
+        __SetStatus(*result, status, [&] { return error_message; });
       } else {
-        response.set_success(false);
-        response.set_error_message("Type mismatch: Variable '" + prop_name + 
-                                  "' is double, but received non-double value");
+        __SetStatus(*result, ResponseMessage::ABORTED, [] { return "Transaction aborted"; });
+      }
+    }
+    __SetStatus(response, ResponseMessage::ABORTED, [&] { 
+      return "Transaction aborted at operation " + std::to_string(index) + ": " + error_message; 
+    });
+  };
+
+  // Resolves triggers first so that an unknown trigger aborts the transaction before anything is applied.
+  std::vector<TriggerWithCallback> trigger_callbacks(operation_count);
+  {
+    std::lock_guard<std::mutex> lock(triggers_mutex_);
+    for (int i = 0; i < operation_count; i++) {
+      const CommandMessage& operation = command.operations(i);
+      if (operation.command_type() != CommandMessage::EXECUTE_TRIGGER) continue;
+      auto it = triggers_.find(operation.trigger().name());
+      if (it == triggers_.end()) {
+        abort(i, ResponseMessage::NOT_FOUND, 
+              verbose_responses_ ? "Trigger not found: " + operation.trigger().name() : std::string());
         return;
       }
+      trigger_callbacks[i] = it->second;
     }
-    else if (std::holds_alternative<int>(value)) {
-      if (prop.value_case() == VariableMessage::kIntValue) {
-        int new_value = prop.int_value();
-        if (std::get<int>(value) != new_value) {
-          value = new_value;
-          changed = true;
+  }
+
+  // Operations are applied outside the lock to copies of the variables, which are committed all together
+  // only if none of the variables changed meanwhile. Otherwise they are applied again to the new values.
+  struct StagedVariable {
+    Value value; // Copied under the lock, except for a large value.
+    std::shared_ptr<const std::string> large_value; // Shared under the lock, and copied to value outside it.
+    uint64_t version = 0; // Version of the variable the operations are applied to.
+    VariableChangedCallback callback;
+    bool changed = false;
+    bool read_only = false; // After the commit.
+    std::shared_ptr<const std::string> committed_large_value; // Large value after the commit, or nullptr.
+  };
+  std::unordered_map<std::string, StagedVariable> staged;
+  std::vector<const std::string*> names(operation_count, nullptr); // Name of the variable of each operation.
+  std::vector<Value> values_after(operation_count); // Value of the variable after each operation.
+  std::vector<bool> operation_changed(operation_count, false);
+  std::vector<PendingResponse> watch_responses;
+  uint64_t version = 0;
+  for (;;) {
+    staged.clear();
+    {
+      std::lock_guard<std::mutex> lock(variables_mutex_);
+      for (int i = 0; i < operation_count; i++) {
+        const CommandMessage& operation = command.operations(i);
+        if (operation.command_type() == CommandMessage::EXECUTE_TRIGGER) continue;
+
+        if (operation.command_type() == CommandMessage::SET_VARIABLE && operation.has_variable()) {
+          names[i] = &operation.variable().name();
+        } else if (operation.command_type() == CommandMessage::ATOMIC_OPERATION && 
+                   operation.has_atomic_operation()) {
+          names[i] = &operation.atomic_operation().operand().name();
+        } else {
+          abort(i, ResponseMessage::NOT_ALLOWED, 
+                verbose_responses_ ? "Operation not allowed in transaction" : std::string());
+          return;
         }
-      } else {
-        response.set_success(false);
-        response.set_error_message("Type mismatch: Variable '" + prop_name + 
-                                  "' is int, but received non-int value");
+
+        const std::string& name = *names[i];
+        if (staged.count(name)) continue;
+        auto it = variables_.find(name);
+        if (it == variables_.end()) {
+          abort(i, ResponseMessage::NOT_FOUND, 
+                verbose_responses_ ? "Variable not found: " + name : std::string());
+          return;
+        }
+        if (it->second.read_only) {
+          abort(i, ResponseMessage::READ_ONLY, 
+                verbose_responses_ ? "Variable " + name + " is READ ONLY" : std::string());
+          return;
+        }
+        StagedVariable& variable = staged[name];
+        variable.value = it->second.value;
+        variable.large_value = it->second.large_value;
+        variable.version = it->second.version;
+        variable.callback = it->second.callback;
+      }
+    }
+
+    for (auto& p : staged) {
+      if (p.second.large_value) p.second.value = *p.second.large_value;
+    }
+    for (int i = 0; i < operation_count; i++) {
+      const CommandMessage& operation = command.operations(i);
+      if (operation.command_type() == CommandMessage::EXECUTE_TRIGGER) continue;
+
+      StagedVariable& variable = staged[*names[i]];
+      bool changed = false;
+      std::string error_message;
+      std::string* error_message_ptr = verbose_responses_ ? &error_message : nullptr;
+      const ResponseMessage::StatusCode status = operation.command_type() == CommandMessage::SET_VARIABLE ?
+          __AssignValue(*names[i], operation.variable(), variable.value, changed, error_message_ptr) :
+          __ApplyAtomicOperation(*names[i], operation.atomic_operation(), variable.value, 
+                                 variable.version, changed, error_message_ptr);
+      if (status != ResponseMessage::OK) {
+        abort(i, status, error_message);
         return;
       }
+      variable.changed |= changed;
+      operation_changed[i] = changed;
+      values_after[i] = variable.value;
     }
-    else if (std::holds_alternative<bool>(value)) {
-      if (prop.value_case() == VariableMessage::kBoolValue) {
-        bool new_value = prop.bool_value();
-        if (std::get<bool>(value) != new_value) {
-          value = new_value;
+
+    // Commit
+    std::lock_guard<std::mutex> lock(variables_mutex_);
+    bool current = true;
+    for (const auto& p : staged) {
+      auto it = variables_.find(p.first);
+      if (it == variables_.end() || it->second.version != p.second.version || 
+          it->second.large_value != p.second.large_value) {
+        current = false;
+        break;
+      }
+    }
+    if (!current) continue;
+
+    for (auto& p : staged) {
+      PropertyWithCallback& property = variables_[p.first];
+      if (p.second.changed) {
+        std::shared_ptr<const std::string> large_value = __MakeLargeValue(p.second.value);
+        __StoreValue(property, std::move(p.second.value), std::move(large_value));
+        property.version = ++version_;
+        __CollectWatches(p.first, watch_responses);
+        __ReplicateVariable(p.first, property);
+      }
+      p.second.version = property.version;
+      p.second.read_only = property.read_only;
+      // Registers the committed large value, which the results reference.
+      p.second.committed_large_value = __GetLargeValue(property);
+    }
+    version = version_;
+    break;
+  }
+
+  // Results are built after the commit. A large value after an operation is returned as a reference to
+  // the value of the variable after the transaction, since only that one is readable on the bulk channel.
+  for (int i = 0; i < operation_count; i++) {
+    if (!names[i]) continue;
+    const StagedVariable& staged_variable = staged[*names[i]];
+    VariableMessage* variable = response.mutable_results(i)->mutable_variable();
+    variable->set_name(*names[i]);
+    variable->set_read_only(staged_variable.read_only);
+    variable->set_version(staged_variable.version);
+    const std::string* string_value = std::get_if<std::string>(&values_after[i]);
+    if (staged_variable.committed_large_value && string_value && __IsLargeValue(*string_value)) {
+      LargeValueMessage* reference = variable->mutable_large_value();
+      reference->set_id(staged_variable.version);
+      reference->set_size(staged_variable.committed_large_value->size());
+      reference->set_epoch(epoch_);
+    } else {
+      __SetValueToVariableMessage(variable, values_after[i]);
+    }
+  }
+  response.set_version(version);
+
+  for (const auto& pending : watch_responses) {
+    __SendResponse(pending.requester, pending.response);
+  }
+
+  // Callbacks run after commit, in the order of operations.
+  response.set_success(true);
+  for (int i = 0; i < operation_count; i++) {
+    ResponseMessage* result = response.mutable_results(i);
+    result->set_success(true);
+    const CommandMessage& operation = command.operations(i);
+    if (operation.command_type() == CommandMessage::EXECUTE_TRIGGER) {
+      __InvokeTriggerCallback(trigger_callbacks[i], operation.trigger(), *result);
+    } else if (operation_changed[i] && staged[*names[i]].callback) {
+      __InvokeVariableCallback(staged[*names[i]].callback, values_after[i], *result);
+    }
+    if (!result->success()) response.set_success(false);
+  }
+}
+
+void Server::__HandleBatch(const CommandMessage& command, ResponseMessage& response) {
+  // Unlike TRANSACTION, each operation is applied independently.
+  response.set_success(true);
+  for (const auto& operation : command.operations()) {
+    switch (operation.command_type()) {
+      case CommandMessage::SET_VARIABLE:
+      case CommandMessage::ATOMIC_OPERATION:
+      case CommandMessage::EXECUTE_TRIGGER:
+        *response.add_results() = __HandleCommand(operation);
+        break;
+      default: {
+        ResponseMessage* result = response.add_results();
+        result->set_command_id(operation.command_id());
+        __SetStatus(*result, ResponseMessage::NOT_ALLOWED, [] { return "Operation not allowed in batch"; });
+        break;
+      }
+    }
+  }
+}
+
+ResponseMessage::StatusCode Server::__AssignValue(const std::string& name, 
+                           const VariableMessage& prop, 
+                           Value& value, 
+                           bool& changed, 
+                           std::string* error_message) {
+  if (std::holds_alternative<double>(value)) {
+    if (prop.value_case() == VariableMessage::kDoubleValue) {
+      double new_value = prop.double_value();
+      if (std::get<double>(value) != new_value) {
+        value = new_value;
+        changed = true;
+      }
+    } else {
+      if (error_message) *error_message = "Type mismatch: Variable '" + name + 
+                      "' is double, but received non-double value";
+      return ResponseMessage::TYPE_MISMATCH;
+    }
+  }
+  else if (std::holds_alternative<int>(value)) {
+    if (prop.value_case() == VariableMessage::kIntValue) {
+      int new_value = prop.int_value();
+      if (std::get<int>(value) != new_value) {
+        value = new_value;
+        changed = true;
+      }
+    } else {
+      if (error_message) *error_message = "Type mismatch: Variable '" + name + 
+                      "' is int, but received non-int value";
+      return ResponseMessage::TYPE_MISMATCH;
+    }
+  }
+  else if (std::holds_alternative<bool>(value)) {
+    if (prop.value_case() == VariableMessage::kBoolValue) {
+      bool new_value = prop.bool_value();
+      if (std::get<bool>(value) != new_value) {
+        value = new_value;
+        changed = true;
+      }
+    } else {
+      if (error_message) *error_message = "Type mismatch: Variable '" + name + 
+                      "' is boolean, but received non-boolean value";
+      return ResponseMessage::TYPE_MISMATCH;
+    }
+  } 
+  else if (std::holds_alternative<std::string>(value)) {
+    if (prop.value_case() == VariableMessage::kStringValue) {
+      const std::string& new_value = prop.string_value();
+      if (std::get<std::string>(value) != new_value) {
+        value = new_value;
+        changed = true;
+      }
+    } else {
+      if (error_message) *error_message = "Type mismatch: Variable '" + name + 
+                      "' is string, but received non-string value";
+      return ResponseMessage::TYPE_MISMATCH;
+    }
+  }
+  return ResponseMessage::OK;
+}
+
+ResponseMessage::StatusCode Server::__ApplyAtomicOperation(const std::string& name, 
+                                    const AtomicOperationMessage& operation, 
+                                    Value& value, 
+                                    const uint64_t version, 
+                                    bool& changed, 
+                                    std::string* error_message) {
+  const VariableMessage& operand = operation.operand();
+  switch (operation.operation_type()) {
+    case AtomicOperationMessage::COMPARE_AND_SET_VALUE: {
+      Value expected;
+      switch (operation.expected().value_case()) {
+        case VariableMessage::kDoubleValue: expected = operation.expected().double_value(); break;
+        case VariableMessage::kIntValue: expected = operation.expected().int_value(); break;
+        case VariableMessage::kBoolValue: expected = operation.expected().bool_value(); break;
+        case VariableMessage::kStringValue: expected = operation.expected().string_value(); break;
+        default:
+          if (error_message) *error_message = "Expected value not specified";
+          return ResponseMessage::NOT_SPECIFIED;
+      }
+      if (expected.index() != value.index()) {
+        if (error_message) *error_message = "Type mismatch: Expected value of '" + name + "' has different type";
+        return ResponseMessage::TYPE_MISMATCH;
+      }
+      if (expected != value) {
+        if (error_message) *error_message = "Compare failed: Variable '" + name + "' has different value";
+        return ResponseMessage::COMPARE_FAILED;
+      }
+      return __AssignValue(name, operand, value, changed, error_message);
+    }
+    case AtomicOperationMessage::COMPARE_AND_SET_VERSION: {
+      if (operation.expected_version() != version) {
+        if (error_message) *error_message = "Compare failed: Variable '" + name + "' has different version";
+        return ResponseMessage::COMPARE_FAILED;
+      }
+      return __AssignValue(name, operand, value, changed, error_message);
+    }
+    case AtomicOperationMessage::ADD: {
+      if (std::holds_alternative<int>(value) && operand.value_case() == VariableMessage::kIntValue) {
+        if (operand.int_value() != 0) {
+          value = std::get<int>(value) + operand.int_value();
           changed = true;
         }
-      } else {
-        response.set_success(false);
-        response.set_error_message("Type mismatch: Variable '" + prop_name + 
-                                  "' is boolean, but received non-boolean value");
-        return;
+        return ResponseMessage::OK;
       }
-    } 
-    else if (std::holds_alternative<std::string>(value)) {
-      if (prop.value_case() == VariableMessage::kStringValue) {
-        std::string new_value = prop.string_value();
-        if (std::get<std::string>(value) != new_value) {
-          value = new_value;
+      if (std::holds_alternative<double>(value) && 
+          (operand.value_case() == VariableMessage::kDoubleValue || 
+           operand.value_case() == VariableMessage::kIntValue)) {
+        const double delta = operand.value_case() == VariableMessage::kDoubleValue ? 
+                             operand.double_value() : static_cast<double>(operand.int_value());
+        if (delta != 0.0) {
+          value = std::get<double>(value) + delta;
           changed = true;
         }
-      } else {
-        response.set_success(false);
-        response.set_error_message("Type mismatch: Variable '" + prop_name + 
-                                  "' is string, but received non-string value");
-        return;
+        return ResponseMessage::OK;
       }
+      if (error_message) *error_message = "Type mismatch: Variable '" + name + "' cannot be added by the operand";
+      return ResponseMessage::TYPE_MISMATCH;
+    }
+    case AtomicOperationMessage::TOGGLE: {
+      if (!std::holds_alternative<bool>(value)) {
+        if (error_message) *error_message = "Type mismatch: Variable '" + name + "' is not boolean";
+        return ResponseMessage::TYPE_MISMATCH;
+      }
+      value = !std::get<bool>(value);
+      changed = true;
+      return ResponseMessage::OK;
+    }
+    case AtomicOperationMessage::APPEND: {
+      if (!std::holds_alternative<std::string>(value) || 
+          operand.value_case() != VariableMessage::kStringValue) {
+        if (error_message) *error_message = "Type mismatch: Variable '" + name + "' is string, but received non-string value";
+        return ResponseMessage::TYPE_MISMATCH;
+      }
+      if (!operand.string_value().empty()) {
+        std::get<std::string>(value).append(operand.string_value());
+        changed = true;
+      }
+      return ResponseMessage::OK;
+    }
+    default:
+      if (error_message) *error_message = "Unknown atomic operation";
+      return ResponseMessage::UNKNOWN_COMMAND;
+  }
+}
+
+bool Server::__InvokeVariableCallback(const VariableChangedCallback& callback, 
+                                      const Value& value, 
+                                      ResponseMessage& response) const {
+  try {
+    callback(value);
+  } catch (const std::exception& e) {
+    PROPLINK_LOG_ERROR("Exception in SetVariable: " << e.what());
+    __SetStatus(response, ResponseMessage::CALLBACK_EXCEPTION, 
+                [] { return "Exception occured in server-side callback"; });
+    return false;
+  } catch (...) {
+    PROPLINK_LOG_ERROR("Unknown exception in SetVariable");
+    __SetStatus(response, ResponseMessage::CALLBACK_EXCEPTION, 
+                [] { return "Exception occured in server-side callback"; });
+    return false;
+  }
+  return true;
+}
+
+void Server::__HandleGetAllVariables(const CommandMessage& command, ResponseMessage& response) {
+  __RefreshProvidedVariables();
+  std::lock_guard<std::mutex> lock(variables_mutex_);
+  response.set_success(true);
+  // The client knows the names and read_only flags of the IDs if its schema is current.
+  bool compact = false;
+  if (command.schema_hash() != 0) {
+    const uint64_t schema_hash = __GetSchemaHash();
+    response.mutable_schema()->set_hash(schema_hash);
+    compact = command.schema_hash() == schema_hash;
+  }
+  for (const auto& it : variables_) {
+    VariableMessage* variable = response.add_variables();
+    if (compact) {
+      variable->set_id(it.second.id);
+      variable->set_version(it.second.version);
+      __SetPropertyValueToVariableMessage(variable, it.second);
+    } else {
+      __FillVariableMessage(variable, it.first, it.second);
     }
+    if (it.second.reader) __SetValueToVariableMessage(variable, it.second.reader());
+  }
+  response.set_version(version_);
+}
 
-    value_cpy = value;
+void Server::__HandleGetVariables(const CommandMessage& command, ResponseMessage& response) {
+  for (const auto& name : command.variable_names()) {
+    __RefreshProvidedVariable(name);
   }
 
-  if (changed && callback) {
-    try {
-      callback(value_cpy);
-    } catch (const std::bad_variant_access& e) {
-      std::cerr << "Exception in SetVariable: " << e.what() << std::endl;
-      response.set_success(false);
-      response.set_error_message("Exception occured in server-side callback");
-      return;
-    } catch (const std::exception& e) {
-      std::cerr << "Exception in SetVariable: " << e.what() << std::endl;
-      response.set_success(false);
-      response.set_error_message("Exception occured in server-side callback");
-      return;
+  struct Snapshot {
+    Value value;
+    std::shared_ptr<const std::string> large_value; // Set instead of value if it is large.
+    bool read_only;
+    uint64_t version;
+  };
+  std::vector<Snapshot> snapshots;
+  snapshots.reserve(command.variable_names_size());
+  uint64_t version;
+  {
+    std::lock_guard<std::mutex> lock(variables_mutex_);
+    for (const auto& name : command.variable_names()) {
+      auto it = variables_.find(name);
+      if (it == variables_.end()) {
+        __SetStatus(response, ResponseMessage::NOT_FOUND, [&] { return "Variable not found: " + name; });
+        return;
+      }
+      const PropertyWithCallback& property = it->second;
+      std::shared_ptr<const std::string> large_value = __GetLargeValue(property);
+      snapshots.push_back({ property.reader ? property.reader() : (large_value ? Value() : property.value), 
+                            std::move(large_value), property.read_only, property.version });
     }
+    version = version_;
   }
 
   response.set_success(true);
-  response.set_message("Variable updated: " + prop_name);
+  for (int i = 0; i < command.variable_names_size(); i++) {
+    VariableMessage* variable = response.add_variables();
+    variable->set_name(command.variable_names(i));
+    variable->set_read_only(snapshots[i].read_only);
+    variable->set_version(snapshots[i].version);
+    if (snapshots[i].large_value) {
+      // The ID of a large value is the version of the variable.
+      variable->mutable_large_value()->set_id(snapshots[i].version);
+      variable->mutable_large_value()->set_size(snapshots[i].large_value->size());
+      variable->mutable_large_value()->set_epoch(epoch_);
+    } else {
+      __SetValueToVariableMessage(variable, snapshots[i].value);
+    }
+  }
+  response.set_version(version);
 }
 
-void Server::__HandleGetAllVariables(const CommandMessage& command, ResponseMessage& response) {
+void Server::__HandleDescribe(const CommandMessage& command, ResponseMessage& response) {
   std::lock_guard<std::mutex> lock(variables_mutex_);
   response.set_success(true);
+  const uint64_t schema_hash = __GetSchemaHash();
+  SchemaMessage* schema = response.mutable_schema();
+  schema->set_hash(schema_hash);
+  if (command.schema_hash() == schema_hash) return; // The cached schema is current.
   for (const auto& it : variables_) {
-    VariableMessage* prop = response.add_variables();
-    prop->set_name(it.first);
-    prop->set_read_only(it.second.read_only);
-    const Value& value = it.second.value;
-    if (std::holds_alternative<double>(value)) {
-      prop->set_double_value(std::get<double>(value));
-    } else if (std::holds_alternative<int>(value)) {
-      prop->set_int_value(std::get<int>(value));
-    } else if (std::holds_alternative<bool>(value)) {
-      prop->set_bool_value(std::get<bool>(value));
-    } else {
-      prop->set_string_value(std::get<std::string>(value));
+    __FillSchemaMessage(schema->add_variables(), it.first, it.second);
+  }
+}
+
+void Server::__FillSchemaMessage(VariableSchemaMessage* schema, const std::string& name, 
+                                 const PropertyWithCallback& property) {
+  schema->set_name(name);
+  schema->set_type(static_cast<VariableSchemaMessage::ValueType>(property.value.index()));
+  schema->set_read_only(property.read_only);
+  schema->set_id(property.id);
+  schema->set_units(property.metadata.units);
+  schema->set_has_range(property.metadata.has_range);
+  if (property.metadata.has_range) {
+    schema->set_minimum(property.metadata.minimum);
+    schema->set_maximum(property.metadata.maximum);
+  }
+}
+
+void Server::__AssignVariableId(const std::string& name, PropertyWithCallback& property) {
+  if (property.id != 0) return;
+  // FNV-1a
+  uint32_t id = 2166136261u;
+  for (const unsigned char c : name) {
+    id = (id ^ c) * 16777619u;
+  }
+  while (true) {
+    if (id == 0) id = 1; // 0 means no ID on the wire.
+    auto inserted = variable_ids_.emplace(id, name);
+    if (inserted.second || inserted.first->second == name) break;
+    id++;
+  }
+  property.id = id;
+}
+
+uint64_t Server::__GetSchemaHash() {
+  if (schema_hash_generation_ == schema_generation_) return schema_hash_;
+  // Sum of the hashes of the variables, so that it doesn't depend on the order of variables_.
+  uint64_t schema_hash = 0;
+  VariableSchemaMessage schema;
+  std::string bytes;
+  for (const auto& it : variables_) {
+    schema.Clear();
+    __FillSchemaMessage(&schema, it.first, it.second);
+    schema.SerializeToString(&bytes);
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ull;
+    for (const unsigned char c : bytes) {
+      hash = (hash ^ c) * 1099511628211ull;
+    }
+    schema_hash += hash;
+  }
+  schema_hash_ = schema_hash != 0 ? schema_hash : 1; // 0 means no cached schema.
+  schema_hash_generation_ = schema_generation_;
+  return schema_hash_;
+}
+
+void Server::__ResolveVariableIds(CommandMessage& command, std::unique_lock<std::mutex>& lock) {
+  auto resolve = [this, &lock](VariableMessage* variable) {
+    if (variable->id() == 0 || !variable->name().empty()) return;
+    if (!lock.owns_lock()) lock.lock();
+    auto it = variable_ids_.find(variable->id());
+    // An unknown ID leaves the name empty, which is not found.
+    if (it != variable_ids_.end()) variable->set_name(it->second);
+  };
+  if (command.has_variable()) {
+    resolve(command.mutable_variable());
+    if (command.command_type() == CommandMessage::GET_VARIABLE && command.variable_name().empty()) {
+      command.set_variable_name(command.variable().name());
+    }
+  }
+  if (command.has_atomic_operation()) resolve(command.mutable_atomic_operation()->mutable_operand());
+  if (command.variable_ids_size() > 0) {
+    if (!lock.owns_lock()) lock.lock();
+    for (const uint32_t id : command.variable_ids()) {
+      auto it = variable_ids_.find(id);
+      // An unknown ID is an empty name, which is not found.
+      command.add_variable_names(it != variable_ids_.end() ? it->second : std::string());
     }
+    command.clear_variable_ids();
+  }
+  for (auto& operation : *command.mutable_operations()) {
+    __ResolveVariableIds(operation, lock);
   }
 }
 
@@ -463,31 +2319,75 @@ void Server::__HandleGetAllTriggers(const CommandMessage& command, ResponseMessa
 
 void Server::__HandleExecuteTrigger(const CommandMessage& command, ResponseMessage& response) {
   if (!command.has_trigger()) {
-    response.set_success(false);
-    response.set_error_message("Trigger name not specified");
+    __SetStatus(response, ResponseMessage::NOT_SPECIFIED, [] { return "Trigger name not specified"; });
     return;
   }
-  std::string trigger_name = command.trigger().name();
-  bool success = __ExecuteTrigger(trigger_name);
-  response.set_success(success);
-  if (success) {
-    response.set_message("Trigger executed: " + trigger_name);
-  } else {
-    response.set_error_message("Failed to execute trigger: " + trigger_name);
+  const std::string& trigger_name = command.trigger().name();
+  if (__ExecuteTrigger(command.trigger(), response)) {
+    __SetStatus(response, ResponseMessage::OK, [&] { return "Trigger executed: " + trigger_name; });
+  } else if (response.status() == ResponseMessage::OK) {
+    __SetStatus(response, ResponseMessage::NOT_FOUND, [&] { return "Trigger not found: " + trigger_name; });
   }
 }
 
-bool Server::__ExecuteTrigger(const std::string& trigger_name) {
-  std::function<void()> callback;
-  int options;
+bool Server::__ExecuteTrigger(const TriggerMessage& trigger, ResponseMessage& response) {
+  TriggerWithCallback callback;
   {
     std::lock_guard<std::mutex> lock(triggers_mutex_);
-    auto it = triggers_.find(trigger_name);
+    auto it = triggers_.find(trigger.name());
     if (it == triggers_.end()) return false;
-    callback = it->second.callback;
+    callback = it->second;
+  }
+  return __InvokeTriggerCallback(callback, trigger, response);
+}
+
+bool Server::__InvokeTriggerCallback(const TriggerWithCallback& callback, 
+                                     const TriggerMessage& trigger, 
+                                     ResponseMessage& response) const {
+  try {
+    if (callback.callback_with_arguments) {
+      std::vector<Value> arguments;
+      arguments.reserve(trigger.arguments_size());
+      for (const auto& argument : trigger.arguments()) {
+        arguments.push_back(__ExtractValue(argument));
+      }
+      std::vector<Value> results = callback.callback_with_arguments(arguments);
+      for (const auto& result : results) {
+        __SetValueToVariableMessage(response.add_trigger_results(), result);
+      }
+    } else if (callback.callback) {
+      callback.callback();
+    }
+  } catch (const std::exception& e) {
+    PROPLINK_LOG_ERROR("Exception in trigger '" << trigger.name() << "': " << e.what());
+    response.clear_trigger_results();
+    __SetStatus(response, ResponseMessage::CALLBACK_EXCEPTION, 
+                [] { return "Exception occured in server-side callback"; });
+    return false;
+  } catch (...) {
+    // Anything else thrown must not escape the task, or the requester would never get a response.
+    PROPLINK_LOG_ERROR("Unknown exception in trigger '" << trigger.name() << "'");
+    response.clear_trigger_results();
+    __SetStatus(response, ResponseMessage::CALLBACK_EXCEPTION, 
+                [] { return "Exception occured in server-side callback"; });
+    return false;
   }
-  callback();
   return true;
 }
 
+Value Server::__ExtractValue(const VariableMessage& variable) {
+  switch (variable.value_case()) {
+  case VariableMessage::kStringValue: 
+    return variable.string_value();
+  case VariableMessage::kDoubleValue: 
+    return variable.double_value();
+  case VariableMessage::kIntValue: 
+    return variable.int_value();
+  case VariableMessage::kBoolValue: 
+    return variable.bool_value();
+  default:
+    return Value{};
+  }
+}
+
 }
\ No newline at end of file